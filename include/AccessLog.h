@@ -0,0 +1,313 @@
+#ifndef TINY_HTTP_SERVER_ACCESS_LOG_H
+#define TINY_HTTP_SERVER_ACCESS_LOG_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <boost/asio/ip/tcp.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "Common.h"
+#include "Metrics.h"
+
+/// Single-producer single-consumer ring of trivially copyable elements.
+/// Capacity must be a power of two; one slot is never wasted since indices grow unbounded.
+template <typename T, std::size_t Capacity>
+class SpscRing {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+    static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+    /// Producer side, fails instead of blocking when the ring is full.
+    bool tryPush(const T& value) noexcept {
+        auto tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _cachedHead == Capacity) {
+            _cachedHead = _head.load(std::memory_order_acquire);
+            if (tail - _cachedHead == Capacity) return false;
+        }
+        _slots[tail & (Capacity - 1)] = value;
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Consumer side.
+    bool tryPop(T& value) noexcept {
+        auto head = _head.load(std::memory_order_relaxed);
+        if (head == _tail.load(std::memory_order_acquire)) return false;
+        value = _slots[head & (Capacity - 1)];
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    alignas(64) std::atomic<std::size_t> _head{0};
+    alignas(64) std::atomic<std::size_t> _tail{0};
+    std::size_t _cachedHead = 0;
+    alignas(64) std::array<T, Capacity> _slots;
+};
+
+/// Fixed-size binary log entry, formatted into text by the writer thread only.
+struct AccessRecord {
+    enum Kind : std::uint8_t { access, error };
+
+    static constexpr std::size_t kMaxUri = 96;
+    static constexpr std::size_t kMaxMethod = 8;
+
+    std::int64_t timestampMicros;
+    std::uint64_t durationMicros;
+    std::uint64_t bytesSent;
+    const std::error_category* errorCategory;
+    int errorValue;
+    std::uint16_t status;
+    std::uint16_t port;
+    Kind kind;
+    bool v6;
+    std::uint8_t methodLength;
+    std::uint8_t uriLength;
+    std::array<unsigned char, 16> address;
+    std::array<char, kMaxMethod> method;
+    std::array<char, kMaxUri> uri;
+
+    void setRemote(const boost::asio::ip::tcp::endpoint& remote) noexcept {
+        auto addr = remote.address();
+        v6 = addr.is_v6();
+        if (v6) {
+            address = addr.to_v6().to_bytes();
+        } else {
+            auto bytes = addr.to_v4().to_bytes();
+            std::copy(bytes.begin(), bytes.end(), address.begin());
+        }
+        port = remote.port();
+    }
+};
+
+struct AccessLogOptions {
+    /// Sample 1 of every 'every' requests whose URI starts with 'prefix'.
+    struct SamplingRule {
+        std::string prefix;
+        std::uint32_t every = 1;
+    };
+
+    std::string path;
+    /// The file is rotated to '<path>.1' once it grows over this size.
+    std::size_t maxFileBytes = 64 << 20;
+    /// Number of rotated files kept besides the active one.
+    std::size_t maxFiles = 4;
+    std::vector<SamplingRule> sampling;
+};
+
+/// Asynchronous access log.
+/// Request threads append fixed-size records to their own SPSC ring and never block: a record is
+/// dropped (and counted) when the ring is full. A background thread drains the rings, formats the
+/// records and writes them in batches, rotating the file by size.
+class AccessLog {
+    static constexpr std::size_t kRingCapacity = 1024;
+    static constexpr std::size_t kMaxSamplingRules = 8;
+    using Ring = SpscRing<AccessRecord, kRingCapacity>;
+
+public:
+    static AccessLog& instance() {
+        static AccessLog log;
+        return log;
+    }
+
+    ~AccessLog() { stop(); }
+
+    /// Open the log file and launch the writer thread. Must be called before any request thread
+    /// logs, rules are not modified afterwards.
+    void start(AccessLogOptions options) {
+        logicAssert(!_running.load(), "Access log is already running");
+        logicAssert(options.sampling.size() <= kMaxSamplingRules, "Too many sampling rules");
+        for (const auto& rule : options.sampling) {
+            logicAssert(rule.every > 0, "Sampling rate must be positive");
+        }
+        _options = std::move(options);
+        _file = std::fopen(_options.path.c_str(), "a");
+        if (!_file) throw std::system_error(errno, std::generic_category(), _options.path);
+        _fileBytes = static_cast<std::size_t>(std::ftell(_file));
+        _running.store(true, std::memory_order_release);
+        _writer = std::thread([this] { writeLoop(); });
+    }
+
+    void stop() {
+        if (!_running.exchange(false)) return;
+        _writer.join();
+        std::fclose(_file);
+        _file = nullptr;
+    }
+
+    [[nodiscard]] bool enabled() const noexcept { return _running.load(std::memory_order_relaxed); }
+
+    /// Whether a request for 'uri' should be logged according to the sampling rules.
+    bool sample(std::string_view uri) noexcept {
+        thread_local std::array<std::uint32_t, kMaxSamplingRules> seen{};
+        for (std::size_t i = 0; i < _options.sampling.size(); ++i) {
+            const auto& rule = _options.sampling[i];
+            if (uri.starts_with(rule.prefix)) return seen[i]++ % rule.every == 0;
+        }
+        return true;
+    }
+
+    void logAccess(const boost::asio::ip::tcp::endpoint& remote, std::string_view method,
+                   std::string_view uri, int status, std::size_t bytesSent,
+                   std::chrono::microseconds duration) noexcept {
+        if (!enabled() || !sample(uri)) return;
+        AccessRecord record{};
+        record.kind = AccessRecord::access;
+        record.timestampMicros = now();
+        record.durationMicros = static_cast<std::uint64_t>(duration.count());
+        record.bytesSent = bytesSent;
+        record.status = static_cast<std::uint16_t>(status);
+        record.setRemote(remote);
+        record.methodLength = static_cast<std::uint8_t>(copyTruncated(record.method, method));
+        record.uriLength = static_cast<std::uint8_t>(copyTruncated(record.uri, uri));
+        push(record);
+    }
+
+    /// Log an error, 'remote' may be null when there is no peer (e.g. accept failures).
+    void logError(const boost::asio::ip::tcp::endpoint* remote, std::error_code ec,
+                  std::string_view what) noexcept {
+        if (!enabled()) return;
+        AccessRecord record{};
+        record.kind = AccessRecord::error;
+        record.timestampMicros = now();
+        record.errorCategory = &ec.category();
+        record.errorValue = ec.value();
+        if (remote) record.setRemote(*remote);
+        record.uriLength = static_cast<std::uint8_t>(copyTruncated(record.uri, what));
+        push(record);
+    }
+
+private:
+    AccessLog() = default;
+
+    static std::int64_t now() noexcept {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    template <std::size_t N>
+    static std::size_t copyTruncated(std::array<char, N>& dst, std::string_view src) noexcept {
+        std::size_t n = std::min(N, src.size());
+        std::memcpy(dst.data(), src.data(), n);
+        return n;
+    }
+
+    void push(const AccessRecord& record) noexcept {
+        thread_local Ring& ring = registerRing();
+        if (!ring.tryPush(record)) Metrics::local().accessLogDrops.add();
+    }
+
+    Ring& registerRing() {
+        std::lock_guard lock(_mutex);
+        _rings.push_back(std::make_unique<Ring>());
+        return *_rings.back();
+    }
+
+    void writeLoop() {
+        std::string batch;
+        batch.reserve(64 << 10);
+        while (true) {
+            bool running = _running.load(std::memory_order_acquire);
+            {
+                std::lock_guard lock(_mutex);
+                AccessRecord record;
+                for (auto& ring : _rings) {
+                    while (ring->tryPop(record)) format(batch, record);
+                }
+            }
+            if (!batch.empty()) {
+                write(batch);
+                batch.clear();
+            } else if (running) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            if (!running) break;
+        }
+    }
+
+    static void format(std::string& out, const AccessRecord& r) {
+        char buf[256];
+        std::time_t seconds = r.timestampMicros / 1000000;
+        std::tm tm{};
+        gmtime_r(&seconds, &tm);
+        std::size_t n = std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+        int m = std::snprintf(buf + n, sizeof(buf) - n, ".%06dZ ",
+                              static_cast<int>(r.timestampMicros % 1000000));
+        out.append(buf, n + static_cast<std::size_t>(m));
+
+        if (r.kind == AccessRecord::access || r.port != 0) {
+            char addr[64];
+            if (r.v6) {
+                boost::asio::ip::address_v6::bytes_type bytes;
+                std::copy(r.address.begin(), r.address.end(), bytes.begin());
+                std::snprintf(addr, sizeof(addr), "[%s]:%u",
+                              boost::asio::ip::address_v6(bytes).to_string().c_str(), r.port);
+            } else {
+                std::snprintf(addr, sizeof(addr), "%u.%u.%u.%u:%u", r.address[0], r.address[1],
+                              r.address[2], r.address[3], r.port);
+            }
+            out.append(addr);
+        } else {
+            out.append("-");
+        }
+
+        if (r.kind == AccessRecord::access) {
+            out.append(" \"").append(r.method.data(), r.methodLength).append(" ");
+            out.append(r.uri.data(), r.uriLength).append("\" ");
+            std::snprintf(buf, sizeof(buf), "%u %llu %lluus\n", r.status,
+                          static_cast<unsigned long long>(r.bytesSent),
+                          static_cast<unsigned long long>(r.durationMicros));
+            out.append(buf);
+        } else {
+            out.append(" error: ").append(r.uri.data(), r.uriLength).append(": ");
+            out.append(r.errorCategory->message(r.errorValue)).append("\n");
+        }
+    }
+
+    void write(const std::string& batch) {
+        if (!_file) return;
+        std::fwrite(batch.data(), 1, batch.size(), _file);
+        std::fflush(_file);
+        _fileBytes += batch.size();
+        if (_fileBytes >= _options.maxFileBytes) rotate();
+    }
+
+    void rotate() {
+        std::fclose(_file);
+        const auto& path = _options.path;
+        for (std::size_t i = _options.maxFiles; i > 1; --i) {
+            std::rename((path + "." + std::to_string(i - 1)).c_str(),
+                        (path + "." + std::to_string(i)).c_str());
+        }
+        if (_options.maxFiles > 0) {
+            std::rename(path.c_str(), (path + ".1").c_str());
+        } else {
+            std::remove(path.c_str());
+        }
+        _file = std::fopen(path.c_str(), "a");
+        _fileBytes = 0;
+    }
+
+private:
+    AccessLogOptions _options;
+    std::FILE* _file = nullptr;
+    std::size_t _fileBytes = 0;
+    std::atomic<bool> _running{false};
+    std::thread _writer;
+    std::mutex _mutex;
+    std::vector<std::unique_ptr<Ring>> _rings;
+};
+
+#endif  // TINY_HTTP_SERVER_ACCESS_LOG_H
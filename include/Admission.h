@@ -0,0 +1,208 @@
+#ifndef TINY_HTTP_SERVER_ADMISSION_H
+#define TINY_HTTP_SERVER_ADMISSION_H
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "HttpResponse.h"
+#include "Metrics.h"
+
+struct AdmissionOptions {
+    /// Open connections beyond which new ones are shed. Unlimited while 0.
+    std::size_t maxConnections = 0;
+    /// Requests served at once beyond which new ones are answered with 503. Unlimited while 0.
+    std::size_t maxInFlightRequests = 0;
+    /// At the connection cap, leave new connections in the listen backlog instead of answering
+    /// them with 503. Connections accepted in the same batch beyond the cap still get the 503.
+    bool pauseAccepting = false;
+    /// Retry-After of the 503 sent to shed connections and requests.
+    std::chrono::seconds retryAfter = std::chrono::seconds(1);
+    /// CoDel shedding: requests are shed while the time between accepting or reading them and
+    /// starting their handler stays above this for 'queueDelayInterval'. Disabled while 0.
+    std::chrono::microseconds queueDelayTarget{0};
+    std::chrono::milliseconds queueDelayInterval = std::chrono::milliseconds(100);
+};
+
+/// Process-wide admission control, keeping memory and latency bounded under traffic spikes.
+/// Connections are admitted by the accepting thread, requests by the io thread serving them;
+/// both are counted in per-thread slots that are summed up for every decision, so the limits
+/// hold within one request per io thread without threads contending on a shared counter.
+class Admission {
+    using Clock = std::chrono::steady_clock;
+
+public:
+    static Admission& instance() {
+        static Admission admission;
+        return admission;
+    }
+
+    void setOptions(const AdmissionOptions& options) {
+        _options = options;
+        Response response(StatusType::service_unavailable);
+        response.addHeader("Retry-After", std::to_string(options.retryAfter.count()));
+        response.addHeader("Connection", "close");
+        _overloaded.clear();
+        for (const auto& buffer : response.toBuffers()) {
+            _overloaded.append(static_cast<const char*>(buffer.data()), buffer.size());
+        }
+    }
+
+    [[nodiscard]] const AdmissionOptions& options() const noexcept { return _options; }
+
+    /// The pre-serialized 503 of shed requests, closing the connection.
+    [[nodiscard]] std::string_view overloadedResponse() const noexcept { return _overloaded; }
+
+    [[nodiscard]] bool atConnectionCap() const noexcept {
+        return _options.maxConnections != 0 &&
+               _connections.sum() >= static_cast<std::int64_t>(_options.maxConnections);
+    }
+
+    /// Count a new connection unless the cap is reached. Called by the accepting thread.
+    bool tryAcquireConnection() noexcept {
+        if (atConnectionCap()) return false;
+        _connections.add(1);
+        return true;
+    }
+
+    void releaseConnection() noexcept { _connections.add(-1); }
+
+    /// Answer a connection shed at the cap and close it, without ever blocking.
+    void rejectConnection(int fd) const noexcept {
+        Metrics::local().connectionsShed.add();
+        // Closing with unread data makes the kernel reset the connection, which may discard the
+        // 503 before the client read it.
+        char discard[4096];
+        for (int i = 0; i < 4 && ::recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0; ++i) {
+        }
+        [[maybe_unused]] auto n =
+            ::send(fd, _overloaded.data(), _overloaded.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        ::shutdown(fd, SHUT_WR);
+        ::close(fd);
+    }
+
+    /// Admit a request whose handler is about to start after waiting since 'queuedSince'.
+    /// Admitted requests are released with releaseRequest once their response is written.
+    bool tryAcquireRequest(Clock::time_point queuedSince) noexcept {
+        if (_options.queueDelayTarget.count() > 0) {
+            thread_local QueueDelayShedder shedder;
+            auto now = Clock::now();
+            if (shedder.shouldShed(now - queuedSince, now, _options)) {
+                Metrics::local().requestsShedQueueDelay.add();
+                return false;
+            }
+        }
+        if (_options.maxInFlightRequests != 0 &&
+            _requests.sum() >= static_cast<std::int64_t>(_options.maxInFlightRequests)) {
+            Metrics::local().requestsShed.add();
+            return false;
+        }
+        _requests.add(1);
+        return true;
+    }
+
+    void releaseRequest() noexcept { _requests.add(-1); }
+
+private:
+    /// A count split into per-thread slots on their own cache lines. Threads only ever touch
+    /// their own slot, the total is the sum over the slots in use.
+    class ShardedCount {
+    public:
+        void add(std::int64_t n) noexcept {
+            _slots[threadSlot()].value.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        [[nodiscard]] std::int64_t sum() const noexcept {
+            std::int64_t total = 0;
+            auto used = std::min(_threadCount.load(std::memory_order_relaxed), kSlots);
+            for (std::size_t i = 0; i < used; ++i) {
+                total += _slots[i].value.load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+    private:
+        static constexpr std::size_t kSlots = 64;
+
+        struct alignas(64) Slot {
+            std::atomic<std::int64_t> value{0};
+        };
+
+        /// Slots are shared round-robin beyond kSlots threads, hence fetch_add above.
+        static std::size_t threadSlot() noexcept {
+            thread_local std::size_t slot =
+                _threadCount.fetch_add(1, std::memory_order_relaxed) % kSlots;
+            return slot;
+        }
+
+        static inline std::atomic<std::size_t> _threadCount{0};
+        std::array<Slot, kSlots> _slots;
+    };
+
+    /// CoDel (Nichols and Jacobson, "Controlling Queue Delay") over the delay requests see
+    /// before their handler starts. Shedding begins once the delay stayed above the target for
+    /// a whole interval, and then sheds at a rate growing with the square root of the number
+    /// of requests shed, until the delay is back under the target. State is per io thread.
+    class QueueDelayShedder {
+    public:
+        bool shouldShed(Clock::duration delay, Clock::time_point now,
+                        const AdmissionOptions& options) noexcept {
+            bool aboveTarget = false;
+            if (delay < options.queueDelayTarget) {
+                _firstAboveTime = {};
+            } else if (_firstAboveTime == Clock::time_point{}) {
+                _firstAboveTime = now + options.queueDelayInterval;
+            } else {
+                aboveTarget = now >= _firstAboveTime;
+            }
+
+            if (_dropping) {
+                if (!aboveTarget) {
+                    _dropping = false;
+                    return false;
+                }
+                if (now < _dropNext) return false;
+                ++_count;
+                _dropNext = controlLaw(_dropNext, options);
+                return true;
+            }
+            if (!aboveTarget) return false;
+            _dropping = true;
+            // Resume near the previous rate when the last dropping phase ended only recently.
+            bool recent = now - _dropNext < 16 * options.queueDelayInterval;
+            _count = recent && _count > 2 ? _count - 2 : 1;
+            _dropNext = controlLaw(now, options);
+            return true;
+        }
+
+    private:
+        Clock::time_point controlLaw(Clock::time_point t, const AdmissionOptions& options) {
+            auto interval = std::chrono::duration_cast<Clock::duration>(options.queueDelayInterval);
+            return t + Clock::duration(static_cast<Clock::rep>(
+                           static_cast<double>(interval.count()) / std::sqrt(_count)));
+        }
+
+        Clock::time_point _firstAboveTime{};
+        Clock::time_point _dropNext{};
+        std::uint32_t _count = 0;
+        bool _dropping = false;
+    };
+
+    Admission() { setOptions({}); }
+
+private:
+    AdmissionOptions _options;
+    std::string _overloaded;
+    ShardedCount _connections;
+    ShardedCount _requests;
+};
+
+#endif  // TINY_HTTP_SERVER_ADMISSION_H
@@ -1,27 +1,105 @@
 #ifndef TINY_HTTP_SERVER_ASIO_COROUTINE_UTIL_H
 #define TINY_HTTP_SERVER_ASIO_COROUTINE_UTIL_H
 
+#include <sys/socket.h>
+
 #include <boost/asio.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <cerrno>
+#include <chrono>
+#include <memory>
+#include <optional>
 #include <utility>
+#include <vector>
 
+#include "Cancellation.h"
+#include "DnsCache.h"
 #include "Executor.h"
 #include "Lazy.h"
+#include "PriorityLanes.h"
+#include "Trace.h"
+#ifdef TINY_HTTP_SERVER_IO_URING
+#include "IoUring.h"
+#endif
 
 #define asio boost::asio
 #define tcp asio::ip::tcp
 
+#ifdef TINY_HTTP_SERVER_IO_URING
+/// Translate an io_uring result into the error code asio would have reported.
+inline std::error_code uringError(int result) {
+    return boost::system::error_code(-result, boost::system::system_category());
+}
+#endif
+
+inline std::error_code operationAborted() {
+    return boost::system::error_code(asio::error::operation_aborted);
+}
+
+/// Abort every pending operation on 'socket', they complete with operation_aborted.
+template <typename Socket>
+inline void cancelSocket(Socket& socket) {
+    boost::system::error_code ec;
+    socket.cancel(ec);
+#ifdef TINY_HTTP_SERVER_IO_URING
+    if constexpr (std::is_same_v<Socket, tcp::socket>) {
+        if (auto& uring = IoUringService::of(socket); uring.available()) {
+            uring.cancelFd(socket.native_handle());
+        }
+    }
+#endif
+}
+
+/// CancellationCallback function calling cancel() of the awaiter passed as context.
+template <typename Awaiter>
+void cancelAwaiter(void* awaiter) {
+    static_cast<Awaiter*>(awaiter)->cancel();
+}
+
 class AsioExecutor : public Executor {
 public:
-    AsioExecutor(asio::io_context& ioContext) : ioContext_(ioContext) {}
+    /// Nested inline dispatches allowed on a thread, deeper ones are posted so that chains of
+    /// coroutines resuming each other cannot overflow the stack.
+    static constexpr unsigned kMaxDispatchDepth = 16;
+
+    /// Functions scheduled without options wait on 'lane' of the io_context.
+    AsioExecutor(asio::io_context& ioContext, Priority lane = Priority::normal)
+        : ioContext_(ioContext), lanes_(PriorityLanes::of(ioContext)), lane_(lane) {}
+
+    bool schedule(Func func) override { return schedule(std::move(func), lane_); }
+
+    bool schedule(Func func, ScheduleOptions opts) override {
+        lanes_.push(std::move(func), opts.priority);
+        return true;
+    }
 
-    bool schedule(Func func) override {
-        asio::post(ioContext_, std::move(func));
+    /// Inline on the thread running the io_context, saving the round trip through its queue.
+    bool dispatch(Func func) override {
+        if (!currentThreadInExecutor() || dispatchDepth() >= kMaxDispatchDepth) {
+            return schedule(std::move(func));
+        }
+        // Only thread-local state is touched after 'func', which may destroy this executor.
+        struct Nested {
+            Nested() noexcept { ++dispatchDepth(); }
+            ~Nested() { --dispatchDepth(); }
+        } nested;
+        func();
         return true;
     }
 
+    bool currentThreadInExecutor() const override {
+        return ioContext_.get_executor().running_in_this_thread();
+    }
+
 private:
+    static unsigned& dispatchDepth() noexcept {
+        thread_local unsigned depth = 0;
+        return depth;
+    }
+
     asio::io_context& ioContext_;
+    PriorityLanes& lanes_;
+    Priority lane_;
 };
 
 class AcceptorAwaiter {
@@ -32,24 +110,57 @@ public:
     bool await_ready() const noexcept { return false; }
 
     void await_suspend(std::coroutine_handle<> handle) {
+#ifdef TINY_HTTP_SERVER_IO_URING
+        if (auto& uring = IoUringService::of(_acceptor); uring.available()) {
+            _useUring = true;
+            _op._handle = handle;
+            uring.accept(_acceptor.native_handle(), &_op);
+            return;
+        }
+#endif
         _acceptor.async_accept(_socket, [this, handle](auto ec) {
             _ec = ec;
             handle.resume();
         });
     }
 
-    std::error_code await_resume() noexcept { return _ec; }
+    std::error_code await_resume() noexcept {
+#ifdef TINY_HTTP_SERVER_IO_URING
+        if (_useUring) {
+            if (_op._result < 0) return uringError(_op._result);
+            boost::system::error_code ec;
+            _socket.assign(_acceptor.local_endpoint(ec).protocol(), _op._result, ec);
+            return ec;
+        }
+#endif
+        return _ec;
+    }
 
-    AcceptorAwaiter coAwait(Executor* executor) noexcept { return *this; }
+    AcceptorAwaiter coAwait(Executor*) noexcept { return *this; }
 
 private:
     tcp::acceptor& _acceptor;
     tcp::socket& _socket;
     std::error_code _ec{};
+#ifdef TINY_HTTP_SERVER_IO_URING
+    bool _useUring = false;
+    IoUringResumeOperation _op;
+#endif
 };
 
-inline Lazy<std::error_code> asyncAccept(tcp::acceptor& acceptor, tcp::socket& socket) noexcept {
-    co_return co_await AcceptorAwaiter(acceptor, socket);
+inline AcceptorAwaiter asyncAccept(tcp::acceptor& acceptor, tcp::socket& socket) noexcept {
+    return {acceptor, socket};
+}
+
+/// Close 'acceptor' along with the connections io_uring accepted for it ahead of asyncAccept.
+inline void closeAcceptor(tcp::acceptor& acceptor) {
+#ifdef TINY_HTTP_SERVER_IO_URING
+    if (auto& uring = IoUringService::of(acceptor); uring.available() && acceptor.is_open()) {
+        uring.closeListener(acceptor.native_handle());
+    }
+#endif
+    boost::system::error_code ec;
+    acceptor.close(ec);
 }
 
 template <typename Socket, typename AsioBuffer>
@@ -57,27 +168,41 @@ struct ReadAwaiter {
 public:
     ReadAwaiter(Socket& socket, AsioBuffer& buffer) : _socket(socket), _buffer(buffer) {}
     bool await_ready() { return false; }
-    void await_suspend(std::coroutine_handle<> handle) {
+    template <typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> handle) {
+        _trace.start(traceOf(handle));
+        if (!_cancellation.registerWith(cancellationOf(handle), cancelAwaiter<ReadAwaiter>, this)) {
+            _ec = operationAborted();
+            return false;
+        }
         asio::async_read(_socket, _buffer, [this, handle](auto ec, auto size) mutable {
             _ec = ec;
             _size = size;
             handle.resume();
         });
+        return true;
     }
-    auto await_resume() { return std::make_pair(_ec, _size); }
-    auto coAwait(Executor* executor) noexcept { return std::move(*this); }
+    auto await_resume() {
+        _cancellation.reset();
+        _trace.stop("read");
+        return std::make_pair(_ec, _size);
+    }
+    auto coAwait(Executor*) noexcept { return std::move(*this); }
+
+    void cancel() { cancelSocket(_socket); }
 
 private:
     Socket& _socket;
     AsioBuffer& _buffer;
     std::error_code _ec{};
     size_t _size{0};
+    CancellationCallback _cancellation;
+    TraceTimer _trace;
 };
 
 template <typename Socket, typename AsioBuffer>
-inline Lazy<std::pair<std::error_code, size_t>> asyncRead(Socket& socket,
-                                                          AsioBuffer& buffer) noexcept {
-    co_return co_await ReadAwaiter(socket, buffer);
+inline ReadAwaiter<Socket, AsioBuffer> asyncRead(Socket& socket, AsioBuffer& buffer) noexcept {
+    return {socket, buffer};
 }
 
 template <typename Socket, typename AsioBuffer>
@@ -87,16 +212,30 @@ public:
         : _socket(socket), _buffer(buffer), _delim(delim) {}
 
     bool await_ready() { return false; }
-    void await_suspend(std::coroutine_handle<> handle) {
+    template <typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> handle) {
+        _trace.start(traceOf(handle));
+        if (!_cancellation.registerWith(cancellationOf(handle), cancelAwaiter<ReadUntilAwaiter>,
+                                        this)) {
+            _ec = operationAborted();
+            return false;
+        }
         asio::async_read_until(_socket, _buffer, _delim, [this, handle](auto ec, auto size) {
             _ec = ec;
             _size = size;
             handle.resume();
         });
+        return true;
+    }
+    auto await_resume() {
+        _cancellation.reset();
+        _trace.stop("read");
+        return std::make_pair(_ec, _size);
     }
-    auto await_resume() { return std::make_pair(_ec, _size); }
 
-    auto coAwait(Executor* executor) noexcept { return std::move(*this); }
+    auto coAwait(Executor*) noexcept { return std::move(*this); }
+
+    void cancel() { cancelSocket(_socket); }
 
 private:
     Socket& _socket;
@@ -104,12 +243,14 @@ private:
     std::string_view _delim;
     std::error_code _ec{};
     std::size_t _size{0};
+    CancellationCallback _cancellation;
+    TraceTimer _trace;
 };
 
 template <typename Socket, typename AsioBuffer>
-inline Lazy<std::pair<std::error_code, std::size_t>> asyncReadUntil(
-    Socket& socket, AsioBuffer& buffer, std::string_view delim) noexcept {
-    co_return co_await ReadUntilAwaiter(socket, buffer, delim);
+inline ReadUntilAwaiter<Socket, AsioBuffer> asyncReadUntil(Socket& socket, AsioBuffer& buffer,
+                                                           std::string_view delim) noexcept {
+    return {socket, buffer, delim};
 }
 
 template <typename Socket, typename AsioBuffer>
@@ -118,28 +259,138 @@ public:
     ReadSomeAwaiter(Socket& socket, AsioBuffer&& buffer) : _socket(socket), _buffer(buffer) {}
 
     bool await_ready() { return false; }
-    void await_suspend(std::coroutine_handle<> handle) {
+    template <typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> handle) {
+        _trace.start(traceOf(handle));
+        if (!_cancellation.registerWith(cancellationOf(handle), cancelAwaiter<ReadSomeAwaiter>,
+                                        this)) {
+            _ec = operationAborted();
+            return false;
+        }
+#ifdef TINY_HTTP_SERVER_IO_URING
+        if constexpr (std::is_same_v<Socket, tcp::socket>) {
+            if (auto& uring = IoUringService::of(_socket); uring.available()) {
+                _useUring = true;
+                _op._handle = handle;
+                auto buffer = asio::mutable_buffer(_buffer);
+                uring.recv(_socket.native_handle(), buffer.data(), buffer.size(), &_op);
+                return true;
+            }
+        }
+#endif
         _socket.async_read_some(std::move(_buffer), [this, handle](auto ec, auto size) {
             _ec = ec;
             _size = size;
             handle.resume();
         });
+        return true;
+    }
+    auto await_resume() {
+        _cancellation.reset();
+        _trace.stop("read");
+#ifdef TINY_HTTP_SERVER_IO_URING
+        if (_useUring) {
+            if (_op._result < 0) return std::make_pair(uringError(_op._result), size_t{0});
+            if (_op._result == 0 && asio::buffer_size(_buffer) > 0) {
+                return std::make_pair(
+                    std::error_code(boost::system::error_code(asio::error::eof)), size_t{0});
+            }
+            return std::make_pair(std::error_code{}, static_cast<size_t>(_op._result));
+        }
+#endif
+        return std::make_pair(_ec, _size);
     }
-    auto await_resume() { return std::make_pair(_ec, _size); }
 
-    auto coAwait(Executor* executor) noexcept { return std::move(*this); }
+    auto coAwait(Executor*) noexcept { return std::move(*this); }
+
+    void cancel() { cancelSocket(_socket); }
 
 private:
     Socket& _socket;
     AsioBuffer _buffer;
     std::error_code _ec{};
     size_t _size{0};
+    CancellationCallback _cancellation;
+    TraceTimer _trace;
+#ifdef TINY_HTTP_SERVER_IO_URING
+    bool _useUring = false;
+    IoUringResumeOperation _op;
+#endif
 };
 
 template <typename Socket, typename AsioBuffer>
-inline Lazy<std::pair<std::error_code, size_t>> asyncReadSome(Socket& socket,
-                                                              AsioBuffer&& buffer) noexcept {
-    co_return co_await ReadSomeAwaiter(socket, std::forward<AsioBuffer>(buffer));
+inline ReadSomeAwaiter<Socket, AsioBuffer> asyncReadSome(Socket& socket,
+                                                         AsioBuffer&& buffer) noexcept {
+    return {socket, std::forward<AsioBuffer>(buffer)};
+}
+
+template <typename Socket>
+class WaitAwaiter {
+public:
+    WaitAwaiter(Socket& socket, typename Socket::wait_type type) : _socket(socket), _type(type) {}
+
+    bool await_ready() { return false; }
+    template <typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> handle) {
+        _trace.start(traceOf(handle));
+        if (!_cancellation.registerWith(cancellationOf(handle),
+                                        cancelAwaiter<WaitAwaiter>, this)) {
+            _ec = operationAborted();
+            return false;
+        }
+#ifdef TINY_HTTP_SERVER_IO_URING
+        if constexpr (std::is_same_v<Socket, tcp::socket>) {
+            if (auto& uring = IoUringService::of(_socket); uring.available()) {
+                _useUring = true;
+                _op._handle = handle;
+                uring.poll(_socket.native_handle(),
+                           _type == Socket::wait_read ? POLLIN : POLLOUT, &_op);
+                return true;
+            }
+        }
+#endif
+        _socket.async_wait(_type, [this, handle](auto ec) {
+            _ec = ec;
+            handle.resume();
+        });
+        return true;
+    }
+    auto await_resume() {
+        _cancellation.reset();
+        // Waits are how reads and writes of TLS sessions block.
+        _trace.stop(_type == Socket::wait_read ? "read" : "write");
+#ifdef TINY_HTTP_SERVER_IO_URING
+        if (_useUring) return _op._result < 0 ? uringError(_op._result) : std::error_code{};
+#endif
+        return _ec;
+    }
+
+    auto coAwait(Executor*) noexcept { return std::move(*this); }
+
+    void cancel() { cancelSocket(_socket); }
+
+private:
+    Socket& _socket;
+    typename Socket::wait_type _type;
+    std::error_code _ec{};
+    CancellationCallback _cancellation;
+    TraceTimer _trace;
+#ifdef TINY_HTTP_SERVER_IO_URING
+    bool _useUring = false;
+    IoUringResumeOperation _op;
+#endif
+};
+
+/// Wait until the socket has data to read without consuming any of it.
+template <typename Socket>
+inline WaitAwaiter<Socket> asyncWaitReadable(Socket& socket) noexcept {
+    return {socket, Socket::wait_read};
+}
+
+/// Wait until the socket has room in its send buffer.
+template <typename Socket>
+inline WaitAwaiter<Socket> asyncWaitWritable(Socket& socket) noexcept {
+    return {socket, Socket::wait_write};
 }
 
 template <typename Socket, typename AsioBuffer>
@@ -149,59 +400,328 @@ public:
         : _socket(socket), _buffer(std::move(buffer)) {}
 
     bool await_ready() { return false; }
-    auto await_suspend(std::coroutine_handle<> handle) {
+    template <typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> handle) {
+        _trace.start(traceOf(handle));
+        if (!_cancellation.registerWith(cancellationOf(handle), cancelAwaiter<WriteAwaiter>,
+                                        this)) {
+            _ec = operationAborted();
+            return false;
+        }
+#ifdef TINY_HTTP_SERVER_IO_URING
+        if constexpr (std::is_same_v<Socket, tcp::socket>) {
+            if (auto& uring = IoUringService::of(_socket); uring.available()) {
+                _op.emplace(this, handle, uring);
+                return true;
+            }
+        }
+#endif
         asio::async_write(_socket, std::move(_buffer), [this, handle](auto ec, auto size) {
             _ec = ec;
             _size = size;
             handle.resume();
         });
+        return true;
+    }
+    auto await_resume() {
+        _cancellation.reset();
+        _trace.stop("write");
+        return std::make_pair(_ec, _size);
+    }
+
+    void cancel() {
+        _cancelled = true;
+        cancelSocket(_socket);
     }
-    auto await_resume() { return std::make_pair(_ec, _size); }
 
 private:
+#ifdef TINY_HTTP_SERVER_IO_URING
+    /// Sends the whole buffer sequence, resubmitting the remainder after short writes
+    /// like asio::async_write does.
+    class UringWriteOperation : public IoUringOperation {
+    public:
+        UringWriteOperation(WriteAwaiter* awaiter, std::coroutine_handle<> handle,
+                            IoUringService& uring)
+            : _awaiter(awaiter), _handle(handle), _uring(uring) {
+            for (auto it = asio::buffer_sequence_begin(awaiter->_buffer);
+                 it != asio::buffer_sequence_end(awaiter->_buffer); ++it) {
+                asio::const_buffer buffer(*it);
+                if (buffer.size() == 0) continue;
+                _iov.push_back({const_cast<void*>(buffer.data()), buffer.size()});
+            }
+            submit();
+        }
+
+        void complete(int result, unsigned) override {
+            if (result < 0) {
+                _awaiter->_ec = uringError(result);
+                _handle.resume();
+                return;
+            }
+            auto written = static_cast<std::size_t>(result);
+            _awaiter->_size += written;
+            while (_next < _iov.size() && written >= _iov[_next].iov_len) {
+                written -= _iov[_next++].iov_len;
+            }
+            if (_next == _iov.size()) {
+                _handle.resume();
+                return;
+            }
+            // A cancellation that raced with this completion would miss the resubmission.
+            if (_awaiter->_cancelled) {
+                _awaiter->_ec = operationAborted();
+                _handle.resume();
+                return;
+            }
+            _iov[_next].iov_base = static_cast<char*>(_iov[_next].iov_base) + written;
+            _iov[_next].iov_len -= written;
+            submit();
+        }
+
+    private:
+        void submit() {
+            if (_next == _iov.size()) {
+                // Nothing to send, still complete asynchronously.
+                _uring.send(_awaiter->_socket.native_handle(), nullptr, 0, this);
+                return;
+            }
+            _message = {};
+            _message.msg_iov = _iov.data() + _next;
+            _message.msg_iovlen = _iov.size() - _next;
+            _uring.sendmsg(_awaiter->_socket.native_handle(), &_message, this);
+        }
+
+        WriteAwaiter* _awaiter;
+        std::coroutine_handle<> _handle;
+        IoUringService& _uring;
+        std::vector<iovec> _iov;
+        std::size_t _next = 0;
+        msghdr _message{};
+    };
+
+    std::optional<UringWriteOperation> _op;
+#endif
     Socket& _socket;
     AsioBuffer _buffer;
     std::error_code _ec{};
     size_t _size{0};
+    bool _cancelled = false;
+    CancellationCallback _cancellation;
+    TraceTimer _trace;
 };
 
 template <typename Socket, typename AsioBuffer>
-inline Lazy<std::pair<std::error_code, std::size_t>> asyncWrite(Socket& socket,
-                                                                AsioBuffer&& buffer) noexcept {
-    co_return co_await WriteAwaiter(socket, std::forward<AsioBuffer>(buffer));
+inline WriteAwaiter<Socket, AsioBuffer> asyncWrite(Socket& socket, AsioBuffer&& buffer) noexcept {
+    return {socket, std::forward<AsioBuffer>(buffer)};
+}
+
+/// Coroutines parked until notified. They are resumed through the io_context rather than
+/// inline, so notifying never runs foreign code on the notifier's stack. Waiters re-check their
+/// condition after resuming.
+class WaitQueue {
+public:
+    explicit WaitQueue(asio::io_context& ioContext) : _ioContext(ioContext) {}
+
+    auto wait() noexcept {
+        struct Awaiter {
+            WaitQueue& queue;
+
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) {
+                queue._waiters.push_back(handle);
+            }
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{*this};
+    }
+
+    void notifyAll() {
+        for (auto handle : std::exchange(_waiters, {})) resume(handle);
+    }
+
+    void notifyOne() {
+        if (_waiters.empty()) return;
+        resume(_waiters.front());
+        _waiters.erase(_waiters.begin());
+    }
+
+private:
+    void resume(std::coroutine_handle<> handle) {
+        asio::post(_ioContext, [handle] { handle.resume(); });
+    }
+
+private:
+    asio::io_context& _ioContext;
+    std::vector<std::coroutine_handle<>> _waiters;
+};
+
+class TimerAwaiter {
+public:
+    explicit TimerAwaiter(asio::steady_timer& timer) : _timer(timer) {}
+
+    bool await_ready() noexcept { return false; }
+    template <typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> handle) {
+        if (!_cancellation.registerWith(cancellationOf(handle), cancelAwaiter<TimerAwaiter>,
+                                        this)) {
+            _ec = operationAborted();
+            return false;
+        }
+        _timer.async_wait([this, handle](auto ec) {
+            _ec = ec;
+            handle.resume();
+        });
+        return true;
+    }
+    auto await_resume() noexcept {
+        _cancellation.reset();
+        return _ec;
+    }
+    auto coAwait(Executor*) noexcept { return std::move(*this); }
+
+    void cancel() { _timer.cancel(); }
+
+private:
+    asio::steady_timer& _timer;
+    std::error_code _ec{};
+    CancellationCallback _cancellation;
+};
+
+/// Wait for the expiry of 'timer', operation_aborted when it or the caller was cancelled.
+inline TimerAwaiter asyncWait(asio::steady_timer& timer) noexcept { return TimerAwaiter(timer); }
+
+inline DnsCache::ResolveAwaiter asyncResolve(asio::io_context& ioCtx, const std::string& host,
+                                             const std::string& port) {
+    return DnsCache::instance().resolve(ioCtx, host, port);
 }
 
 class ConnectAwaiter {
 public:
-    ConnectAwaiter(asio::io_context& ioContext, tcp::socket& socket, std::string  host,
-                   std::string  port)
-        : _ioContext(ioContext), _socket(socket), _host(std::move(host)), _port(std::move(port)) {}
+    ConnectAwaiter(tcp::socket& socket, DnsCache::Endpoints endpoints)
+        : _socket(socket), _endpoints(std::move(endpoints)) {}
 
     bool await_ready() noexcept { return false; }
-    void await_suspend(std::coroutine_handle<> handle) {
-        tcp::resolver resolver(_ioContext);
-        auto endpoints = resolver.resolve(_host, _port);
-        asio::async_connect(_socket, endpoints,
+    template <typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> handle) {
+        _trace.start(traceOf(handle));
+        if (!_cancellation.registerWith(cancellationOf(handle), cancelAwaiter<ConnectAwaiter>,
+                                        this)) {
+            _ec = operationAborted();
+            return false;
+        }
+        asio::async_connect(_socket, _endpoints,
                             [this, handle](std::error_code ec, const tcp::endpoint&) {
                                 _ec = ec;
                                 handle.resume();
                             });
+        return true;
+    }
+    auto await_resume() noexcept {
+        _cancellation.reset();
+        _trace.stop("connect");
+        return _ec;
+    }
+    auto coAwait(Executor*) noexcept { return std::move(*this); }
+
+    /// Closing rather than cancelling, async_connect would move on to the next endpoint.
+    void cancel() {
+        boost::system::error_code ec;
+        _socket.close(ec);
     }
-    auto await_resume() noexcept { return _ec; }
-    auto coAwait(Executor* executor) noexcept { return std::move(*this); }
 
 private:
-    asio::io_context& _ioContext;
     tcp::socket& _socket;
-    std::string _host;
-    std::string _port;
+    DnsCache::Endpoints _endpoints;
     std::error_code _ec{};
+    CancellationCallback _cancellation;
+    TraceTimer _trace;
 };
 
+/// Two awaits in a row, so unlike the operations above this one is a Lazy of its own.
 inline Lazy<std::error_code> asyncConnect(asio::io_context& ioCtx, tcp::socket& socket,
                                           const std::string& host,
                                           const std::string& port) noexcept {
-    co_return co_await ConnectAwaiter(ioCtx, socket, host, port);
+    auto [err, endpoints] = co_await asyncResolve(ioCtx, host, port);
+    if (err) co_return err;
+    co_return co_await ConnectAwaiter(socket, std::move(endpoints));
+}
+
+/// Cancels 'source' once the peer closes or resets 'socket' while nothing reads from it, e.g.
+/// while a proxied request waits for its upstream. The watch ends when data arrives, which is
+/// left to the next read. Over TLS the records a peer sends when it closes count as data, so only
+/// a close without close_notify or a reset is noticed there.
+class DisconnectWatch {
+public:
+    DisconnectWatch(tcp::socket& socket, CancellationSource& source)
+        : _state(std::make_shared<State>(socket, source, true)) {
+        arm(_state);
+    }
+
+    DisconnectWatch(const DisconnectWatch&) = delete;
+
+    DisconnectWatch& operator=(const DisconnectWatch&) = delete;
+
+    ~DisconnectWatch() {
+        _state->active = false;
+        boost::system::error_code ec;
+        _state->socket.cancel(ec);
+    }
+
+private:
+    // Shared with the wait handler, which runs after the watch is gone when it was cancelled.
+    struct State {
+        tcp::socket& socket;
+        CancellationSource& source;
+        bool active = true;
+    };
+
+    static void arm(std::shared_ptr<State> state) {
+        auto& socket = state->socket;
+        socket.async_wait(tcp::socket::wait_read,
+                          [state = std::move(state)](const boost::system::error_code& ec) {
+                              if (ec || !state->active) return;
+                              char byte;
+                              auto n = ::recv(state->socket.native_handle(), &byte, 1,
+                                              MSG_PEEK | MSG_DONTWAIT);
+                              if (n > 0) return;
+                              if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                                            errno == EINTR)) {
+                                  arm(state);
+                                  return;
+                              }
+                              state->source.cancel();
+                          });
+    }
+
+    std::shared_ptr<State> _state;
+};
+
+/// Run 'lazy' with a deadline, giving std::nullopt when it expired. Expiry cancels the token
+/// 'lazy' runs with, so its pending operations are aborted and it finishes within a turn of the
+/// event loop; its result is dropped then. Cancellation of the caller reaches 'lazy' as well.
+template <typename T, typename Rep, typename Period>
+Lazy<std::optional<T>> withTimeout(asio::io_context& ioContext, Lazy<T> lazy,
+                                   std::chrono::duration<Rep, Period> timeout) {
+    // Shared with the timer handler, which may run after this frame is gone.
+    struct Deadline {
+        explicit Deadline(CancellationToken parent) : source(parent) {}
+
+        CancellationSource source;
+        bool finished = false;
+        bool expired = false;
+    };
+    auto deadline = std::make_shared<Deadline>(co_await currentCancellation());
+    asio::steady_timer timer(ioContext, timeout);
+    timer.async_wait([deadline](const boost::system::error_code& ec) {
+        if (ec || deadline->finished) return;
+        deadline->expired = true;
+        deadline->source.cancel();
+    });
+    auto result = co_await std::move(lazy).withCancellation(deadline->source.token());
+    deadline->finished = true;
+    timer.cancel();
+    if (deadline->expired) co_return std::nullopt;
+    co_return std::move(result);
 }
 
 #undef tcp
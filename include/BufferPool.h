@@ -0,0 +1,124 @@
+#ifndef TINY_HTTP_SERVER_BUFFER_POOL_H
+#define TINY_HTTP_SERVER_BUFFER_POOL_H
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/// A buffer borrowed from a BufferPool, handed back to the pool of the releasing thread.
+class PooledBuffer {
+public:
+    PooledBuffer() = default;
+
+    PooledBuffer(char* data, std::size_t sizeClass) : _data(data), _sizeClass(sizeClass) {}
+
+    PooledBuffer(const PooledBuffer&) = delete;
+
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    PooledBuffer(PooledBuffer&& other) noexcept
+        : _data(std::exchange(other._data, nullptr)), _sizeClass(other._sizeClass) {}
+
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept {
+        std::swap(_data, other._data);
+        std::swap(_sizeClass, other._sizeClass);
+        return *this;
+    }
+
+    ~PooledBuffer() { reset(); }
+
+    inline void reset() noexcept;
+
+    [[nodiscard]] char* data() const noexcept { return _data; }
+
+    [[nodiscard]] inline std::size_t size() const noexcept;
+
+    [[nodiscard]] std::size_t sizeClass() const noexcept { return _sizeClass; }
+
+    explicit operator bool() const noexcept { return _data != nullptr; }
+
+private:
+    char* _data = nullptr;
+    std::size_t _sizeClass = 0;
+};
+
+/// Per-thread slab allocator for connection read buffers.
+/// Buffers come in a few size classes and are carved out of large slabs that are never returned
+/// to the system. Freed buffers are kept on an intrusive free list of their class, so steady-state
+/// acquire/release is a pointer swap and no lock is ever taken.
+class BufferPool {
+public:
+    static constexpr std::array<std::size_t, 3> kSizeClasses = {2 << 10, 8 << 10, 32 << 10};
+    static constexpr std::size_t kSlabSize = 256 << 10;
+
+    /// Pool of the calling thread. Pools live as long as the process since buffers may still be
+    /// held by connections that migrated to other threads.
+    static BufferPool& local() {
+        thread_local BufferPool* pool = new BufferPool;
+        return *pool;
+    }
+
+    /// Smallest size class that holds at least 'bytes', or the largest one.
+    static constexpr std::size_t classFor(std::size_t bytes) noexcept {
+        for (std::size_t i = 0; i < kSizeClasses.size(); ++i) {
+            if (kSizeClasses[i] >= bytes) return i;
+        }
+        return kSizeClasses.size() - 1;
+    }
+
+    PooledBuffer acquire(std::size_t sizeClass) {
+        auto& list = _classes[sizeClass];
+        if (!list.head) refill(sizeClass);
+        FreeNode* node = list.head;
+        list.head = node->next;
+        --list.count;
+        return {reinterpret_cast<char*>(node), sizeClass};
+    }
+
+    void release(char* data, std::size_t sizeClass) noexcept {
+        auto& list = _classes[sizeClass];
+        auto* node = reinterpret_cast<FreeNode*>(data);
+        node->next = list.head;
+        list.head = node;
+        ++list.count;
+    }
+
+private:
+    struct FreeNode {
+        FreeNode* next;
+    };
+
+    struct FreeList {
+        FreeNode* head = nullptr;
+        std::size_t count = 0;
+    };
+
+    void refill(std::size_t sizeClass) {
+        auto& list = _classes[sizeClass];
+        std::size_t size = kSizeClasses[sizeClass];
+        _slabs.push_back(std::make_unique<char[]>(kSlabSize));
+        char* slab = _slabs.back().get();
+        for (std::size_t offset = 0; offset + size <= kSlabSize; offset += size) {
+            auto* node = reinterpret_cast<FreeNode*>(slab + offset);
+            node->next = list.head;
+            list.head = node;
+            ++list.count;
+        }
+    }
+
+private:
+    std::array<FreeList, kSizeClasses.size()> _classes;
+    std::vector<std::unique_ptr<char[]>> _slabs;
+};
+
+inline void PooledBuffer::reset() noexcept {
+    if (_data) BufferPool::local().release(std::exchange(_data, nullptr), _sizeClass);
+}
+
+inline std::size_t PooledBuffer::size() const noexcept {
+    return BufferPool::kSizeClasses[_sizeClass];
+}
+
+#endif  // TINY_HTTP_SERVER_BUFFER_POOL_H
@@ -0,0 +1,144 @@
+#ifndef TINY_HTTP_SERVER_CANCELLATION_H
+#define TINY_HTTP_SERVER_CANCELLATION_H
+
+#include <utility>
+
+#include "Common.h"
+
+class CancellationSource;
+
+/// Observes a CancellationSource. An empty token is never cancelled.
+/// Tokens do not own their source: it has to outlive the work it was handed to, which holds
+/// naturally when the owner awaits that work.
+class CancellationToken {
+public:
+    CancellationToken() = default;
+
+    explicit CancellationToken(CancellationSource* source) noexcept : _source(source) {}
+
+    [[nodiscard]] inline bool cancelled() const noexcept;
+
+    /// Whether the token is bound to a source at all.
+    explicit operator bool() const noexcept { return _source != nullptr; }
+
+private:
+    friend class CancellationCallback;
+
+    CancellationSource* _source = nullptr;
+};
+
+/// Calls a function once the token it is registered with gets cancelled, unless it was reset
+/// or destroyed before. Registration never allocates, the callback is a node of an intrusive
+/// list of its source.
+class CancellationCallback {
+public:
+    using Function = void (*)(void* context);
+
+    CancellationCallback() = default;
+
+    CancellationCallback(const CancellationCallback&) = delete;
+
+    CancellationCallback& operator=(const CancellationCallback&) = delete;
+
+    /// Only unregistered callbacks can be moved, as awaiters are before they suspend.
+    CancellationCallback(CancellationCallback&& other) noexcept {
+        logicAssert(!other._source, "A registered CancellationCallback cannot be moved");
+    }
+
+    ~CancellationCallback() { reset(); }
+
+    /// Register with 'token'. Returns false and registers nothing when it is cancelled already.
+    inline bool registerWith(CancellationToken token, Function function, void* context);
+
+    inline void reset() noexcept;
+
+private:
+    friend class CancellationSource;
+
+    CancellationSource* _source = nullptr;
+    CancellationCallback* _prev = nullptr;
+    CancellationCallback* _next = nullptr;
+    Function _function = nullptr;
+    void* _context = nullptr;
+};
+
+/// Requests cancellation of the work its tokens were handed to.
+/// Like everything else on a connection it is not thread-safe: cancel() has to be called on the
+/// io_context thread the cancellable operations run on. The callbacks cancel pending asio
+/// operations, which then complete with operation_aborted on the next turn of the event loop.
+class CancellationSource {
+public:
+    CancellationSource() = default;
+
+    /// A source that is also cancelled when 'parent' is.
+    explicit CancellationSource(CancellationToken parent) {
+        if (parent.cancelled()) {
+            _cancelled = true;
+        } else {
+            _parentLink.registerWith(
+                parent, [](void* self) { static_cast<CancellationSource*>(self)->cancel(); }, this);
+        }
+    }
+
+    CancellationSource(const CancellationSource&) = delete;
+
+    CancellationSource& operator=(const CancellationSource&) = delete;
+
+    ~CancellationSource() {
+        while (_callbacks) _callbacks->reset();
+    }
+
+    CancellationToken token() noexcept { return CancellationToken(this); }
+
+    [[nodiscard]] bool cancelled() const noexcept { return _cancelled; }
+
+    /// Cancel once, running every registered callback.
+    void cancel() {
+        if (std::exchange(_cancelled, true)) return;
+        _parentLink.reset();
+        // Callbacks are unlinked before they run, so they may reset or destroy other ones.
+        while (auto* callback = _callbacks) {
+            callback->reset();
+            callback->_function(callback->_context);
+        }
+    }
+
+private:
+    friend class CancellationCallback;
+
+    bool _cancelled = false;
+    CancellationCallback* _callbacks = nullptr;
+    CancellationCallback _parentLink;
+};
+
+inline bool CancellationToken::cancelled() const noexcept {
+    return _source && _source->cancelled();
+}
+
+inline bool CancellationCallback::registerWith(CancellationToken token, Function function,
+                                               void* context) {
+    reset();
+    if (!token._source) return true;
+    if (token._source->cancelled()) return false;
+    _source = token._source;
+    _function = function;
+    _context = context;
+    _next = _source->_callbacks;
+    if (_next) _next->_prev = this;
+    _source->_callbacks = this;
+    return true;
+}
+
+inline void CancellationCallback::reset() noexcept {
+    if (!_source) return;
+    if (_prev) {
+        _prev->_next = _next;
+    } else {
+        _source->_callbacks = _next;
+    }
+    if (_next) _next->_prev = _prev;
+    _source = nullptr;
+    _prev = _next = nullptr;
+}
+
+#endif  // TINY_HTTP_SERVER_CANCELLATION_H
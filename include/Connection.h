@@ -1,125 +1,439 @@
 #ifndef TINY_HTTP_SERVER_CONNECTION_H
 #define TINY_HTTP_SERVER_CONNECTION_H
 
+#include <atomic>
 #include <boost/asio/ip/tcp.hpp>
-#include <fstream>
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <optional>
 
+#include "AccessLog.h"
+#include "Admission.h"
 #include "AsioCoroutineUtil.h"
+#include "BufferPool.h"
+#include "FileIo.h"
+#include "Http2.h"
 #include "HttpRequest.h"
 #include "HttpResponse.h"
 #include "Lazy.h"
+#include "Metrics.h"
+#include "Proxy.h"
+#include "RateLimit.h"
+#include "RequestArena.h"
+#include "RequestHandler.h"
+#include "ServerOptions.h"
+#include "Tls.h"
+#include "Trace.h"
+#include "WebSocket.h"
 
 class Connection {
     using Socket = boost::asio::ip::tcp::socket;
+    using Clock = std::chrono::steady_clock;
 
 public:
-    Connection(Socket socket, std::string&& docRoot)
-        : _socket(std::move(socket)), _docRoot(std::move(docRoot)) {}
+    /// An 'admin' connection only serves the metrics endpoint. 'acceptedAt' is when the listener
+    /// accepted the socket, the queue delay of the first request is measured from there. With
+    /// 'tls', the connection starts with a TLS handshake and is served over the session.
+    Connection(Socket socket, const ServerOptions& options, bool admin = false,
+               Clock::time_point acceptedAt = Clock::now(), TlsContext* tls = nullptr)
+        : _socket(std::move(socket)),
+          _tls(tls ? std::make_unique<TlsSession>(*tls, _socket) : nullptr),
+          _stream(_socket, _tls.get()),
+          _options(options),
+          _admin(admin),
+          _handler(options, admin),
+          _proxy(options.proxy),
+          _request(_arena.allocator()),
+          _response(_arena.allocator()),
+          _acceptedAt(acceptedAt) {
+        boost::system::error_code ec;
+        _remote = _socket.remote_endpoint(ec);
+        Metrics::local().activeConnections.add();
+        // Connections stay on the thread they were started on, see Server::dispatch.
+        _next = localHead();
+        if (_next) _next->_prev = this;
+        localHead() = this;
+    }
 
     ~Connection() {
+        // Sends close_notify, while the socket is still open.
+        _tls.reset();
         boost::system::error_code ec;
         _socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
         _socket.close(ec);
+        if (_admitted) Admission::instance().releaseRequest();
+        Metrics::local().activeConnections.sub();
+        if (_prev) {
+            _prev->_next = _next;
+        } else {
+            localHead() = _next;
+        }
+        if (_next) _next->_prev = _prev;
+    }
+
+    /// Disable keep-alive everywhere: connections close after the response in flight.
+    static void startDraining() noexcept { _draining.store(true, std::memory_order_relaxed); }
+
+    static bool draining() noexcept { return _draining.load(std::memory_order_relaxed); }
+
+    /// Wake the connections of the calling thread that wait for their next request so that they
+    /// notice the drain and close.
+    static void closeIdle() noexcept {
+        for (Connection* con = localHead(); con; con = con->_next) {
+            if (!con->_idle) continue;
+            // Unlike cancel(), this also completes a poll that is pending in io_uring.
+            boost::system::error_code ec;
+            con->_socket.shutdown(Socket::shutdown_receive, ec);
+        }
     }
 
     Lazy<void> start() {
+        if (Tracer::instance().enabled()) co_await bindTrace(&_trace);
+        if (_tls) {
+            if (!co_await handshake()) co_return;
+            if (_tls->alpn() == "h2") {
+                _idle = true;
+                co_await Http2Session(_stream, _handler, _options, _remote).startNegotiated();
+                co_return;
+            }
+        }
         while (true) {
-            auto [err, bytesTransferred] =
-                co_await asyncReadSome(_socket, boost::asio::buffer(_readBuffer));
-            if (err) {
-                std::cerr << "Error: " << err.message() << " , size = " << bytesTransferred
-                          << std::endl;
-                break;
+            if (_readPos == _readEnd) {
+                if (!_readBuffer) {
+                    // Idle connections hold no buffer until the next request shows up.
+                    _idle = true;
+                    auto err = co_await asyncWaitReadable(_stream);
+                    _idle = false;
+                    if (err) {
+                        AccessLog::instance().logError(&_remote, err, "wait");
+                        break;
+                    }
+                    _readBuffer = BufferPool::local().acquire(0);
+                }
+                auto [err, bytesTransferred] = co_await asyncReadSome(
+                    _stream, boost::asio::buffer(_readBuffer.data(), _readBuffer.size()));
+                if (err) {
+                    if (err != boost::system::error_code(boost::asio::error::eof)) {
+                        AccessLog::instance().logError(&_remote, err, "read");
+                    }
+                    break;
+                }
+                Metrics::local().bytesIn.add(bytesTransferred);
+                _readPos = 0;
+                _readEnd = bytesTransferred;
             }
+            if (!_inRequest) {
+                _inRequest = true;
+                _requestStart = Clock::now();
+                if (Tracer::instance().enabled()) _trace.start(Tracer::instance().sample());
+            }
+
+            char* data = _readBuffer.data();
+            bool bufferFilled = _readEnd == _readBuffer.size();
+            // Never feed the parser more than what is left of the header budget.
+            std::size_t parseEnd =
+                std::min(_readEnd, _readPos + (_options.maxHeaderSize - _headerBytes));
+            TraceTimer parseTimer;
+            parseTimer.start(&_trace);
+            auto [res, consumed] = _parser.parse(_request, data + _readPos, data + parseEnd);
+            parseTimer.stop("parse");
+            auto consumedPos = static_cast<std::size_t>(consumed - data);
+            _headerBytes += consumedPos - _readPos;
+            _readPos = consumedPos;
 
-            auto [res, dummy] =
-                _parser.parse(_request, _readBuffer, _readBuffer + bytesTransferred);
+            bool close = true;
             if (res == RequestParser::succeed) {
-                _response = handleRequest(_request);
-                co_await asyncWrite(_socket, _response.toBuffers());
-                if (!isKeepAlive()) break;
-                _request = {};
-                _response = {};
-                _parser.reset();
+                if (_request.method == "PRI" && _request.uri == "*" &&
+                    _request.httpVersionMajor == 2) {
+                    // HTTP/2 with prior knowledge. Sessions are woken by closeIdle as well and
+                    // then finish their open streams. Their streams are not traced.
+                    _idle = true;
+                    _trace.stop();
+                    co_await Http2Session(_stream, _handler, _options, _remote)
+                        .start(takeReceived());
+                    break;
+                }
+                if (auto* settings = h2cUpgradeSettings()) {
+                    std::string payload(settings->value);
+                    auto [upgradeErr, n] = co_await asyncWrite(
+                        _stream, boost::asio::buffer(Http2::kSwitchingProtocols));
+                    if (upgradeErr) break;
+                    _idle = true;
+                    _trace.stop();
+                    co_await Http2Session(_stream, _handler, _options, _remote)
+                        .startUpgrade(std::move(_request), payload, takeReceived());
+                    break;
+                }
+                if (auto* route = webSocketRoute()) {
+                    auto* key = _request.header(KnownHeader::sec_websocket_key);
+                    auto* version = _request.header(KnownHeader::sec_websocket_version);
+                    if (_request.method == "GET" && key && version && version->value == "13") {
+                        co_await serveWebSocket(*route, std::string(key->value));
+                        break;
+                    }
+                    _response = Response(StatusType::bad_request);
+                    _response.addHeader("Sec-WebSocket-Version", "13");
+                } else if (!exempt() && rateLimited()) {
+                    close = !isKeepAlive() || hasBody();
+                } else if (!exempt() && !admit()) {
+                    // Shed without running any handler, the canned 503 closes the connection.
+                    auto overloaded = Admission::instance().overloadedResponse();
+                    auto [shedErr, bytesWritten] =
+                        co_await asyncWrite(_stream, boost::asio::buffer(overloaded));
+                    recordResponse(static_cast<int>(StatusType::service_unavailable), bytesWritten);
+                    break;
+                } else if (!_admin && _proxy.matches(_request)) {
+                    _stream.setPriority(Priority::low);
+                    // The upstream's work is abandoned as soon as the client goes away.
+                    DisconnectWatch watch(_socket, _disconnect);
+                    auto result =
+                        co_await _proxy
+                            .forward({_stream, _remote, _readBuffer, _readPos, _readEnd},
+                                     _request, isKeepAlive() && !draining())
+                            .withCancellation(_disconnect.token());
+                    if (!result.error) {
+                        recordResponse(result.status, result.bytesWritten);
+                        if (result.close) break;
+                        nextRequest();
+                        continue;
+                    }
+                    _response = Response(*result.error);
+                    close = result.close || !isKeepAlive();
+                } else {
+                    TraceTimer handleTimer;
+                    handleTimer.start(&_trace);
+                    _response = _handler.handle(_request);
+                    handleTimer.stop("handle");
+                    _stream.setPriority(_response.priority());
+                    close = !isKeepAlive() || hasBody();
+                }
             } else if (res == RequestParser::failed) {
+                Metrics::local().parseFailures.add();
                 _response = Response(StatusType::bad_request);
-                co_await asyncWrite(_socket, _response.toBuffers());
-                break;
+            } else if (_headerBytes >= _options.maxHeaderSize) {
+                _response = Response(StatusType::request_header_fields_too_large);
+            } else {
+                // Headers did not fit into the buffer, read the rest of them with a bigger one.
+                std::size_t sizeClass = _readBuffer.sizeClass();
+                if (bufferFilled && sizeClass + 1 < BufferPool::kSizeClasses.size()) {
+                    _readBuffer = BufferPool::local().acquire(sizeClass + 1);
+                }
+                continue;
             }
+
+            if (draining()) close = true;
+            if (close) _response.addHeader("Connection", "close");
+            auto [writeErr, bytesWritten] = co_await writeResponse();
+            recordResponse(static_cast<int>(_response.status()), bytesWritten);
+            if (writeErr || close) break;
+            nextRequest();
         }
     }
 
 private:
-    Response handleRequest(const Request& request) {
-        std::string reqPath = decodeUrl(request.uri);
-
-        // Request path must be absolute.
-        if (reqPath.empty() || reqPath[0] != '/' || reqPath.find("..") != std::string::npos) {
-            return {StatusType::bad_request};
+    /// Complete the TLS handshake, giving up after TlsOptions::handshakeTimeout.
+    Lazy<bool> handshake() {
+        auto result =
+            co_await withTimeout(ioContext(), _tls->handshake(), _options.tls.handshakeTimeout);
+        auto err = result.value_or(boost::system::error_code(boost::asio::error::timed_out));
+        if (err && err != boost::system::error_code(boost::asio::error::eof)) {
+            AccessLog::instance().logError(&_remote, err, "handshake");
         }
+        co_return !err;
+    }
 
-        if (reqPath.back() == '/') return {StatusType::ok};
+    /// Write '_response'. A file body is streamed after the head in chunks read off the io
+    /// thread, the first one going out with the head in a single write. Bulk ones wait on the
+    /// low priority lane before every chunk, the other requests of the io_context go first.
+    Lazy<std::pair<std::error_code, std::size_t>> writeResponse() {
+        auto buffers = _response.toBuffers();
+        if (!_response.file()) co_return co_await asyncWrite(_stream, std::move(buffers));
 
-        // Get the file extension.
-        std::size_t lastSlashPos = reqPath.find_last_of('/');
-        std::size_t lastDotPos = reqPath.find_last_of('.');
-        std::string extension;
-        if (lastDotPos != std::string::npos && lastDotPos > lastSlashPos) {
-            extension = reqPath.substr(lastDotPos + 1);
+        FileReader reader(ioContext(), _response.file(), _response.fileSize());
+        std::size_t written = 0;
+        while (true) {
+            if (_response.priority() == Priority::low) {
+                co_await _stream.lanes().enter(Priority::low);
+            }
+            auto [readErr, chunk] = co_await reader.next();
+            if (readErr) {
+                // The head promised more than can be sent, the connection has to close.
+                AccessLog::instance().logError(&_remote, readErr, "file");
+                co_return std::make_pair(readErr, written);
+            }
+            if (chunk.size() > 0) buffers.push_back(chunk);
+            if (buffers.empty()) break;
+            auto [err, n] = co_await asyncWrite(_stream, std::move(buffers));
+            written += n;
+            if (err) co_return std::make_pair(err, written);
+            // Moved from, the following chunks are written on their own.
+            buffers.clear();
         }
+        co_return std::make_pair(std::error_code{}, written);
+    }
 
-        // Open the file to send back.
-        std::string fullPath = _docRoot + reqPath;
-        std::ifstream is(fullPath.c_str(), std::ios::in | std::ios::binary);
-        if (!is) return {StatusType::not_found};
+    boost::asio::io_context& ioContext() {
+        return static_cast<boost::asio::io_context&>(_socket.get_executor().context());
+    }
 
-        // Fill out the response to be sent to the client.
-        Response response(StatusType::ok, MimeType::extensionToType(extension));
-        char buf[512];
-        while (is.read(buf, sizeof(buf)).gcount() > 0) {
-            response.appendToContent(buf, is.gcount());
-        }
-        return response;
-    }
-
-    static std::string decodeUrl(const std::string& url) {
-        std::string out;
-        out.reserve(url.size());
-        for (std::size_t i = 0; i < url.size(); ++i) {
-            if (url[i] == '%') {
-                if (i + 3 <= url.size()) {
-                    int value = 0;
-                    std::istringstream is(url.substr(i + 1, 2));
-                    if (is >> std::hex >> value) {
-                        out += static_cast<char>(value);
-                        i += 2;
-                    }
-                } else {
-                    return {};
-                }
-            } else if (url[i] == '+') {
-                out += ' ';
-            } else {
-                out += url[i];
-            }
+    /// Account a finished response on the shard of the thread it completed on.
+    void recordResponse(int status, std::size_t bytesWritten) {
+        auto& metrics = Metrics::local();
+        metrics.bytesOut.add(bytesWritten);
+        metrics.countRequest(static_cast<StatusType>(status));
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                                            _requestStart);
+        metrics.latency.record(static_cast<std::uint64_t>(elapsed.count()));
+        AccessLog::instance().logAccess(_remote, _request.method, _request.uri, status,
+                                        bytesWritten, elapsed);
+        finishTrace(status);
+        _inRequest = false;
+        if (std::exchange(_admitted, false)) Admission::instance().releaseRequest();
+    }
+
+    /// Hand the trace of the finished request to the Tracer, if it was traced.
+    void finishTrace(int status) {
+        if (!_trace.active()) return;
+        _trace.stop();
+        auto& metrics = Metrics::local();
+        if (_trace.sampled()) metrics.requestsTraced.add();
+        if (Tracer::instance().finish(_trace, _request.method, _request.uri, status)) {
+            metrics.slowRequests.add();
         }
-        return out;
     }
 
-    bool isKeepAlive() {
-        return std::ranges::none_of(_request.headers, [](const auto& h) {
-            return h.name == "Connection" && h.value == "close";
-        });
+    /// Admin connections and metrics scrapes bypass rate limits and shedding, so that an
+    /// overload can still be observed.
+    bool exempt() const {
+        return _admin || std::string_view(_request.uri) == _options.metricsPath;
+    }
+
+    /// Whether the client ran out of requests, '_response' is the 429 then.
+    bool rateLimited() {
+        auto& limiter = RateLimiter::instance();
+        if (!limiter.enabled()) return false;
+        auto wait = limiter.acquire(_remote.address(), _request.uri);
+        if (wait == Clock::duration::zero()) return false;
+        _response = limiter.rejection(wait);
+        return true;
+    }
+
+    /// Whether the parsed request may be served, see Admission::tryAcquireRequest.
+    bool admit() {
+        // The first request may have been waiting ever since the connection was accepted.
+        auto queuedSince = _acceptedAt.value_or(_requestStart);
+        _acceptedAt.reset();
+        _admitted = Admission::instance().tryAcquireRequest(queuedSince);
+        return _admitted;
+    }
+
+    void nextRequest() {
+        // Rebuilt rather than cleared, the capacity they keep would point into the arena.
+        std::destroy_at(&_response);
+        std::destroy_at(&_request);
+        _arena.reset();
+        std::construct_at(&_request, _arena.allocator());
+        std::construct_at(&_response, _arena.allocator());
+        _parser.reset();
+        _headerBytes = 0;
+        _stream.setPriority(Priority::normal);
+        // Pipelined requests keep the buffer, otherwise it goes back to the pool.
+        if (_readPos == _readEnd) _readBuffer.reset();
+    }
+
+    /// Bytes read beyond the current request, the read buffer is released.
+    std::string takeReceived() {
+        std::string received(_readBuffer.data() + _readPos, _readEnd - _readPos);
+        _readBuffer.reset();
+        _readPos = _readEnd = 0;
+        return received;
+    }
+
+    /// Complete the WebSocket handshake and hand the connection over to 'handler'.
+    Lazy<void> serveWebSocket(const WebSocketHandler& handler, std::string key) {
+        auto handshake = WebSocket::handshakeResponse(key);
+        auto [err, bytesWritten] = co_await asyncWrite(_stream, boost::asio::buffer(handshake));
+        Metrics::local().bytesOut.add(bytesWritten);
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                                            _requestStart);
+        AccessLog::instance().logAccess(_remote, _request.method, _request.uri, 101,
+                                        bytesWritten, elapsed);
+        finishTrace(101);
+        if (err) co_return;
+
+        // Like HTTP/2 sessions, WebSockets are woken by closeIdle and then shut down.
+        _idle = true;
+        WebSocket ws(_stream, _options.maxWebSocketMessageSize, takeReceived());
+        co_await handler(ws);
+        co_await ws.close(draining() ? WebSocket::kGoingAway : WebSocket::kNormalClosure);
+    }
+
+    /// The handler of a request asking for a WebSocket on one of its routes, null otherwise.
+    const WebSocketHandler* webSocketRoute() const {
+        auto* upgrade = _request.header(KnownHeader::upgrade);
+        if (!upgrade || !equalsIgnoreCase(upgrade->value, "websocket")) return nullptr;
+        auto route = _options.webSocketRoutes.find(std::string(_request.uri));
+        return route == _options.webSocketRoutes.end() ? nullptr : &route->second;
+    }
+
+    /// The HTTP2-Settings header of a request asking for an upgrade to h2c, null otherwise.
+    const Header* h2cUpgradeSettings() const {
+        auto* upgrade = _request.header(KnownHeader::upgrade);
+        if (!upgrade || !equalsIgnoreCase(upgrade->value, "h2c")) return nullptr;
+        return _request.header(KnownHeader::http2_settings);
+    }
+
+    /// Whether the request is followed by a body. Only the proxy reads bodies, anywhere else
+    /// the connection is closed after the response so the body is never parsed as a request.
+    bool hasBody() const {
+        if (_request.header(KnownHeader::transfer_encoding)) return true;
+        auto* length = _request.header(KnownHeader::content_length);
+        return length && length->value != "0";
+    }
+
+    bool isKeepAlive() const {
+        auto* connection = _request.header(KnownHeader::connection);
+        return !connection || !hasToken(connection->value, "close");
+    }
+
+    static Connection*& localHead() noexcept {
+        thread_local Connection* head = nullptr;
+        return head;
     }
 
 private:
+    static inline std::atomic<bool> _draining{false};
+
     Socket _socket;
-    char _readBuffer[1024]{};
+    std::unique_ptr<TlsSession> _tls;
+    /// What requests are read from and responses written to, '_tls' if set or '_socket'.
+    ClientStream _stream;
+    boost::asio::ip::tcp::endpoint _remote;
+    PooledBuffer _readBuffer;
+    std::size_t _readPos = 0;
+    std::size_t _readEnd = 0;
+    std::size_t _headerBytes = 0;
     RequestParser _parser;
+    const ServerOptions& _options;
+    bool _admin;
+    RequestHandler _handler;
+    ReverseProxy _proxy;
+    /// Cancelled once the client closed or reset the connection during a proxied request.
+    CancellationSource _disconnect;
+    /// Holds '_request' and '_response', which are declared after it to be destroyed first.
+    RequestArena _arena;
     Request _request;
     Response _response;
-    std::string _docRoot;
+    bool _inRequest = false;
+    Clock::time_point _requestStart;
+    /// Spans of the current request, recorded while tracing is enabled, see Tracer.
+    RequestTrace _trace;
+    std::optional<Clock::time_point> _acceptedAt;
+    bool _admitted = false;
+    bool _idle = false;
+    Connection* _prev = nullptr;
+    Connection* _next = nullptr;
 };
 
 #endif  // TINY_HTTP_SERVER_CONNECTION_H
@@ -0,0 +1,255 @@
+#ifndef TINY_HTTP_SERVER_DNS_CACHE_H
+#define TINY_HTTP_SERVER_DNS_CACHE_H
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <charconv>
+#include <chrono>
+#include <coroutine>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Cancellation.h"
+#include "Executor.h"
+#include "Lazy.h"
+#include "Metrics.h"
+
+#define asio boost::asio
+#define tcp asio::ip::tcp
+
+struct DnsCacheOptions {
+    /// How long resolved addresses are reused. getaddrinfo does not report record TTLs, so this
+    /// caps them instead.
+    std::chrono::milliseconds ttl = std::chrono::seconds(30);
+    /// How long a failed lookup is reported again without asking the resolver.
+    std::chrono::milliseconds negativeTtl = std::chrono::seconds(5);
+    /// Entries kept at most. Beyond it expired entries are swept, then the ones expiring first
+    /// are dropped. Names still being resolved are never dropped and may exceed it.
+    std::size_t maxEntries = 1024;
+};
+
+/// Process-wide cache of host name lookups.
+/// Lookups run asynchronously through the resolver of the requesting io_context, so io threads
+/// never block on DNS. Concurrent lookups of the same name share one query, and failures are
+/// cached as well so that a missing name does not hit the resolver on every connect.
+class DnsCache {
+    using Clock = std::chrono::steady_clock;
+
+public:
+    using Endpoints = std::vector<tcp::endpoint>;
+    using LookupHandler = std::function<void(std::error_code, Endpoints)>;
+    /// Starts a lookup and calls the handler on an io_context thread once it finished.
+    using Lookup = std::function<void(asio::io_context&, const std::string& host,
+                                      const std::string& port, LookupHandler)>;
+
+    static DnsCache& instance() {
+        static DnsCache cache;
+        return cache;
+    }
+
+    void setOptions(const DnsCacheOptions& options) {
+        std::lock_guard lock(_mutex);
+        _options = options;
+    }
+
+    /// Replace the system resolver, e.g. by a stub. Cached results are dropped.
+    void setLookup(Lookup lookup) {
+        std::lock_guard lock(_mutex);
+        _lookup = std::move(lookup);
+        std::erase_if(_entries, [](const auto& entry) { return !entry.second.resolving; });
+    }
+
+    class ResolveAwaiter {
+    public:
+        ResolveAwaiter(DnsCache& cache, asio::io_context& ioContext, std::string host,
+                       std::string port)
+            : _cache(cache),
+              _ioContext(ioContext),
+              _host(std::move(host)),
+              _port(std::move(port)) {}
+
+        bool await_ready() {
+            // Addresses need no lookup at all.
+            boost::system::error_code ec;
+            auto address = asio::ip::make_address(_host, ec);
+            if (ec) return false;
+            unsigned short port = 0;
+            auto [ptr, portEc] = std::from_chars(_port.data(), _port.data() + _port.size(), port);
+            if (portEc != std::errc() || ptr != _port.data() + _port.size()) return false;
+            _endpoints.emplace_back(address, port);
+            return true;
+        }
+
+        template <typename Promise>
+        bool await_suspend(std::coroutine_handle<Promise> handle) {
+            _handle = handle;
+            if (!_cancellation.registerWith(
+                    cancellationOf(handle),
+                    [](void* self) { static_cast<ResolveAwaiter*>(self)->cancel(); }, this)) {
+                _error = boost::system::error_code(asio::error::operation_aborted);
+                return false;
+            }
+            return _cache.resolve(*this);
+        }
+
+        std::pair<std::error_code, Endpoints> await_resume() {
+            _cancellation.reset();
+            return {_error, std::move(_endpoints)};
+        }
+
+        auto coAwait(Executor*) noexcept { return std::move(*this); }
+
+        /// Stop waiting for the lookup, which goes on for the other awaiters and the cache. The
+        /// awaiter completes with operation_aborted on the next turn of the event loop.
+        void cancel() { _cache.cancel(*this); }
+
+    private:
+        friend class DnsCache;
+
+        DnsCache& _cache;
+        asio::io_context& _ioContext;
+        std::string _host;
+        std::string _port;
+        std::coroutine_handle<> _handle;
+        std::error_code _error;
+        Endpoints _endpoints;
+        CancellationCallback _cancellation;
+    };
+
+    ResolveAwaiter resolve(asio::io_context& ioContext, std::string host, std::string port) {
+        return {*this, ioContext, std::move(host), std::move(port)};
+    }
+
+private:
+    struct Entry {
+        std::error_code error;
+        Endpoints endpoints;
+        Clock::time_point expiresAt;
+        /// Set while a lookup is running, which may have no awaiters left once they cancelled.
+        bool resolving = false;
+        /// The awaiters waiting for the running lookup.
+        std::vector<ResolveAwaiter*> waiters;
+    };
+
+    DnsCache() : _lookup(systemLookup) {}
+
+    /// Complete 'awaiter' from the cache, or park it until a lookup finished. Returns whether
+    /// it was parked.
+    bool resolve(ResolveAwaiter& awaiter) {
+        auto key = awaiter._host + ':' + awaiter._port;
+        auto now = Clock::now();
+        Lookup lookup;
+        {
+            std::lock_guard lock(_mutex);
+            auto [it, inserted] = _entries.try_emplace(key);
+            Entry& entry = it->second;
+            if (!inserted && !entry.resolving && entry.expiresAt > now) {
+                awaiter._error = entry.error;
+                awaiter._endpoints = entry.endpoints;
+                Metrics::local().dnsCacheHits.add();
+                return false;
+            }
+            entry.waiters.push_back(&awaiter);
+            // Somebody else already asked the resolver.
+            if (std::exchange(entry.resolving, true)) return true;
+            if (inserted && _entries.size() > _options.maxEntries) sweep(now);
+            lookup = _lookup;
+        }
+
+        Metrics::local().dnsLookups.add();
+        lookup(awaiter._ioContext, awaiter._host, awaiter._port,
+               [this, key](std::error_code error, Endpoints endpoints) {
+                   complete(key, error, std::move(endpoints));
+               });
+        return true;
+    }
+
+    void complete(const std::string& key, std::error_code error, Endpoints endpoints) {
+        std::vector<ResolveAwaiter*> waiters;
+        {
+            std::lock_guard lock(_mutex);
+            Entry& entry = _entries[key];
+            if (!error && endpoints.empty()) {
+                error = boost::system::error_code(asio::error::host_not_found);
+            }
+            entry.error = error;
+            entry.endpoints = std::move(endpoints);
+            entry.expiresAt = Clock::now() + (error ? _options.negativeTtl : _options.ttl);
+            entry.resolving = false;
+            waiters.swap(entry.waiters);
+            for (auto* awaiter : waiters) {
+                awaiter->_error = entry.error;
+                awaiter->_endpoints = entry.endpoints;
+            }
+        }
+        // Every coroutine continues on the io_context it asked from.
+        for (auto* awaiter : waiters) {
+            asio::post(awaiter->_ioContext, [handle = awaiter->_handle] { handle.resume(); });
+        }
+    }
+
+    /// Unpark 'awaiter' unless the lookup it waits for completed already, its resumption is
+    /// posted then.
+    void cancel(ResolveAwaiter& awaiter) {
+        {
+            std::lock_guard lock(_mutex);
+            auto it = _entries.find(awaiter._host + ':' + awaiter._port);
+            if (it == _entries.end()) return;
+            auto& waiters = it->second.waiters;
+            auto parked = std::find(waiters.begin(), waiters.end(), &awaiter);
+            if (parked == waiters.end()) return;
+            waiters.erase(parked);
+        }
+        awaiter._error = boost::system::error_code(asio::error::operation_aborted);
+        asio::post(awaiter._ioContext, [handle = awaiter._handle] { handle.resume(); });
+    }
+
+    void sweep(Clock::time_point now) {
+        std::erase_if(_entries, [now](const auto& entry) {
+            return !entry.second.resolving && entry.second.expiresAt <= now;
+        });
+        if (_entries.size() <= _options.maxEntries) return;
+        std::vector<std::unordered_map<std::string, Entry>::iterator> settled;
+        for (auto it = _entries.begin(); it != _entries.end(); ++it) {
+            if (!it->second.resolving) settled.push_back(it);
+        }
+        auto excess = std::min(_entries.size() - _options.maxEntries, settled.size());
+        auto expiresFirst = [](const auto& a, const auto& b) {
+            return a->second.expiresAt < b->second.expiresAt;
+        };
+        std::nth_element(settled.begin(), settled.begin() + static_cast<std::ptrdiff_t>(excess),
+                         settled.end(), expiresFirst);
+        for (std::size_t i = 0; i < excess; ++i) _entries.erase(settled[i]);
+    }
+
+    static void systemLookup(asio::io_context& ioContext, const std::string& host,
+                             const std::string& port, LookupHandler handler) {
+        // asio runs getaddrinfo on a private thread of the resolver service.
+        auto resolver = std::make_shared<tcp::resolver>(ioContext);
+        resolver->async_resolve(
+            host, port,
+            [resolver, handler = std::move(handler)](const boost::system::error_code& ec,
+                                                     const tcp::resolver::results_type& results) {
+                Endpoints endpoints;
+                for (const auto& result : results) endpoints.push_back(result.endpoint());
+                handler(ec, std::move(endpoints));
+            });
+    }
+
+private:
+    std::mutex _mutex;
+    DnsCacheOptions _options;
+    Lookup _lookup;
+    std::unordered_map<std::string, Entry> _entries;
+};
+
+#undef tcp
+#undef asio
+
+#endif  // TINY_HTTP_SERVER_DNS_CACHE_H
@@ -2,14 +2,20 @@
 #define TINY_HTTP_SERVER_EXECUTOR_H
 
 #include <chrono>
+#include <cstdint>
 #include <functional>
 #include <string>
 #include <thread>
 
+/// Lane scheduled work waits on, executors with a single queue ignore it.
+enum class Priority : std::uint8_t { high, normal, low };
+
 struct ScheduleOptions {
     /// Whether or not this schedule should be prompted.
     bool prompt = true;
+    Priority priority = Priority::normal;
     ScheduleOptions() = default;
+    ScheduleOptions(Priority lane) : priority(lane) {}
 };
 
 class Executor {
@@ -23,12 +29,21 @@ public:
 
     virtual bool schedule(Func func) = 0;
 
+    /// Schedule on the lane 'opts' select.
+    virtual bool schedule(Func func, [[maybe_unused]] ScheduleOptions opts) {
+        return schedule(std::move(func));
+    }
+
+    /// Run 'func' right away when that is known to be safe, e.g. when already on a thread of the
+    /// executor, and schedule it otherwise. Callers must not touch anything 'func' may destroy
+    /// once it returned.
+    virtual bool dispatch(Func func) { return schedule(std::move(func)); }
+
     virtual bool currentThreadInExecutor() const { throw std::logic_error("Not implemented"); }
 
     virtual Context checkout() { return NULLCTX; }
-    virtual bool checkin(Func func, [[maybe_unused]] Context ctx,
-                         [[maybe_unused]] ScheduleOptions opts) {
-        return schedule(std::move(func));
+    virtual bool checkin(Func func, [[maybe_unused]] Context ctx, ScheduleOptions opts) {
+        return schedule(std::move(func), opts);
     }
 
     virtual bool checkin(Func func, Context ctx) {
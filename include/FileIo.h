@@ -0,0 +1,307 @@
+#ifndef TINY_HTTP_SERVER_FILE_IO_H
+#define TINY_HTTP_SERVER_FILE_IO_H
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <cerrno>
+#include <coroutine>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "BufferPool.h"
+#include "Executor.h"
+#include "Lazy.h"
+#include "Metrics.h"
+#include "OpenFileCache.h"
+#include "Trace.h"
+#ifdef TINY_HTTP_SERVER_IO_URING
+#include "IoUring.h"
+#endif
+
+#define asio boost::asio
+
+struct FileIoOptions {
+    /// Threads making the blocking reads, used where io_uring is not available.
+    std::size_t threads = 4;
+    /// Chunks a streamed file is read ahead of the socket, see FileReader.
+    std::size_t readAhead = 4;
+};
+
+/// Positional reads from files that never block an io thread. Data in the page cache is read
+/// right away with RWF_NOWAIT, see readCached. Anything else is submitted to the io_uring of the
+/// io_context when there is one, and read on a small pool of blocking threads otherwise; either
+/// way the completion is delivered on the io_context's own thread.
+class FileIo {
+public:
+    static FileIo& instance() {
+        static FileIo io;
+        return io;
+    }
+
+    void setOptions(const FileIoOptions& options) {
+        _options = options;
+        if (_pool) _pool->join();
+        _pool = std::make_unique<asio::thread_pool>(std::max<std::size_t>(options.threads, 1));
+    }
+
+    [[nodiscard]] const FileIoOptions& options() const noexcept { return _options; }
+
+    /// Read 'size' bytes at 'offset' of 'fd' if that needs no disk access, std::nullopt if it
+    /// does. The result holds fewer bytes only at the end of the file.
+    static std::optional<std::pair<std::error_code, std::size_t>> readCached(int fd, void* data,
+                                                                             std::size_t size,
+                                                                             std::uint64_t offset) {
+        iovec iov{data, size};
+        auto n = ::preadv2(fd, &iov, 1, static_cast<off_t>(offset), RWF_NOWAIT);
+        if (n < 0) {
+            // EOPNOTSUPP where the file system cannot tell.
+            if (errno == EAGAIN || errno == EOPNOTSUPP) return std::nullopt;
+            return std::make_pair(std::error_code(errno, std::system_category()), std::size_t{0});
+        }
+        // A partly cached range is read again as a whole, from the disk.
+        auto bytes = static_cast<std::size_t>(n);
+        if (bytes < size && bytes > 0) return std::nullopt;
+        Metrics::local().fileReadsCached.add();
+        return std::make_pair(std::error_code{}, bytes);
+    }
+
+    /// Read up to 'size' bytes at 'offset' of 'fd' into 'data', then call 'done' on the thread
+    /// of 'ioContext'. Reads are not cancellable, but they are short.
+    template <typename Handler>
+    void readAt(asio::io_context& ioContext, int fd, void* data, std::size_t size,
+                std::uint64_t offset, Handler&& done) {
+        Metrics::local().fileReadsOffloaded.add();
+#ifdef TINY_HTTP_SERVER_IO_URING
+        if (auto& uring = asio::use_service<IoUringService>(ioContext); uring.available()) {
+            uring.readAt(fd, data, size, offset,
+                         new ReadOperation<std::decay_t<Handler>>(std::forward<Handler>(done)));
+            return;
+        }
+#endif
+        asio::post(pool(), [&ioContext, fd, data, size, offset,
+                            done = std::forward<Handler>(done)]() mutable {
+            auto n = ::pread(fd, data, size, static_cast<off_t>(offset));
+            std::error_code ec;
+            if (n < 0) ec = std::error_code(errno, std::system_category());
+            auto bytes = static_cast<std::size_t>(std::max<ssize_t>(n, 0));
+            asio::post(ioContext,
+                       [done = std::move(done), ec, bytes]() mutable { done(ec, bytes); });
+        });
+    }
+
+private:
+#ifdef TINY_HTTP_SERVER_IO_URING
+    template <typename Handler>
+    class ReadOperation : public IoUringOperation {
+    public:
+        explicit ReadOperation(Handler done) : _done(std::move(done)) {}
+
+        void complete(int result, unsigned) override {
+            std::unique_ptr<ReadOperation> self(this);
+            if (result < 0) {
+                _done(std::error_code(-result, std::system_category()), 0);
+            } else {
+                _done(std::error_code{}, static_cast<std::size_t>(result));
+            }
+        }
+
+    private:
+        Handler _done;
+    };
+#endif
+
+    FileIo() = default;
+
+    asio::thread_pool& pool() {
+        // Without setOptions, e.g. in benchmarks, the defaults apply.
+        if (!_pool) setOptions(_options);
+        return *_pool;
+    }
+
+    FileIoOptions _options;
+    std::unique_ptr<asio::thread_pool> _pool;
+};
+
+class ReadAtAwaiter {
+public:
+    ReadAtAwaiter(asio::io_context& ioContext, int fd, asio::mutable_buffer buffer,
+                  std::uint64_t offset)
+        : _ioContext(ioContext), _fd(fd), _buffer(buffer), _offset(offset) {}
+
+    bool await_ready() noexcept {
+        auto cached = FileIo::readCached(_fd, _buffer.data(), _buffer.size(), _offset);
+        if (cached) std::tie(_ec, _size) = *cached;
+        return cached.has_value();
+    }
+
+    template <typename Promise>
+    void await_suspend(std::coroutine_handle<Promise> handle) {
+        _trace.start(traceOf(handle));
+        FileIo::instance().readAt(_ioContext, _fd, _buffer.data(), _buffer.size(), _offset,
+                                  [this, handle](std::error_code ec, std::size_t n) {
+                                      _ec = ec;
+                                      _size = n;
+                                      handle.resume();
+                                  });
+    }
+
+    std::pair<std::error_code, std::size_t> await_resume() noexcept {
+        _trace.stop("file");
+        return {_ec, _size};
+    }
+
+    ReadAtAwaiter coAwait(Executor*) noexcept { return *this; }
+
+private:
+    asio::io_context& _ioContext;
+    int _fd;
+    asio::mutable_buffer _buffer;
+    std::uint64_t _offset;
+    std::error_code _ec{};
+    std::size_t _size = 0;
+    TraceTimer _trace;
+};
+
+/// Read into 'buffer' at 'offset' of 'fd' without blocking the io thread of 'ioContext'.
+/// Fewer bytes than asked for are only read at the end of the file.
+inline ReadAtAwaiter asyncReadAt(asio::io_context& ioContext, int fd, asio::mutable_buffer buffer,
+                                 std::uint64_t offset) noexcept {
+    return {ioContext, fd, buffer, offset};
+}
+
+/// Streams a file in chunks of BufferPool's largest size class, keeping a bounded number of
+/// reads in flight ahead of the consumer. A chunk is handed to the next read only once the
+/// consumer asks for the one after it, i.e. after it was written to the socket, so a download
+/// holds at most FileIoOptions::readAhead chunks however large the file and however slow the
+/// client. Must be used on the thread of 'ioContext'.
+class FileReader {
+public:
+    using File = std::shared_ptr<const OpenFile>;
+
+    static constexpr std::size_t kChunkClass = BufferPool::kSizeClasses.size() - 1;
+    static constexpr std::size_t kChunkSize = BufferPool::kSizeClasses[kChunkClass];
+
+    /// Stream the first 'size' bytes of 'file'.
+    FileReader(asio::io_context& ioContext, File file, std::uint64_t size)
+        : _ioContext(ioContext), _file(std::move(file)), _size(size) {
+        auto window = std::max<std::size_t>(FileIo::instance().options().readAhead, 1);
+        // No more chunks than the file needs.
+        window = std::min<std::uint64_t>(window, (size + kChunkSize - 1) / kChunkSize);
+        for (std::size_t i = 0; i < window; ++i) _ring.push_back(std::make_shared<Chunk>());
+    }
+
+    FileReader(const FileReader&) = delete;
+
+    FileReader& operator=(const FileReader&) = delete;
+
+    /// The next chunk of the file, empty at its end. It stays valid until the following call.
+    /// Fails when a read fails or the file turned out shorter than 'size'.
+    Lazy<std::pair<std::error_code, asio::const_buffer>> next() {
+        if (_holding) {
+            // The consumer is done with the previous chunk, it can be refilled.
+            _holding = false;
+            _head = (_head + 1) % _ring.size();
+            --_inFlight;
+        }
+        if (_consumed == _size) co_return std::make_pair(std::error_code{}, asio::const_buffer{});
+        // Reads from the page cache are made right here, they count as file time as well.
+        TraceTimer timer;
+        timer.start(co_await currentTrace());
+        startReads();
+        timer.stop("file");
+        auto chunk = _ring[_head];
+        if (!chunk->done) co_await ChunkAwaiter{*chunk, {}};
+        if (chunk->error) co_return std::make_pair(chunk->error, asio::const_buffer{});
+        _holding = true;
+        _consumed += chunk->size;
+        co_return std::make_pair(std::error_code{},
+                                 asio::const_buffer(chunk->buffer.data(), chunk->size));
+    }
+
+private:
+    /// Shared with the read in flight, which may complete after the reader is gone.
+    struct Chunk {
+        PooledBuffer buffer;
+        std::size_t size = 0;
+        std::error_code error;
+        bool done = false;
+        std::coroutine_handle<> waiter;
+    };
+
+    struct ChunkAwaiter {
+        Chunk& chunk;
+        TraceTimer trace;
+
+        bool await_ready() const noexcept { return chunk.done; }
+
+        template <typename Promise>
+        void await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            trace.start(traceOf(handle));
+            chunk.waiter = handle;
+        }
+
+        void await_resume() noexcept { trace.stop("file"); }
+
+        ChunkAwaiter coAwait(Executor*) noexcept { return *this; }
+    };
+
+    /// Fill every free chunk with the next part of the file.
+    void startReads() {
+        while (_inFlight < _ring.size() && _issued < _size) {
+            auto& chunk = _ring[(_head + _inFlight) % _ring.size()];
+            if (!chunk->buffer) chunk->buffer = BufferPool::local().acquire(kChunkClass);
+            auto offset = _issued;
+            auto size =
+                static_cast<std::size_t>(std::min<std::uint64_t>(kChunkSize, _size - offset));
+            _issued += size;
+            ++_inFlight;
+            if (auto cached = FileIo::readCached(_file->fd(), chunk->buffer.data(), size, offset)) {
+                complete(*chunk, size, cached->first, cached->second);
+                continue;
+            }
+            chunk->done = false;
+            // The read holds the file as well, its descriptor must not be closed and reused by
+            // OpenFileCache while the read is in flight, even when the reader is gone.
+            FileIo::instance().readAt(_ioContext, _file->fd(), chunk->buffer.data(), size, offset,
+                                      [chunk, size, file = _file](std::error_code ec,
+                                                                  std::size_t n) {
+                                          complete(*chunk, size, ec, n);
+                                          if (auto waiter = std::exchange(chunk->waiter, {})) {
+                                              waiter.resume();
+                                          }
+                                      });
+        }
+    }
+
+    static void complete(Chunk& chunk, std::size_t size, std::error_code ec, std::size_t n) {
+        // Anything short of the chunk means the file shrank.
+        if (!ec && n < size) ec = std::make_error_code(std::errc::io_error);
+        chunk.error = ec;
+        chunk.size = n;
+        chunk.done = true;
+    }
+
+    asio::io_context& _ioContext;
+    File _file;
+    std::uint64_t _size;
+    std::vector<std::shared_ptr<Chunk>> _ring;
+    /// The chunk handed out next, followed by '_inFlight' - 1 chunks read or being read.
+    std::size_t _head = 0;
+    std::size_t _inFlight = 0;
+    /// Whether the chunk at '_head' is held by the consumer.
+    bool _holding = false;
+    std::uint64_t _issued = 0;
+    std::uint64_t _consumed = 0;
+};
+
+#undef asio
+
+#endif  // TINY_HTTP_SERVER_FILE_IO_H
@@ -0,0 +1,438 @@
+#ifndef TINY_HTTP_SERVER_HPACK_H
+#define TINY_HTTP_SERVER_HPACK_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "HttpRequest.h"
+
+/// HPACK header compression for HTTP/2 (RFC 7541).
+namespace Hpack {
+
+struct StaticEntry {
+    std::string_view name;
+    std::string_view value;
+};
+
+/// Predefined header fields, HPACK index i refers to kStaticTable[i - 1].
+inline constexpr std::array<StaticEntry, 61> kStaticTable = {{
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+}};
+
+/// Canonical Huffman code of every octet, the last entry is the end-of-string symbol.
+inline constexpr std::array<std::uint32_t, 257> kHuffmanCodes = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7, 0xfffffe8,
+    0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed,
+    0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3, 0xffffff4,
+    0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9,
+    0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18, 0x0, 0x1,
+    0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa,
+    0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b,
+    0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc,
+    0x22, 0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26, 0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a,
+    0x7, 0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf, 0xffffec,
+    0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc,
+    0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd, 0xfffe9,
+    0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde, 0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0,
+    0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed,
+    0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5,
+    0x3fffe6, 0x7ffff1, 0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8,
+    0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1,
+    0x1ffffed, 0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5, 0xfffec,
+    0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4, 0x3ffffeb, 0x7ffffe6, 0x3ffffec,
+    0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec,
+    0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff};
+
+inline constexpr std::array<std::uint8_t, 257> kHuffmanLengths = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 30, 28,
+    28, 28, 28, 28, 28, 28, 28, 28, 6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6, 5, 5, 5,
+    6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10, 13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6, 15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28, 20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23,
+    23, 23, 23, 24, 23, 24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24, 22, 21, 20,
+    22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23, 21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22,
+    22, 23, 22, 22, 23, 26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25, 19, 21, 26,
+    27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27, 20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25,
+    25, 24, 24, 26, 23, 26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30};
+
+/// Size of an entry as accounted against the dynamic table limit.
+inline std::size_t entrySize(std::string_view name, std::string_view value) {
+    return name.size() + value.size() + 32;
+}
+
+namespace Huffman {
+
+inline std::size_t encodedLength(std::string_view in) {
+    std::size_t bits = 0;
+    for (unsigned char c : in) bits += kHuffmanLengths[c];
+    return (bits + 7) / 8;
+}
+
+inline void encode(std::string_view in, std::string& out) {
+    std::uint64_t bits = 0;
+    int count = 0;
+    for (unsigned char c : in) {
+        bits = (bits << kHuffmanLengths[c]) | kHuffmanCodes[c];
+        count += kHuffmanLengths[c];
+        while (count >= 8) {
+            count -= 8;
+            out.push_back(static_cast<char>(bits >> count));
+        }
+    }
+    // Pad with the most significant bits of the end-of-string symbol, i.e. ones.
+    if (count > 0) out.push_back(static_cast<char>((bits << (8 - count)) | (0xff >> count)));
+}
+
+/// Binary decoding tree, leaves hold the symbol and inner nodes the indexes of their children.
+class DecodeTree {
+public:
+    struct Node {
+        std::array<std::int16_t, 2> next{-1, -1};
+        std::int16_t symbol = -1;
+    };
+
+    static const DecodeTree& instance() {
+        static const DecodeTree tree;
+        return tree;
+    }
+
+    const Node& node(std::size_t index) const { return _nodes[index]; }
+
+private:
+    DecodeTree() {
+        _nodes.emplace_back();
+        for (std::size_t symbol = 0; symbol < kHuffmanCodes.size(); ++symbol) {
+            std::size_t current = 0;
+            for (int bit = kHuffmanLengths[symbol] - 1; bit >= 0; --bit) {
+                int branch = (kHuffmanCodes[symbol] >> bit) & 1;
+                if (_nodes[current].next[branch] < 0) {
+                    _nodes[current].next[branch] = static_cast<std::int16_t>(_nodes.size());
+                    _nodes.emplace_back();
+                }
+                current = _nodes[current].next[branch];
+            }
+            _nodes[current].symbol = static_cast<std::int16_t>(symbol);
+        }
+    }
+
+    std::vector<Node> _nodes;
+};
+
+/// Append the decoded string to 'out', false if the input is not validly encoded.
+inline bool decode(const std::uint8_t* data, std::size_t len, std::pmr::string& out) {
+    const auto& tree = DecodeTree::instance();
+    std::size_t current = 0;
+    int depth = 0;
+    bool allOnes = true;
+    for (std::size_t i = 0; i < len; ++i) {
+        for (int bit = 7; bit >= 0; --bit) {
+            int branch = (data[i] >> bit) & 1;
+            auto next = tree.node(current).next[branch];
+            if (next < 0) return false;
+            current = static_cast<std::size_t>(next);
+            ++depth;
+            allOnes = allOnes && branch;
+            if (auto symbol = tree.node(current).symbol; symbol >= 0) {
+                if (symbol == 256) return false;
+                out.push_back(static_cast<char>(symbol));
+                current = 0;
+                depth = 0;
+                allOnes = true;
+            }
+        }
+    }
+    // Padding is a prefix of the end-of-string symbol no longer than 7 bits.
+    return depth < 8 && allOnes;
+}
+
+}  // namespace Huffman
+
+/// Decode an integer with an N-bit prefix, false if the input is truncated or too large.
+inline bool decodeInteger(const std::uint8_t*& pos, const std::uint8_t* end, int prefixBits,
+                          std::uint64_t& value) {
+    if (pos == end) return false;
+    std::uint64_t mask = (1u << prefixBits) - 1;
+    value = *pos++ & mask;
+    if (value < mask) return true;
+    for (int shift = 0; shift <= 28; shift += 7) {
+        if (pos == end) return false;
+        std::uint8_t byte = *pos++;
+        value += static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+/// Encode an integer with an N-bit prefix, 'flags' fills the bits above the prefix.
+inline void encodeInteger(std::string& out, std::uint8_t flags, int prefixBits,
+                          std::uint64_t value) {
+    std::uint64_t mask = (1u << prefixBits) - 1;
+    if (value < mask) {
+        out.push_back(static_cast<char>(flags | value));
+        return;
+    }
+    out.push_back(static_cast<char>(flags | mask));
+    value -= mask;
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+/// FIFO of recently used header fields, newest first. Index 0 is HPACK index 62.
+class DynamicTable {
+public:
+    explicit DynamicTable(std::size_t maxSize = 4096) : _maxSize(maxSize) {}
+
+    void setMaxSize(std::size_t maxSize) {
+        _maxSize = maxSize;
+        evict(0);
+    }
+
+    [[nodiscard]] std::size_t maxSize() const { return _maxSize; }
+
+    void insert(std::string_view name, std::string_view value) {
+        std::size_t size = entrySize(name, value);
+        evict(size);
+        // An entry larger than the table empties it and is not added.
+        if (size > _maxSize) return;
+        _size += size;
+        _entries.emplace_front(name, value);
+    }
+
+    [[nodiscard]] std::size_t count() const { return _entries.size(); }
+
+    [[nodiscard]] const Header& at(std::size_t index) const { return _entries[index]; }
+
+private:
+    void evict(std::size_t incoming) {
+        while (!_entries.empty() && _size + incoming > _maxSize) {
+            _size -= entrySize(_entries.back().name, _entries.back().value);
+            _entries.pop_back();
+        }
+    }
+
+private:
+    std::deque<Header> _entries;
+    std::size_t _size = 0;
+    std::size_t _maxSize;
+};
+
+class Decoder {
+public:
+    /// Largest dynamic table the peer may use, i.e. our SETTINGS_HEADER_TABLE_SIZE.
+    explicit Decoder(std::size_t maxTableSize = 4096)
+        : _table(maxTableSize), _maxTableSize(maxTableSize) {}
+
+    /// Decode a complete header block into 'headers'.
+    /// Returns false on a compression error, after which the connection must be closed since
+    /// the table state is no longer in sync with the peer.
+    bool decode(const std::uint8_t* pos, const std::uint8_t* end, std::vector<Header>& headers) {
+        bool first = true;
+        while (pos != end) {
+            std::uint8_t byte = *pos;
+            std::uint64_t index;
+            if (byte & 0x80) {
+                // Indexed header field.
+                if (!decodeInteger(pos, end, 7, index) || index == 0) return false;
+                auto* entry = lookup(index);
+                if (!entry) return false;
+                headers.push_back(*entry);
+            } else if ((byte & 0xe0) == 0x20) {
+                // Dynamic table size update, only allowed at the start of a block.
+                if (!first || !decodeInteger(pos, end, 5, index) || index > _maxTableSize) {
+                    return false;
+                }
+                _table.setMaxSize(index);
+                continue;
+            } else {
+                // Literal, with incremental indexing (01), without (0000) or never indexed (0001).
+                bool indexing = (byte & 0xc0) == 0x40;
+                if (!decodeInteger(pos, end, indexing ? 6 : 4, index)) return false;
+                Header header;
+                if (index != 0) {
+                    auto* entry = lookup(index);
+                    if (!entry) return false;
+                    header.name = entry->name;
+                } else if (!decodeString(pos, end, header.name)) {
+                    return false;
+                }
+                if (!decodeString(pos, end, header.value)) return false;
+                if (indexing) _table.insert(header.name, header.value);
+                headers.push_back(std::move(header));
+            }
+            first = false;
+        }
+        return true;
+    }
+
+private:
+    const Header* lookup(std::uint64_t index) {
+        if (index <= kStaticTable.size()) {
+            const auto& entry = kStaticTable[index - 1];
+            _scratch = Header(entry.name, entry.value);
+            return &_scratch;
+        }
+        index -= kStaticTable.size() + 1;
+        return index < _table.count() ? &_table.at(index) : nullptr;
+    }
+
+    static bool decodeString(const std::uint8_t*& pos, const std::uint8_t* end,
+                             std::pmr::string& out) {
+        if (pos == end) return false;
+        bool huffman = *pos & 0x80;
+        std::uint64_t length;
+        if (!decodeInteger(pos, end, 7, length)) return false;
+        if (length > static_cast<std::uint64_t>(end - pos)) return false;
+        if (huffman) {
+            if (!Huffman::decode(pos, length, out)) return false;
+        } else {
+            out.assign(reinterpret_cast<const char*>(pos), length);
+        }
+        pos += length;
+        return true;
+    }
+
+private:
+    DynamicTable _table;
+    std::size_t _maxTableSize;
+    Header _scratch;
+};
+
+class Encoder {
+public:
+    /// Apply the peer's SETTINGS_HEADER_TABLE_SIZE, announced at the start of the next block.
+    void setMaxTableSize(std::size_t maxSize) {
+        _pendingTableSize = std::min(maxSize, kMaxTableSize);
+    }
+
+    /// Append one header field to the block in 'out'. Names must be lowercase.
+    /// Fields that are unlikely to repeat are not added to the dynamic table.
+    void encode(std::string_view name, std::string_view value, std::string& out,
+                bool indexing = true) {
+        if (_pendingTableSize != kNoPendingSize) {
+            _table.setMaxSize(_pendingTableSize);
+            encodeInteger(out, 0x20, 5, _pendingTableSize);
+            _pendingTableSize = kNoPendingSize;
+        }
+
+        std::size_t nameIndex = 0;
+        for (std::size_t i = 0; i < kStaticTable.size(); ++i) {
+            if (kStaticTable[i].name != name) continue;
+            if (kStaticTable[i].value == value) return encodeInteger(out, 0x80, 7, i + 1);
+            if (!nameIndex) nameIndex = i + 1;
+        }
+        for (std::size_t i = 0; i < _table.count(); ++i) {
+            const auto& entry = _table.at(i);
+            if (entry.name != name) continue;
+            std::size_t index = kStaticTable.size() + 1 + i;
+            if (entry.value == value) return encodeInteger(out, 0x80, 7, index);
+            if (!nameIndex) nameIndex = index;
+        }
+
+        if (indexing) {
+            encodeInteger(out, 0x40, 6, nameIndex);
+        } else {
+            encodeInteger(out, 0x00, 4, nameIndex);
+        }
+        if (!nameIndex) encodeString(name, out);
+        encodeString(value, out);
+        if (indexing) _table.insert(std::string(name), std::string(value));
+    }
+
+private:
+    static void encodeString(std::string_view in, std::string& out) {
+        std::size_t huffmanLength = Huffman::encodedLength(in);
+        if (huffmanLength < in.size()) {
+            encodeInteger(out, 0x80, 7, huffmanLength);
+            Huffman::encode(in, out);
+        } else {
+            encodeInteger(out, 0x00, 7, in.size());
+            out.append(in);
+        }
+    }
+
+private:
+    static constexpr std::size_t kMaxTableSize = 4096;
+    static constexpr std::size_t kNoPendingSize = ~std::size_t(0);
+
+    DynamicTable _table{kMaxTableSize};
+    std::size_t _pendingTableSize = kNoPendingSize;
+};
+
+}  // namespace Hpack
+
+#endif  // TINY_HTTP_SERVER_HPACK_H
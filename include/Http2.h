@@ -0,0 +1,747 @@
+#ifndef TINY_HTTP_SERVER_HTTP2_H
+#define TINY_HTTP_SERVER_HTTP2_H
+
+#include <algorithm>
+#include <array>
+#include <boost/asio.hpp>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "AccessLog.h"
+#include "AsioCoroutineUtil.h"
+#include "BufferPool.h"
+#include "FileIo.h"
+#include "Hpack.h"
+#include "HttpRequest.h"
+#include "HttpResponse.h"
+#include "Lazy.h"
+#include "Metrics.h"
+#include "RequestHandler.h"
+#include "ServerOptions.h"
+#include "Tls.h"
+
+#define asio boost::asio
+#define tcp asio::ip::tcp
+
+namespace Http2 {
+
+/// Client connection preface. With prior knowledge, the HTTP/1.1 parser accepts its first part
+/// as a request line, so only the rest is still expected afterwards.
+constexpr std::string_view kPreface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+constexpr std::string_view kPrefaceTail = "SM\r\n\r\n";
+
+/// Reply to an 'Upgrade: h2c' request, sent right before the server connection preface.
+constexpr std::string_view kSwitchingProtocols =
+    "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+constexpr std::size_t kFrameHeaderSize = 9;
+constexpr std::int64_t kDefaultWindowSize = 65535;
+constexpr std::int64_t kMaxWindowSize = 0x7fffffff;
+constexpr std::uint32_t kDefaultMaxFrameSize = 16384;
+constexpr std::uint32_t kMaxFrameSizeLimit = 16777215;
+constexpr std::uint32_t kMaxConcurrentStreams = 100;
+
+enum class FrameType : std::uint8_t {
+    data = 0x0,
+    headers = 0x1,
+    priority = 0x2,
+    rst_stream = 0x3,
+    settings = 0x4,
+    push_promise = 0x5,
+    ping = 0x6,
+    goaway = 0x7,
+    window_update = 0x8,
+    continuation = 0x9
+};
+
+namespace Flags {
+constexpr std::uint8_t end_stream = 0x1;
+constexpr std::uint8_t ack = 0x1;
+constexpr std::uint8_t end_headers = 0x4;
+constexpr std::uint8_t padded = 0x8;
+constexpr std::uint8_t priority = 0x20;
+}  // namespace Flags
+
+enum class ErrorCode : std::uint32_t {
+    no_error = 0x0,
+    protocol_error = 0x1,
+    internal_error = 0x2,
+    flow_control_error = 0x3,
+    settings_timeout = 0x4,
+    stream_closed = 0x5,
+    frame_size_error = 0x6,
+    refused_stream = 0x7,
+    cancel = 0x8,
+    compression_error = 0x9,
+    connect_error = 0xa,
+    enhance_your_calm = 0xb,
+    inadequate_security = 0xc,
+    http_1_1_required = 0xd
+};
+
+enum class Setting : std::uint16_t {
+    header_table_size = 0x1,
+    enable_push = 0x2,
+    max_concurrent_streams = 0x3,
+    initial_window_size = 0x4,
+    max_frame_size = 0x5,
+    max_header_list_size = 0x6
+};
+
+struct FrameHeader {
+    std::uint32_t length;
+    FrameType type;
+    std::uint8_t flags;
+    std::uint32_t streamId;
+};
+
+inline std::uint32_t readUint32(const std::uint8_t* p) {
+    return (static_cast<std::uint32_t>(p[0]) << 24) | (static_cast<std::uint32_t>(p[1]) << 16) |
+           (static_cast<std::uint32_t>(p[2]) << 8) | p[3];
+}
+
+inline void appendUint32(std::string& out, std::uint32_t value) {
+    out.push_back(static_cast<char>(value >> 24));
+    out.push_back(static_cast<char>(value >> 16));
+    out.push_back(static_cast<char>(value >> 8));
+    out.push_back(static_cast<char>(value));
+}
+
+inline FrameHeader parseFrameHeader(const std::uint8_t* p) {
+    return {(static_cast<std::uint32_t>(p[0]) << 16) | (static_cast<std::uint32_t>(p[1]) << 8) |
+                p[2],
+            static_cast<FrameType>(p[3]), p[4], readUint32(p + 5) & 0x7fffffff};
+}
+
+inline void appendFrameHeader(std::string& out, std::uint32_t length, FrameType type,
+                              std::uint8_t flags, std::uint32_t streamId) {
+    out.push_back(static_cast<char>(length >> 16));
+    out.push_back(static_cast<char>(length >> 8));
+    out.push_back(static_cast<char>(length));
+    out.push_back(static_cast<char>(type));
+    out.push_back(static_cast<char>(flags));
+    appendUint32(out, streamId);
+}
+
+/// Decode the unpadded base64url of an HTTP2-Settings header, false on invalid input.
+inline bool decodeBase64Url(std::string_view in, std::string& out) {
+    std::uint32_t bits = 0;
+    int count = 0;
+    for (char c : in) {
+        int value;
+        if (c >= 'A' && c <= 'Z') {
+            value = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            value = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            value = c - '0' + 52;
+        } else if (c == '-') {
+            value = 62;
+        } else if (c == '_') {
+            value = 63;
+        } else if (c == '=') {
+            break;
+        } else {
+            return false;
+        }
+        bits = (bits << 6) | static_cast<std::uint32_t>(value);
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            out.push_back(static_cast<char>(bits >> count));
+        }
+    }
+    return true;
+}
+
+}  // namespace Http2
+
+/// One HTTP/2 connection, multiplexing concurrent streams over a socket owned by Connection.
+/// The session reads and dispatches frames while every request runs as its own Lazy on the
+/// io_context of the socket. All of them share one output buffer that is written by whoever
+/// finds no write in flight, so no lock is needed.
+class Http2Session {
+    using Socket = ClientStream;
+    using Clock = std::chrono::steady_clock;
+
+public:
+    Http2Session(Socket& socket, RequestHandler& handler, const ServerOptions& options,
+                 const tcp::endpoint& remote)
+        : _socket(socket),
+          _handler(handler),
+          _options(options),
+          _remote(remote),
+          _ioContext(static_cast<asio::io_context&>(socket.get_executor().context())),
+          _executors{AsioExecutor(_ioContext, Priority::high), AsioExecutor(_ioContext),
+                     AsioExecutor(_ioContext, Priority::low)} {}
+
+    /// Serve a prior knowledge connection whose preface request line was already consumed.
+    /// 'received' holds what was read beyond it.
+    Lazy<void> start(std::string received) {
+        co_await run(std::move(received), Http2::kPrefaceTail);
+    }
+
+    /// Serve a TLS connection that agreed on h2 with ALPN, nothing was read from it yet.
+    Lazy<void> startNegotiated() { co_await run({}, Http2::kPreface); }
+
+    /// Serve a connection upgraded from HTTP/1.1, 'request' becomes stream 1.
+    Lazy<void> startUpgrade(Request request, std::string_view settings, std::string received) {
+        std::string payload;
+        if (!Http2::decodeBase64Url(settings, payload) || !applySettings(payload)) co_return;
+        auto& stream = openStream(1);
+        stream.request = std::move(request);
+        stream.remoteClosed = true;
+        _lastStreamId = 1;
+        launch(stream);
+        co_await run(std::move(received), Http2::kPreface);
+    }
+
+private:
+    /// Stop queueing DATA frames while this much output is pending.
+    static constexpr std::size_t kOutputHighWater = 64 << 10;
+
+    struct Stream {
+        std::uint32_t id;
+        Request request;
+        std::int64_t sendWindow;
+        bool remoteClosed = false;
+        bool reset = false;
+        bool headersTooLarge = false;
+        Clock::time_point start = Clock::now();
+    };
+
+    Lazy<void> run(std::string received, std::string_view preface) {
+        _readBuffer = BufferPool::local().acquire(BufferPool::kSizeClasses.size() - 1);
+        std::memcpy(_readBuffer.data(), received.data(), received.size());
+        _readEnd = received.size();
+        sendSettings();
+
+        bool prefaceDone = false;
+        while (!_dead) {
+            if (!prefaceDone && _readEnd - _readPos >= preface.size()) {
+                if (std::string_view(_readBuffer.data() + _readPos, preface.size()) != preface) {
+                    break;
+                }
+                _readPos += preface.size();
+                prefaceDone = true;
+            }
+            if (prefaceDone && !processFrames()) break;
+            co_await flush();
+            if (_dead) break;
+
+            // Move a partial frame to the front, a frame always fits into the buffer.
+            char* data = _readBuffer.data();
+            std::memmove(data, data + _readPos, _readEnd - _readPos);
+            _readEnd -= _readPos;
+            _readPos = 0;
+            auto [err, bytesTransferred] = co_await asyncReadSome(
+                _socket, asio::buffer(data + _readEnd, _readBuffer.size() - _readEnd));
+            if (err) {
+                if (err != boost::system::error_code(asio::error::eof)) {
+                    AccessLog::instance().logError(&_remote, err, "h2 read");
+                }
+                if (!_goawaySent) goaway(Http2::ErrorCode::no_error);
+                break;
+            }
+            Metrics::local().bytesIn.add(bytesTransferred);
+            _readEnd += bytesTransferred;
+        }
+
+        // Let the streams in flight finish before the socket goes away with the Connection.
+        _closing = true;
+        _waiters.notifyAll();
+        co_await flush();
+        while (_activeHandlers > 0) co_await _closeWaiters.wait();
+        _readBuffer.reset();
+    }
+
+    /// Dispatch every complete frame in the read buffer, false after a connection error.
+    bool processFrames() {
+        while (_readEnd - _readPos >= Http2::kFrameHeaderSize) {
+            auto* data = reinterpret_cast<const std::uint8_t*>(_readBuffer.data() + _readPos);
+            auto header = Http2::parseFrameHeader(data);
+            if (header.length > Http2::kDefaultMaxFrameSize) {
+                return connectionError(Http2::ErrorCode::frame_size_error);
+            }
+            if (_readEnd - _readPos < Http2::kFrameHeaderSize + header.length) break;
+            _readPos += Http2::kFrameHeaderSize + header.length;
+            if (!processFrame(header, data + Http2::kFrameHeaderSize)) return false;
+        }
+        return true;
+    }
+
+    bool processFrame(const Http2::FrameHeader& header, const std::uint8_t* payload) {
+        using Http2::ErrorCode;
+        using Http2::FrameType;
+        // A header block must not be interleaved with any other frame.
+        if (_headerStreamId != 0 && header.type != FrameType::continuation) {
+            return connectionError(ErrorCode::protocol_error);
+        }
+        switch (header.type) {
+            case FrameType::data:
+                return onData(header, payload);
+            case FrameType::headers:
+                return onHeaders(header, payload);
+            case FrameType::continuation:
+                if (header.streamId == 0 || header.streamId != _headerStreamId) {
+                    return connectionError(ErrorCode::protocol_error);
+                }
+                return appendHeaderBlock(header, payload, header.length);
+            case FrameType::priority:
+                if (header.streamId == 0) return connectionError(ErrorCode::protocol_error);
+                if (header.length != 5) return connectionError(ErrorCode::frame_size_error);
+                return true;
+            case FrameType::rst_stream:
+                return onRstStream(header, payload);
+            case FrameType::settings:
+                return onSettings(header, payload);
+            case FrameType::ping:
+                if (header.streamId != 0) return connectionError(ErrorCode::protocol_error);
+                if (header.length != 8) return connectionError(ErrorCode::frame_size_error);
+                if (!(header.flags & Http2::Flags::ack)) {
+                    Http2::appendFrameHeader(_output, 8, FrameType::ping, Http2::Flags::ack, 0);
+                    _output.append(reinterpret_cast<const char*>(payload), 8);
+                }
+                return true;
+            case FrameType::goaway:
+                // Streams in flight are completed, the peer closes the socket when it is done.
+                if (header.streamId != 0) return connectionError(ErrorCode::protocol_error);
+                return true;
+            case FrameType::window_update:
+                return onWindowUpdate(header, payload);
+            case FrameType::push_promise:
+                return connectionError(ErrorCode::protocol_error);
+            default:
+                // Unknown frame types must be ignored.
+                return true;
+        }
+    }
+
+    bool onData(const Http2::FrameHeader& header, const std::uint8_t* payload) {
+        using Http2::ErrorCode;
+        if (header.streamId == 0) return connectionError(ErrorCode::protocol_error);
+        std::size_t padding = 0;
+        if (header.flags & Http2::Flags::padded) {
+            if (header.length < 1) return connectionError(ErrorCode::frame_size_error);
+            padding = payload[0] + 1u;
+            if (padding > header.length) return connectionError(ErrorCode::protocol_error);
+        }
+
+        // Request bodies are not passed to handlers, so every frame is consumed right away and
+        // the receive windows are replenished immediately.
+        if (header.length > 0) windowUpdate(0, header.length);
+
+        auto it = _streams.find(header.streamId);
+        if (it == _streams.end() || it->second->remoteClosed) {
+            if (header.streamId > _lastStreamId) return connectionError(ErrorCode::protocol_error);
+            resetStream(header.streamId, ErrorCode::stream_closed);
+            return true;
+        }
+        auto& stream = *it->second;
+        if (header.flags & Http2::Flags::end_stream) {
+            stream.remoteClosed = true;
+            launch(stream);
+        } else if (header.length > 0) {
+            windowUpdate(stream.id, header.length);
+        }
+        return true;
+    }
+
+    bool onHeaders(const Http2::FrameHeader& header, const std::uint8_t* payload) {
+        using Http2::ErrorCode;
+        if (header.streamId == 0 || header.streamId % 2 == 0) {
+            return connectionError(ErrorCode::protocol_error);
+        }
+        std::size_t offset = 0, padding = 0;
+        if (header.flags & Http2::Flags::padded) {
+            if (header.length < 1) return connectionError(ErrorCode::frame_size_error);
+            padding = payload[0];
+            offset = 1;
+        }
+        if (header.flags & Http2::Flags::priority) offset += 5;
+        if (offset + padding > header.length) return connectionError(ErrorCode::protocol_error);
+
+        _headerStreamId = header.streamId;
+        _headerEndStream = header.flags & Http2::Flags::end_stream;
+        _headerBlock.clear();
+        return appendHeaderBlock(header, payload + offset, header.length - offset - padding);
+    }
+
+    bool appendHeaderBlock(const Http2::FrameHeader& header, const std::uint8_t* fragment,
+                           std::size_t length) {
+        // The raw block is bounded as well since it must be decoded to keep HPACK in sync.
+        if (_headerBlock.size() + length > 4 * _options.maxHeaderSize) {
+            return connectionError(Http2::ErrorCode::enhance_your_calm);
+        }
+        _headerBlock.append(reinterpret_cast<const char*>(fragment), length);
+        if (!(header.flags & Http2::Flags::end_headers)) return true;
+        std::uint32_t streamId = std::exchange(_headerStreamId, 0);
+        return onHeaderBlock(streamId);
+    }
+
+    bool onHeaderBlock(std::uint32_t streamId) {
+        using Http2::ErrorCode;
+        std::vector<Header> fields;
+        auto* begin = reinterpret_cast<const std::uint8_t*>(_headerBlock.data());
+        if (!_decoder.decode(begin, begin + _headerBlock.size(), fields)) {
+            return connectionError(ErrorCode::compression_error);
+        }
+
+        if (streamId <= _lastStreamId) {
+            // Trailers of a request whose body is still arriving.
+            auto it = _streams.find(streamId);
+            if (it == _streams.end() || it->second->remoteClosed) {
+                return connectionError(ErrorCode::stream_closed);
+            }
+            if (!_headerEndStream) return connectionError(ErrorCode::protocol_error);
+            it->second->remoteClosed = true;
+            launch(*it->second);
+            return true;
+        }
+
+        _lastStreamId = streamId;
+        if (_goawaySent || _streams.size() >= Http2::kMaxConcurrentStreams) {
+            resetStream(streamId, ErrorCode::refused_stream);
+            return true;
+        }
+
+        auto& stream = openStream(streamId);
+        stream.request.httpVersionMajor = 2;
+        stream.request.httpVersionMinor = 0;
+        std::size_t listSize = 0;
+        for (auto& field : fields) {
+            listSize += Hpack::entrySize(field.name, field.value);
+            if (field.name == ":method") {
+                stream.request.method = std::move(field.value);
+            } else if (field.name == ":path") {
+                stream.request.uri = std::move(field.value);
+            } else if (field.name == ":authority") {
+                stream.request.addHeader(Header{"host", std::move(field.value)});
+            } else if (!field.name.empty() && field.name[0] != ':') {
+                stream.request.addHeader(std::move(field));
+            }
+        }
+        stream.headersTooLarge = listSize > _options.maxHeaderSize;
+        if (stream.request.method.empty() || stream.request.uri.empty()) {
+            Metrics::local().parseFailures.add();
+            _streams.erase(streamId);
+            resetStream(streamId, ErrorCode::protocol_error);
+            return true;
+        }
+        if (_headerEndStream) {
+            stream.remoteClosed = true;
+            launch(stream);
+        }
+        return true;
+    }
+
+    bool onRstStream(const Http2::FrameHeader& header, const std::uint8_t*) {
+        using Http2::ErrorCode;
+        if (header.streamId == 0) return connectionError(ErrorCode::protocol_error);
+        if (header.length != 4) return connectionError(ErrorCode::frame_size_error);
+        if (header.streamId > _lastStreamId) return connectionError(ErrorCode::protocol_error);
+        if (auto it = _streams.find(header.streamId); it != _streams.end()) closeStream(it);
+        return true;
+    }
+
+    bool onSettings(const Http2::FrameHeader& header, const std::uint8_t* payload) {
+        using Http2::ErrorCode;
+        if (header.streamId != 0) return connectionError(ErrorCode::protocol_error);
+        if (header.flags & Http2::Flags::ack) {
+            return header.length == 0 || connectionError(ErrorCode::frame_size_error);
+        }
+        if (header.length % 6 != 0) return connectionError(ErrorCode::frame_size_error);
+        if (!applySettings({reinterpret_cast<const char*>(payload), header.length})) return false;
+        Http2::appendFrameHeader(_output, 0, Http2::FrameType::settings, Http2::Flags::ack, 0);
+        return true;
+    }
+
+    bool applySettings(std::string_view payload) {
+        using Http2::ErrorCode;
+        using Http2::Setting;
+        for (std::size_t i = 0; i + 6 <= payload.size(); i += 6) {
+            auto* p = reinterpret_cast<const std::uint8_t*>(payload.data() + i);
+            auto id = static_cast<Setting>((p[0] << 8) | p[1]);
+            std::uint32_t value = Http2::readUint32(p + 2);
+            switch (id) {
+                case Setting::header_table_size:
+                    _encoder.setMaxTableSize(value);
+                    break;
+                case Setting::enable_push:
+                    if (value > 1) return connectionError(ErrorCode::protocol_error);
+                    break;
+                case Setting::initial_window_size: {
+                    if (value > Http2::kMaxWindowSize) {
+                        return connectionError(ErrorCode::flow_control_error);
+                    }
+                    std::int64_t delta = static_cast<std::int64_t>(value) - _initialWindowSize;
+                    _initialWindowSize = value;
+                    for (auto& [id, stream] : _streams) stream->sendWindow += delta;
+                    _waiters.notifyAll();
+                    break;
+                }
+                case Setting::max_frame_size:
+                    if (value < Http2::kDefaultMaxFrameSize || value > Http2::kMaxFrameSizeLimit) {
+                        return connectionError(ErrorCode::protocol_error);
+                    }
+                    _peerMaxFrameSize = value;
+                    break;
+                default:
+                    break;
+            }
+        }
+        return true;
+    }
+
+    bool onWindowUpdate(const Http2::FrameHeader& header, const std::uint8_t* payload) {
+        using Http2::ErrorCode;
+        if (header.length != 4) return connectionError(ErrorCode::frame_size_error);
+        std::int64_t increment = Http2::readUint32(payload) & 0x7fffffff;
+        if (header.streamId == 0) {
+            if (increment == 0) return connectionError(ErrorCode::protocol_error);
+            _sendWindow += increment;
+            if (_sendWindow > Http2::kMaxWindowSize) {
+                return connectionError(ErrorCode::flow_control_error);
+            }
+        } else if (auto it = _streams.find(header.streamId); it != _streams.end()) {
+            auto& stream = *it->second;
+            if (increment == 0 || stream.sendWindow + increment > Http2::kMaxWindowSize) {
+                resetStream(stream.id, increment == 0 ? ErrorCode::protocol_error
+                                                      : ErrorCode::flow_control_error);
+                closeStream(it);
+            } else {
+                stream.sendWindow += increment;
+            }
+        }
+        _waiters.notifyAll();
+        return true;
+    }
+
+    /// Forget a stream that was reset. Once its handler runs, the handler owns it and only
+    /// notices the reset when it resumes.
+    void closeStream(std::unordered_map<std::uint32_t, std::unique_ptr<Stream>>::iterator it) {
+        if (it->second->remoteClosed) {
+            it->second->reset = true;
+        } else {
+            _streams.erase(it);
+        }
+    }
+
+    Stream& openStream(std::uint32_t id) {
+        auto stream = std::make_unique<Stream>();
+        stream->id = id;
+        stream->sendWindow = _initialWindowSize;
+        auto& ref = *stream;
+        _streams[id] = std::move(stream);
+        return ref;
+    }
+
+    /// Run the handler of a complete request on the io_context of the connection, from the lane
+    /// of its route.
+    void launch(Stream& stream) {
+        ++_activeHandlers;
+        auto lane = stream.headersTooLarge ? Priority::normal
+                                           : _handler.routePriority(stream.request);
+        serveStream(stream).via(&_executors[static_cast<std::size_t>(lane)]).detach();
+    }
+
+    Lazy<void> serveStream(Stream& stream) {
+        Response response = stream.headersTooLarge
+                                ? Response(StatusType::request_header_fields_too_large)
+                                : _handler.handle(stream.request);
+        // The body is the content, followed by the file streamed from disk if there is one.
+        std::string_view pending = response.content();
+        std::uint64_t bodySize = pending.size() + response.fileSize();
+        std::optional<FileReader> file;
+        if (response.file()) file.emplace(_ioContext, response.file(), response.fileSize());
+
+        std::string block;
+        _encoder.encode(":status", std::to_string(static_cast<int>(response.status())), block);
+        for (const auto& header : response.headers()) {
+            std::string name(header.name);
+            std::ranges::transform(name, name.begin(),
+                                   [](unsigned char c) { return std::tolower(c); });
+            // Connection-specific fields are not allowed in HTTP/2.
+            if (name == "connection" || name == "keep-alive" || name == "transfer-encoding") {
+                continue;
+            }
+            _encoder.encode(name, header.value, block, name != "content-length");
+        }
+        sendHeaders(stream.id, block, bodySize == 0);
+
+        std::uint64_t sent = 0;
+        while (sent < bodySize && !stream.reset && !_dead) {
+            if (pending.empty()) {
+                // Bulk ones let the other requests of the io_context go first, chunk by chunk.
+                if (response.priority() == Priority::low) {
+                    co_await _socket.lanes().enter(Priority::low);
+                }
+                // Only read on once the previous chunk is queued, which bounds the read-ahead.
+                auto [err, chunk] = co_await file->next();
+                if (err) {
+                    AccessLog::instance().logError(&_remote, err, "file");
+                    resetStream(stream.id, Http2::ErrorCode::internal_error);
+                    break;
+                }
+                pending = {static_cast<const char*>(chunk.data()), chunk.size()};
+                continue;
+            }
+            std::int64_t allowed = std::min<std::int64_t>(
+                {static_cast<std::int64_t>(pending.size()), _sendWindow, stream.sendWindow,
+                 static_cast<std::int64_t>(_peerMaxFrameSize)});
+            if (allowed <= 0 || _output.size() >= kOutputHighWater) {
+                if (_closing && allowed <= 0) break;
+                // The peer only opens the window after receiving what is queued.
+                if (!_output.empty() && !_writing) {
+                    co_await flush();
+                } else {
+                    // Wait for a WINDOW_UPDATE or for the write in flight to complete.
+                    co_await _waiters.wait();
+                }
+                continue;
+            }
+            auto length = static_cast<std::size_t>(allowed);
+            bool last = sent + length == bodySize;
+            Http2::appendFrameHeader(_output, length, Http2::FrameType::data,
+                                     last ? Http2::Flags::end_stream : 0, stream.id);
+            _output.append(pending.substr(0, length));
+            pending.remove_prefix(length);
+            sent += length;
+            _sendWindow -= allowed;
+            stream.sendWindow -= allowed;
+        }
+        co_await flush();
+
+        auto& metrics = Metrics::local();
+        metrics.countRequest(response.status());
+        auto elapsed =
+            std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - stream.start);
+        metrics.latency.record(static_cast<std::uint64_t>(elapsed.count()));
+        AccessLog::instance().logAccess(_remote, stream.request.method, stream.request.uri,
+                                        static_cast<int>(response.status()), sent, elapsed);
+
+        _streams.erase(stream.id);
+        if (--_activeHandlers == 0) _closeWaiters.notifyAll();
+    }
+
+    void sendHeaders(std::uint32_t streamId, std::string_view block, bool endStream) {
+        std::uint8_t flags = endStream ? Http2::Flags::end_stream : 0;
+        auto type = Http2::FrameType::headers;
+        do {
+            std::size_t length = std::min<std::size_t>(block.size(), _peerMaxFrameSize);
+            bool last = length == block.size();
+            Http2::appendFrameHeader(_output, length, type,
+                                     flags | (last ? Http2::Flags::end_headers : 0), streamId);
+            _output.append(block.substr(0, length));
+            block.remove_prefix(length);
+            type = Http2::FrameType::continuation;
+            flags = 0;
+        } while (!block.empty());
+    }
+
+    void sendSettings() {
+        using Http2::Setting;
+        std::pair<Setting, std::uint32_t> settings[] = {
+            {Setting::max_concurrent_streams, Http2::kMaxConcurrentStreams},
+            {Setting::max_header_list_size, static_cast<std::uint32_t>(_options.maxHeaderSize)}};
+        Http2::appendFrameHeader(_output, sizeof(settings) / sizeof(settings[0]) * 6,
+                                 Http2::FrameType::settings, 0, 0);
+        for (auto [id, value] : settings) {
+            _output.push_back(static_cast<char>(static_cast<std::uint16_t>(id) >> 8));
+            _output.push_back(static_cast<char>(id));
+            Http2::appendUint32(_output, value);
+        }
+    }
+
+    void windowUpdate(std::uint32_t streamId, std::uint32_t increment) {
+        Http2::appendFrameHeader(_output, 4, Http2::FrameType::window_update, 0, streamId);
+        Http2::appendUint32(_output, increment);
+    }
+
+    void resetStream(std::uint32_t streamId, Http2::ErrorCode error) {
+        Http2::appendFrameHeader(_output, 4, Http2::FrameType::rst_stream, 0, streamId);
+        Http2::appendUint32(_output, static_cast<std::uint32_t>(error));
+    }
+
+    void goaway(Http2::ErrorCode error) {
+        Http2::appendFrameHeader(_output, 8, Http2::FrameType::goaway, 0, 0);
+        Http2::appendUint32(_output, _lastStreamId);
+        Http2::appendUint32(_output, static_cast<std::uint32_t>(error));
+        _goawaySent = true;
+    }
+
+    /// Queue a GOAWAY, the connection is closed once it is written.
+    bool connectionError(Http2::ErrorCode error) {
+        goaway(error);
+        return false;
+    }
+
+    /// Write out everything queued, unless another coroutine is already doing so.
+    Lazy<void> flush() {
+        if (_writing) co_return;
+        _writing = true;
+        while (!_output.empty() && !_dead) {
+            std::swap(_output, _writeBuffer);
+            auto [err, bytesWritten] = co_await asyncWrite(_socket, asio::buffer(_writeBuffer));
+            _writeBuffer.clear();
+            Metrics::local().bytesOut.add(bytesWritten);
+            if (err) {
+                AccessLog::instance().logError(&_remote, err, "h2 write");
+                _dead = true;
+                // Fail the pending read as well.
+                boost::system::error_code ec;
+                _socket.socket().shutdown(tcp::socket::shutdown_receive, ec);
+            }
+            _waiters.notifyAll();
+        }
+        _writing = false;
+    }
+
+private:
+    Socket& _socket;
+    RequestHandler& _handler;
+    const ServerOptions& _options;
+    const tcp::endpoint& _remote;
+    asio::io_context& _ioContext;
+    /// One per lane, see PriorityLanes.
+    std::array<AsioExecutor, PriorityLanes::kLanes> _executors;
+
+    PooledBuffer _readBuffer;
+    std::size_t _readPos = 0;
+    std::size_t _readEnd = 0;
+    std::string _output;
+    std::string _writeBuffer;
+    bool _writing = false;
+    bool _dead = false;
+    bool _closing = false;
+    bool _goawaySent = false;
+
+    Hpack::Decoder _decoder;
+    Hpack::Encoder _encoder;
+    std::uint32_t _headerStreamId = 0;
+    bool _headerEndStream = false;
+    std::string _headerBlock;
+
+    std::unordered_map<std::uint32_t, std::unique_ptr<Stream>> _streams;
+    std::uint32_t _lastStreamId = 0;
+    std::size_t _activeHandlers = 0;
+    std::int64_t _sendWindow = Http2::kDefaultWindowSize;
+    std::int64_t _initialWindowSize = Http2::kDefaultWindowSize;
+    std::uint32_t _peerMaxFrameSize = Http2::kDefaultMaxFrameSize;
+    /// Streams waiting for a send window or for the write in flight.
+    WaitQueue _waiters{_ioContext};
+    WaitQueue _closeWaiters{_ioContext};
+};
+
+#undef tcp
+#undef asio
+
+#endif  // TINY_HTTP_SERVER_HTTP2_H
@@ -1,23 +1,203 @@
 #ifndef TINY_HTTP_SERVER_HTTP_REQUEST_H
 #define TINY_HTTP_SERVER_HTTP_REQUEST_H
 
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+#include <span>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <vector>
 
+/// Allocator-aware, so that the headers of a request or response live in its memory resource.
 struct Header {
-    std::string name;
-    std::string value;
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    Header() = default;
+
+    explicit Header(const allocator_type& alloc) : name(alloc), value(alloc) {}
+
+    Header(std::string_view headerName, std::string_view headerValue,
+           const allocator_type& alloc = {})
+        : name(headerName, alloc), value(headerValue, alloc) {}
+
+    Header(const Header& other, const allocator_type& alloc)
+        : name(other.name, alloc), value(other.value, alloc) {}
+
+    Header(Header&& other, const allocator_type& alloc)
+        : name(std::move(other.name), alloc), value(std::move(other.value), alloc) {}
+
+    Header(const Header&) = default;
+    Header(Header&&) = default;
+    Header& operator=(const Header&) = default;
+    Header& operator=(Header&&) = default;
+
+    std::pmr::string name;
+    std::pmr::string value;
+};
+
+inline bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+    return std::ranges::equal(a, b, [](unsigned char x, unsigned char y) {
+        return std::tolower(x) == std::tolower(y);
+    });
+}
+
+/// First header called 'name', compared case-insensitively, or null.
+inline const Header* findHeader(std::span<const Header> headers, std::string_view name) {
+    auto it = std::ranges::find_if(
+        headers, [name](const auto& h) { return equalsIgnoreCase(h.name, name); });
+    return it == headers.end() ? nullptr : &*it;
+}
+
+/// Headers the server itself looks at. Requests index them while they are parsed.
+enum class KnownHeader : std::uint8_t {
+    host,
+    connection,
+    content_length,
+    transfer_encoding,
+    accept_encoding,
+    if_none_match,
+    if_modified_since,
+    range,
+    expect,
+    upgrade,
+    sec_websocket_key,
+    sec_websocket_version,
+    http2_settings,
+};
+
+namespace KnownHeaders {
+/// Lowercase names, in the order of KnownHeader.
+constexpr std::array<std::string_view, 13> kNames = {
+    "host",
+    "connection",
+    "content-length",
+    "transfer-encoding",
+    "accept-encoding",
+    "if-none-match",
+    "if-modified-since",
+    "range",
+    "expect",
+    "upgrade",
+    "sec-websocket-key",
+    "sec-websocket-version",
+    "http2-settings",
 };
 
+constexpr unsigned kTableBits = 6;
+
+/// FNV-1a over the name with ASCII letters folded to lowercase, fed one character at a time so
+/// that the parser hashes names while it reads them. Setting 0x20 lowercases letters; it also
+/// maps a few symbols onto others, which only costs a compare on a hash hit.
+constexpr std::uint32_t hashStep(std::uint32_t hash, char c) noexcept {
+    return (hash ^ static_cast<std::uint8_t>(c | 0x20)) * 16777619u;
+}
+
+constexpr std::uint32_t hash(std::uint32_t seed, std::string_view name) noexcept {
+    for (char c : name) seed = hashStep(seed, c);
+    return seed;
+}
+
+constexpr std::size_t slotOf(std::uint32_t hash) noexcept { return hash >> (32 - kTableBits); }
+
+/// The first seed under which no two known names share a table slot, found while compiling.
+consteval std::uint32_t perfectSeed() {
+    for (std::uint32_t seed = 2166136261u;; ++seed) {
+        std::array<bool, 1 << kTableBits> used{};
+        bool collision = false;
+        for (auto name : kNames) {
+            auto slot = slotOf(hash(seed, name));
+            collision = collision || used[slot];
+            used[slot] = true;
+        }
+        if (!collision) return seed;
+    }
+}
+
+constexpr std::uint32_t kSeed = perfectSeed();
+
+/// Slot to KnownHeader + 1, 0 for slots no known name hashes to.
+constexpr auto kTable = [] {
+    std::array<std::uint8_t, 1 << kTableBits> table{};
+    for (std::size_t i = 0; i < kNames.size(); ++i) {
+        table[slotOf(hash(kSeed, kNames[i]))] = static_cast<std::uint8_t>(i + 1);
+    }
+    return table;
+}();
+
+/// Classify 'name' whose hash under kSeed is 'nameHash'.
+inline std::optional<KnownHeader> classify(std::uint32_t nameHash, std::string_view name) {
+    auto entry = kTable[slotOf(nameHash)];
+    if (entry == 0 || !equalsIgnoreCase(name, kNames[entry - 1])) return std::nullopt;
+    return static_cast<KnownHeader>(entry - 1);
+}
+
+inline std::optional<KnownHeader> classify(std::string_view name) {
+    return classify(hash(kSeed, name), name);
+}
+}  // namespace KnownHeaders
+
+/// Allocator-aware like Header: a request built with an allocator keeps all of its strings in
+/// the memory resource of that allocator.
 struct Request {
-    std::string method;
-    std::string uri;
-    int httpVersionMajor;
-    int httpVersionMinor;
-    std::vector<Header> headers;
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    Request() = default;
+
+    explicit Request(const allocator_type& alloc) : method(alloc), uri(alloc), headers(alloc) {}
+
+    [[nodiscard]] allocator_type get_allocator() const { return headers.get_allocator(); }
+
+    std::pmr::string method;
+    std::pmr::string uri;
+    int httpVersionMajor = 0;
+    int httpVersionMinor = 0;
+    /// All headers in the order they were received.
+    std::pmr::vector<Header> headers;
+    /// Position + 1 in 'headers' of the first header of every known name, 0 when absent.
+    std::array<std::uint16_t, KnownHeaders::kNames.size()> known{};
+
+    /// First header called 'name', or null, in constant time.
+    [[nodiscard]] const Header* header(KnownHeader name) const {
+        auto position = known[static_cast<std::size_t>(name)];
+        return position ? &headers[position - 1] : nullptr;
+    }
+
+    /// Append a header, indexing it when its name is known.
+    void addHeader(Header header) {
+        headers.push_back(std::move(header));
+        indexLast(KnownHeaders::classify(headers.back().name));
+    }
+
+    /// Index the last header as 'name' unless an earlier one already was.
+    void indexLast(std::optional<KnownHeader> name) {
+        if (!name) return;
+        auto& position = known[static_cast<std::size_t>(*name)];
+        if (position == 0 && headers.size() <= UINT16_MAX) {
+            position = static_cast<std::uint16_t>(headers.size());
+        }
+    }
 };
 
+/// Whether the comma separated list 'value' holds 'token', ignoring case, as in
+/// "Connection: keep-alive, Close".
+inline bool hasToken(std::string_view value, std::string_view token) {
+    while (!value.empty()) {
+        auto comma = value.find(',');
+        auto item = value.substr(0, comma);
+        auto blank = [](char c) { return c == ' ' || c == '\t'; };
+        while (!item.empty() && blank(item.front())) item.remove_prefix(1);
+        while (!item.empty() && blank(item.back())) item.remove_suffix(1);
+        if (equalsIgnoreCase(item, token)) return true;
+        value = comma == std::string_view::npos ? "" : value.substr(comma + 1);
+    }
+    return false;
+}
+
 class RequestParser {
 public:
     RequestParser() : _state(method_start) {}
@@ -165,8 +345,8 @@ private:
                 } else if (!isChar(input) || isCtl(input) || isTspecial(input)) {
                     return failed;
                 } else {
-                    req.headers.push_back(Header());
-                    req.headers.back().name.push_back(input);
+                    req.headers.emplace_back().name.push_back(input);
+                    _nameHash = KnownHeaders::hashStep(KnownHeaders::kSeed, input);
                     _state = header_name;
                     return indeterminate;
                 }
@@ -185,12 +365,14 @@ private:
                 }
             case header_name:
                 if (input == ':') {
+                    req.indexLast(KnownHeaders::classify(_nameHash, req.headers.back().name));
                     _state = space_before_header_value;
                     return indeterminate;
                 } else if (!isChar(input) || isCtl(input) || isTspecial(input)) {
                     return failed;
                 } else {
                     req.headers.back().name.push_back(input);
+                    _nameHash = KnownHeaders::hashStep(_nameHash, input);
                     return indeterminate;
                 }
             case space_before_header_value:
@@ -284,6 +466,8 @@ private:
         expecting_newline_2,
         expecting_newline_3
     } _state;
+    /// KnownHeaders::hash of the header name read so far.
+    std::uint32_t _nameHash = 0;
 };
 
 #endif  // TINY_HTTP_SERVER_HTTP_REQUEST_H
@@ -2,11 +2,18 @@
 #define TINY_HTTP_SERVER_HTTP_RESPONSE_H
 
 #include <boost/asio.hpp>
+#include <charconv>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
 #include <string>
 #include <string_view>
 #include <unordered_map>
 #include <vector>
 
+#include "Executor.h"
+#include "HttpRequest.h"
+
 enum class StatusType {
     ok = 200,
     created = 201,
@@ -20,14 +27,19 @@ enum class StatusType {
     unauthorized = 401,
     forbidden = 403,
     not_found = 404,
+    too_many_requests = 429,
+    request_header_fields_too_large = 431,
     internal_server_error = 500,
     not_implemented = 501,
     bad_gateway = 502,
-    service_unavailable = 503
+    service_unavailable = 503,
+    gateway_timeout = 504
 };
 
 #define asio boost::asio
 
+class OpenFile;
+
 namespace StatusLine {
 constexpr std::string_view ok = "HTTP/1.1 200 OK\r\n";
 constexpr std::string_view created = "HTTP/1.1 201 Created\r\n";
@@ -41,10 +53,14 @@ constexpr std::string_view bad_request = "HTTP/1.1 400 Bad Request\r\n";
 constexpr std::string_view unauthorized = "HTTP/1.1 401 Unauthorized\r\n";
 constexpr std::string_view forbidden = "HTTP/1.1 403 Forbidden\r\n";
 constexpr std::string_view not_found = "HTTP/1.1 404 Not Found\r\n";
+constexpr std::string_view too_many_requests = "HTTP/1.1 429 Too Many Requests\r\n";
+constexpr std::string_view request_header_fields_too_large =
+    "HTTP/1.1 431 Request Header Fields Too Large\r\n";
 constexpr std::string_view internal_server_error = "HTTP/1.1 500 Internal Server Error\r\n";
 constexpr std::string_view not_implemented = "HTTP/1.1 501 Not Implemented\r\n";
 constexpr std::string_view bad_gateway = "HTTP/1.1 502 Bad Gateway\r\n";
 constexpr std::string_view service_unavailable = "HTTP/1.1 503 Service Unavailable\r\n";
+constexpr std::string_view gateway_timeout = "HTTP/1.1 504 Gateway Timeout\r\n";
 
 asio::const_buffer statusToBuffer(StatusType status) {
     switch (status) {
@@ -62,10 +78,13 @@ asio::const_buffer statusToBuffer(StatusType status) {
         CASE(unauthorized);
         CASE(forbidden);
         CASE(not_found);
+        CASE(too_many_requests);
+        CASE(request_header_fields_too_large);
         CASE(internal_server_error);
         CASE(not_implemented);
         CASE(bad_gateway);
         CASE(service_unavailable);
+        CASE(gateway_timeout);
 #undef CASE
         default:
             return asio::buffer(internal_server_error);
@@ -155,6 +174,16 @@ constexpr std::string_view response_not_found =
     "<head><title>Not Found</title></head>"
     "<body><h1>404 Not Found</h1></body>"
     "</html>";
+constexpr std::string_view response_too_many_requests =
+    "<html>"
+    "<head><title>Too Many Requests</title></head>"
+    "<body><h1>429 Too Many Requests</h1></body>"
+    "</html>";
+constexpr std::string_view response_request_header_fields_too_large =
+    "<html>"
+    "<head><title>Request Header Fields Too Large</title></head>"
+    "<body><h1>431 Request Header Fields Too Large</h1></body>"
+    "</html>";
 constexpr std::string_view response_internal_server_error =
     "<html>"
     "<head><title>Internal Server Error</title></head>"
@@ -175,6 +204,11 @@ constexpr std::string_view response_service_unavailable =
     "<head><title>Service Unavailable</title></head>"
     "<body><h1>503 Service Unavailable</h1></body>"
     "</html>";
+constexpr std::string_view response_gateway_timeout =
+    "<html>"
+    "<head><title>Gateway Timeout</title></head>"
+    "<body><h1>504 Gateway Timeout</h1></body>"
+    "</html>";
 
 std::string_view to_string(StatusType status) {
     switch (status) {
@@ -202,6 +236,10 @@ std::string_view to_string(StatusType status) {
             return response_forbidden;
         case StatusType::not_found:
             return response_not_found;
+        case StatusType::too_many_requests:
+            return response_too_many_requests;
+        case StatusType::request_header_fields_too_large:
+            return response_request_header_fields_too_large;
         case StatusType::internal_server_error:
             return response_internal_server_error;
         case StatusType::not_implemented:
@@ -210,27 +248,38 @@ std::string_view to_string(StatusType status) {
             return response_bad_gateway;
         case StatusType::service_unavailable:
             return response_service_unavailable;
+        case StatusType::gateway_timeout:
+            return response_gateway_timeout;
         default:
             return response_internal_server_error;
     }
 }
 }  // namespace response_content
 
+/// Allocator-aware like Request. Responses built by handlers use the allocator of the request,
+/// so both live in the arena of the connection.
 class Response {
 public:
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
     Response() = default;
 
-    Response(StatusType status, std::string_view contentType = "text/html")
-        : _status(status), _content(response_content::to_string(status)) {
-        _headers.resize(2);
-        _headers[0].name = "Content-Length";
-        _headers[0].value = std::to_string(_content.size());
-        _headers[1].name = "Content-Type";
-        _headers[1].value = contentType;
+    explicit Response(const allocator_type& alloc) : _headers(alloc), _content(alloc) {}
+
+    Response(StatusType status, std::string_view contentType = "text/html",
+             const allocator_type& alloc = {})
+        : _status(status), _headers(alloc), _content(response_content::to_string(status), alloc) {
+        _headers.reserve(4);
+        _headers.emplace_back("Content-Length", "");
+        _headers.emplace_back("Content-Type", contentType);
+        updateContentLength();
     }
 
-    std::vector<asio::const_buffer> toBuffers() {
-        std::vector<asio::const_buffer> buffers;
+    [[nodiscard]] allocator_type get_allocator() const { return _headers.get_allocator(); }
+
+    std::pmr::vector<asio::const_buffer> toBuffers() {
+        std::pmr::vector<asio::const_buffer> buffers(get_allocator());
+        buffers.reserve(_headers.size() * 4 + 3);
         buffers.push_back(StatusLine::statusToBuffer(_status));
         for (const auto& h : _headers) {
             buffers.push_back(asio::buffer(h.name));
@@ -245,14 +294,55 @@ public:
 
     void appendToContent(const char* buf, std::size_t len) {
         _content.append(buf, len);
-        _headers[0].value = std::to_string(_content.size());
+        updateContentLength();
+    }
+
+    void setContent(std::string_view content) {
+        _content.assign(content);
+        updateContentLength();
     }
 
+    void addHeader(std::string_view name, std::string_view value) {
+        _headers.emplace_back(name, value);
+    }
+
+    /// Send the first 'size' bytes of 'file' after the content. They are not read into memory,
+    /// the writer streams them from disk, see FileReader.
+    void setFile(std::shared_ptr<const OpenFile> file, std::uint64_t size) {
+        _file = std::move(file);
+        _fileSize = size;
+        updateContentLength();
+    }
+
+    [[nodiscard]] StatusType status() const { return _status; }
+
+    [[nodiscard]] const std::pmr::vector<Header>& headers() const { return _headers; }
+
+    [[nodiscard]] const std::pmr::string& content() const { return _content; }
+
+    [[nodiscard]] const std::shared_ptr<const OpenFile>& file() const { return _file; }
+
+    [[nodiscard]] std::uint64_t fileSize() const { return _fileSize; }
+
+    /// Lane of its io_context the response is written from, see PriorityLanes.
+    void setPriority(Priority priority) { _priority = priority; }
+
+    [[nodiscard]] Priority priority() const { return _priority; }
+
+private:
+    void updateContentLength() {
+        char digits[20];
+        auto end = std::to_chars(digits, digits + sizeof(digits), _content.size() + _fileSize).ptr;
+        _headers[0].value.assign(digits, end);
+    }
 
 private:
-    StatusType _status;
-    std::vector<Header> _headers;
-    std::string _content;
+    StatusType _status = StatusType::ok;
+    std::pmr::vector<Header> _headers;
+    std::pmr::string _content;
+    std::shared_ptr<const OpenFile> _file;
+    std::uint64_t _fileSize = 0;
+    Priority _priority = Priority::normal;
 };
 
 #undef asio
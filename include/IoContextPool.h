@@ -39,6 +39,17 @@ public:
         return ioContext;
     }
 
+    template <typename F>
+    void forEach(F&& f) {
+        for (auto& ctx : _ioContexts) f(*ctx);
+    }
+
+    /// Let run() return, pending handlers are abandoned.
+    void stop() {
+        _works.clear();
+        for (auto& ctx : _ioContexts) ctx->stop();
+    }
+
 private:
     using IoContextPtr = std::shared_ptr<asio::io_context>;
     using WorkPtr = std::shared_ptr<asio::io_context::work>;
@@ -0,0 +1,523 @@
+#ifndef TINY_HTTP_SERVER_IO_URING_H
+#define TINY_HTTP_SERVER_IO_URING_H
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <boost/asio.hpp>
+#include <coroutine>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#define asio boost::asio
+
+/// An in-flight io_uring request. The submitter keeps it alive until 'complete' is called with
+/// the CQE result (a negated errno on failure) and flags.
+class IoUringOperation {
+public:
+    virtual ~IoUringOperation() = default;
+    virtual void complete(int result, unsigned flags) = 0;
+};
+
+/// Operation that stores its result and resumes a suspended coroutine.
+class IoUringResumeOperation : public IoUringOperation {
+public:
+    void complete(int result, unsigned flags) override {
+        _result = result;
+        _flags = flags;
+        _handle.resume();
+    }
+
+    std::error_code error() const noexcept {
+        return _result < 0 ? std::error_code(-_result, std::system_category()) : std::error_code();
+    }
+
+    std::coroutine_handle<> _handle;
+    int _result = 0;
+    unsigned _flags = 0;
+};
+
+/// io_uring backend of one io_context, registered as an asio service.
+/// SQEs prepared during a loop iteration are submitted with a single io_uring_enter from a
+/// posted flush handler. Completions are signalled through an eventfd that the io_context waits
+/// on like any other descriptor, so the ring is driven by the existing event loop and all
+/// operations complete on the io_context's own thread.
+/// The backend disables itself when the kernel refuses to set up a ring, or when the environment
+/// variable TINY_HTTP_SERVER_IO_BACKEND is set to "epoll"; callers then fall back to asio.
+class IoUringService : public asio::execution_context::service {
+public:
+    using key_type = IoUringService;
+    static inline asio::execution_context::id id;
+
+    static constexpr unsigned kEntries = 1024;
+    static constexpr unsigned kProvidedBuffers = 256;
+    static constexpr std::size_t kProvidedBufferSize = 2 << 10;
+    static constexpr std::uint16_t kBufferGroup = 0;
+
+    explicit IoUringService(asio::execution_context& ctx)
+        : asio::execution_context::service(ctx),
+          _ioContext(static_cast<asio::io_context&>(ctx)),
+          _eventDescriptor(_ioContext) {
+        const char* backend = std::getenv("TINY_HTTP_SERVER_IO_BACKEND");
+        if (backend && std::string_view(backend) == "epoll") return;
+        _available = setupRing() && setupEventFd();
+        if (_available) setupBufferRing();
+    }
+
+    ~IoUringService() override {
+        if (_bufferRing) ::munmap(_bufferRing, _bufferRingBytes);
+        if (_sqes) ::munmap(_sqes, _sqeBytes);
+        if (_cqRing && _cqRing != _sqRing) ::munmap(_cqRing, _cqRingBytes);
+        if (_sqRing) ::munmap(_sqRing, _sqRingBytes);
+        if (_ringFd >= 0) ::close(_ringFd);
+    }
+
+    /// Service of the io_context an I/O object is bound to.
+    template <typename IoObject>
+    static IoUringService& of(IoObject& object) {
+        return asio::use_service<IoUringService>(object.get_executor().context());
+    }
+
+    [[nodiscard]] bool available() const noexcept { return _available; }
+
+    /// Number of io_uring_enter calls, i.e. syscalls spent on submission.
+    [[nodiscard]] std::uint64_t enterCount() const noexcept { return _enterCount; }
+
+    void recv(int fd, void* data, std::size_t size, IoUringOperation* op) {
+        run([=, this] {
+            if (!_bufferRing || size < kProvidedBufferSize) {
+                recvInto(fd, data, size, op);
+                return;
+            }
+            // Let the kernel pick a buffer at completion time, see ProvidedRecvOperation.
+            auto* sqe = nextSqe();
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = fd;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = kBufferGroup;
+            sqe->len = static_cast<std::uint32_t>(kProvidedBufferSize);
+            sqe->user_data =
+                reinterpret_cast<std::uint64_t>(new ProvidedRecvOperation(this, op, fd, data, size));
+        });
+    }
+
+    /// Complete once 'fd' is ready for one of the poll 'events', without consuming any data.
+    void poll(int fd, std::uint32_t events, IoUringOperation* op) {
+        run([=, this] {
+            auto* sqe = nextSqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fd;
+            sqe->poll32_events = events;
+            sqe->user_data = reinterpret_cast<std::uint64_t>(op);
+        });
+    }
+
+    /// Vectored send, the socket flavour of writev that does not raise SIGPIPE.
+    void sendmsg(int fd, const msghdr* message, IoUringOperation* op) {
+        run([=, this] {
+            auto* sqe = nextSqe();
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<std::uint64_t>(message);
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sqe->user_data = reinterpret_cast<std::uint64_t>(op);
+        });
+    }
+
+    void send(int fd, const void* data, std::size_t size, IoUringOperation* op) {
+        run([=, this] {
+            auto* sqe = nextSqe();
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<std::uint64_t>(data);
+            sqe->len = static_cast<std::uint32_t>(size);
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sqe->user_data = reinterpret_cast<std::uint64_t>(op);
+        });
+    }
+
+    /// Positional read from a regular file.
+    void readAt(int fd, void* data, std::size_t size, std::uint64_t offset, IoUringOperation* op) {
+        run([=, this] {
+            auto* sqe = nextSqe();
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<std::uint64_t>(data);
+            sqe->len = static_cast<std::uint32_t>(size);
+            sqe->off = offset;
+            sqe->user_data = reinterpret_cast<std::uint64_t>(op);
+        });
+    }
+
+    /// Cancel every operation in flight on 'fd', they complete with -ECANCELED.
+    void cancelFd(int fd) {
+        run([=, this] {
+            auto* sqe = nextSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            // Nobody waits for the outcome, reap() skips user_data 0.
+            sqe->user_data = 0;
+        });
+    }
+
+    /// Complete 'op' with the next connection accepted on the listening socket 'fd'.
+    /// A single multishot accept stays armed per listener and queues connections that arrive
+    /// while nobody is waiting.
+    void accept(int fd, IoUringOperation* op) {
+        run([=, this] {
+            auto& listener = _listeners[fd];
+            if (!listener) listener = std::make_unique<MultishotAccept>(this, fd);
+            if (!listener->_ready.empty()) {
+                int result = listener->_ready.front();
+                listener->_ready.pop_front();
+                op->complete(result, 0);
+                return;
+            }
+            listener->_waiters.push_back(op);
+            if (!listener->_armed) listener->arm();
+        });
+    }
+
+    /// Stop accepting on the listening socket 'fd', which is about to be closed. Connections
+    /// accepted for it that nobody took yet are closed, pending accepts complete with -ECANCELED.
+    void closeListener(int fd) {
+        run([=, this] {
+            auto it = _listeners.find(fd);
+            if (it == _listeners.end()) return;
+            auto listener = std::move(it->second);
+            _listeners.erase(it);
+            listener->close();
+            if (!listener->_armed) return;
+            // The armed accept still refers to the listener, it goes with its last completion.
+            auto* sqe = nextSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = reinterpret_cast<std::uint64_t>(listener.release());
+            sqe->user_data = 0;
+        });
+    }
+
+private:
+    /// Recv that used a buffer from the provided buffer ring: copy it out and recycle it.
+    class ProvidedRecvOperation : public IoUringOperation {
+    public:
+        ProvidedRecvOperation(IoUringService* service, IoUringOperation* op, int fd, void* data,
+                              std::size_t size)
+            : _service(service), _op(op), _fd(fd), _data(data), _size(size) {}
+
+        void complete(int result, unsigned flags) override {
+            std::unique_ptr<ProvidedRecvOperation> self(this);
+            if (flags & IORING_CQE_F_BUFFER) {
+                auto bid = static_cast<std::uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+                char* buffer = _service->providedBuffer(bid);
+                if (result > 0) std::memcpy(_data, buffer, static_cast<std::size_t>(result));
+                _service->recycleBuffer(bid);
+            } else if (result == -ENOBUFS) {
+                // The ring ran dry, read straight into the caller's buffer instead.
+                _service->recvInto(_fd, _data, _size, _op);
+                _service->scheduleFlush();
+                return;
+            }
+            _op->complete(result, flags);
+        }
+
+    private:
+        IoUringService* _service;
+        IoUringOperation* _op;
+        int _fd;
+        void* _data;
+        std::size_t _size;
+    };
+
+    class MultishotAccept : public IoUringOperation {
+    public:
+        MultishotAccept(IoUringService* service, int fd) : _service(service), _fd(fd) {}
+
+        ~MultishotAccept() override {
+            for (int fd : _ready) ::close(fd);
+        }
+
+        void close() {
+            _closed = true;
+            for (int fd : _ready) ::close(fd);
+            _ready.clear();
+            // Completed from the event loop like any other operation, not from within close().
+            for (auto* op : _waiters) {
+                asio::post(_service->_ioContext, [op] { op->complete(-ECANCELED, 0); });
+            }
+            _waiters.clear();
+        }
+
+        void arm() {
+            auto* sqe = _service->nextSqe();
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = _fd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            sqe->user_data = reinterpret_cast<std::uint64_t>(this);
+            _armed = true;
+        }
+
+        void complete(int result, unsigned flags) override {
+            if (!(flags & IORING_CQE_F_MORE)) _armed = false;
+            if (_closed) {
+                if (result >= 0) ::close(result);
+                if (!_armed) delete this;
+                return;
+            }
+            if (!_waiters.empty()) {
+                auto* op = _waiters.front();
+                _waiters.pop_front();
+                op->complete(result, 0);
+            } else if (result >= 0) {
+                _ready.push_back(result);
+            }
+            if (!_armed && !_waiters.empty()) {
+                arm();
+                _service->scheduleFlush();
+            }
+        }
+
+        IoUringService* _service;
+        int _fd;
+        bool _armed = false;
+        bool _closed = false;
+        std::deque<int> _ready;
+        std::deque<IoUringOperation*> _waiters;
+    };
+
+    /// Prepare SQEs on the io_context thread, posting there when called from elsewhere.
+    template <typename F>
+    void run(F&& prepare) {
+        if (_ioContext.get_executor().running_in_this_thread()) {
+            prepare();
+            scheduleFlush();
+        } else {
+            asio::post(_ioContext, [this, prepare = std::forward<F>(prepare)]() mutable {
+                prepare();
+                scheduleFlush();
+            });
+        }
+    }
+
+    void recvInto(int fd, void* data, std::size_t size, IoUringOperation* op) {
+        auto* sqe = nextSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<std::uint64_t>(data);
+        sqe->len = static_cast<std::uint32_t>(size);
+        sqe->user_data = reinterpret_cast<std::uint64_t>(op);
+    }
+
+    bool setupRing() {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_SUBMIT_ALL;
+        _ringFd = static_cast<int>(::syscall(__NR_io_uring_setup, kEntries, &params));
+        if (_ringFd < 0) return false;
+
+        _sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        _cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap) _sqRingBytes = _cqRingBytes = std::max(_sqRingBytes, _cqRingBytes);
+
+        _sqRing = map(_sqRingBytes, IORING_OFF_SQ_RING);
+        if (!_sqRing) return false;
+        _cqRing = singleMmap ? _sqRing : map(_cqRingBytes, IORING_OFF_CQ_RING);
+        if (!_cqRing) return false;
+        _sqeBytes = params.sq_entries * sizeof(io_uring_sqe);
+        _sqes = static_cast<io_uring_sqe*>(map(_sqeBytes, IORING_OFF_SQES));
+        if (!_sqes) return false;
+
+        auto* sq = static_cast<char*>(_sqRing);
+        auto* cq = static_cast<char*>(_cqRing);
+        _sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        _sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        _sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        _sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        _sqEntries = params.sq_entries;
+        _cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        _cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        _cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        _cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    void* map(std::size_t bytes, std::uint64_t offset) const {
+        void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         _ringFd, static_cast<off_t>(offset));
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    bool setupEventFd() {
+        int efd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (efd < 0) return false;
+        if (::syscall(__NR_io_uring_register, _ringFd, IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+            ::close(efd);
+            return false;
+        }
+        _eventDescriptor.assign(efd);
+        waitCompletions();
+        return true;
+    }
+
+    /// Register the provided buffer ring used by recv. Failing is not fatal, recv then reads
+    /// straight into the caller's buffer.
+    void setupBufferRing() {
+        _bufferRingBytes = kProvidedBuffers * sizeof(io_uring_buf);
+        void* ring = ::mmap(nullptr, _bufferRingBytes, PROT_READ | PROT_WRITE,
+                            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (ring == MAP_FAILED) return;
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<std::uint64_t>(ring);
+        reg.ring_entries = kProvidedBuffers;
+        reg.bgid = kBufferGroup;
+        if (::syscall(__NR_io_uring_register, _ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            ::munmap(ring, _bufferRingBytes);
+            return;
+        }
+        // Index the entries by hand: in C++ the empty member in front of the kernel's flexible
+        // 'bufs' array shifts it by 8 bytes. The ring tail overlays the first entry's 'resv'.
+        _bufferRing = static_cast<io_uring_buf*>(ring);
+        _providedBuffers = std::make_unique<char[]>(kProvidedBuffers * kProvidedBufferSize);
+        for (unsigned i = 0; i < kProvidedBuffers; ++i) {
+            auto bid = static_cast<std::uint16_t>(i);
+            _bufferRing[i].addr = reinterpret_cast<std::uint64_t>(providedBuffer(bid));
+            _bufferRing[i].len = static_cast<std::uint32_t>(kProvidedBufferSize);
+            _bufferRing[i].bid = bid;
+        }
+        _bufferRingTail = static_cast<std::uint16_t>(kProvidedBuffers);
+        __atomic_store_n(&_bufferRing[0].resv, _bufferRingTail, __ATOMIC_RELEASE);
+    }
+
+    char* providedBuffer(std::uint16_t bid) const noexcept {
+        return _providedBuffers.get() + bid * kProvidedBufferSize;
+    }
+
+    void recycleBuffer(std::uint16_t bid) noexcept {
+        auto& buf = _bufferRing[_bufferRingTail & (kProvidedBuffers - 1)];
+        buf.addr = reinterpret_cast<std::uint64_t>(providedBuffer(bid));
+        buf.len = static_cast<std::uint32_t>(kProvidedBufferSize);
+        buf.bid = bid;
+        ++_bufferRingTail;
+        __atomic_store_n(&_bufferRing[0].resv, _bufferRingTail, __ATOMIC_RELEASE);
+    }
+
+    io_uring_sqe* nextSqe() {
+        unsigned tail = *_sqTail;
+        if (tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) == _sqEntries) {
+            flush();
+            tail = *_sqTail;
+        }
+        unsigned index = tail & _sqMask;
+        io_uring_sqe* sqe = &_sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        _sqArray[index] = index;
+        __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++_pending;
+        return sqe;
+    }
+
+    void scheduleFlush() {
+        if (_flushScheduled) return;
+        _flushScheduled = true;
+        asio::post(_ioContext, [this] {
+            _flushScheduled = false;
+            flush();
+        });
+    }
+
+    void flush() {
+        while (_pending > 0) {
+            ++_enterCount;
+            auto submitted = ::syscall(__NR_io_uring_enter, _ringFd, _pending, 0, 0, nullptr, 0);
+            if (submitted < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EBUSY) {
+                    reap();
+                    continue;
+                }
+                break;
+            }
+            _pending -= static_cast<unsigned>(submitted);
+        }
+    }
+
+    void waitCompletions() {
+        _eventDescriptor.async_wait(asio::posix::stream_descriptor::wait_read,
+                                    [this](boost::system::error_code ec) {
+                                        if (ec) return;
+                                        std::uint64_t value;
+                                        [[maybe_unused]] auto n = ::read(
+                                            _eventDescriptor.native_handle(), &value,
+                                            sizeof(value));
+                                        reap();
+                                        waitCompletions();
+                                    });
+    }
+
+    void reap() {
+        unsigned head = *_cqHead;
+        while (head != __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe cqe = _cqes[head & _cqMask];
+            __atomic_store_n(_cqHead, ++head, __ATOMIC_RELEASE);
+            if (auto* op = reinterpret_cast<IoUringOperation*>(cqe.user_data)) {
+                op->complete(cqe.res, cqe.flags);
+            }
+            head = *_cqHead;
+        }
+    }
+
+    void shutdown() override {
+        boost::system::error_code ec;
+        _eventDescriptor.close(ec);
+    }
+
+private:
+    asio::io_context& _ioContext;
+    asio::posix::stream_descriptor _eventDescriptor;
+    bool _available = false;
+    bool _flushScheduled = false;
+    unsigned _pending = 0;
+    std::uint64_t _enterCount = 0;
+
+    int _ringFd = -1;
+    void* _sqRing = nullptr;
+    void* _cqRing = nullptr;
+    io_uring_sqe* _sqes = nullptr;
+    std::size_t _sqRingBytes = 0;
+    std::size_t _cqRingBytes = 0;
+    std::size_t _sqeBytes = 0;
+    unsigned* _sqHead = nullptr;
+    unsigned* _sqTail = nullptr;
+    unsigned* _sqArray = nullptr;
+    unsigned _sqMask = 0;
+    unsigned _sqEntries = 0;
+    unsigned* _cqHead = nullptr;
+    unsigned* _cqTail = nullptr;
+    unsigned _cqMask = 0;
+    io_uring_cqe* _cqes = nullptr;
+
+    io_uring_buf* _bufferRing = nullptr;
+    std::size_t _bufferRingBytes = 0;
+    std::uint16_t _bufferRingTail = 0;
+    std::unique_ptr<char[]> _providedBuffers;
+
+    std::unordered_map<int, std::unique_ptr<MultishotAccept>> _listeners;
+};
+
+#undef asio
+
+#endif  // TINY_HTTP_SERVER_IO_URING_H
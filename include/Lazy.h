@@ -5,14 +5,20 @@
 #include <coroutine>
 #include <variant>
 
+#include "Cancellation.h"
 #include "Common.h"
 #include "DetachedCoroutine.h"
 #include "Executor.h"
+#include "Trace.h"
+#include "Traits.h"
 #include "Try.h"
 
 template <typename T>
 class Lazy;
 
+template <typename Promise>
+RequestTrace* traceOf(std::coroutine_handle<Promise> handle) noexcept;
+
 class LazyPromiseBase {
 public:
     class FinalAwaiter {
@@ -33,9 +39,18 @@ public:
 
         bool await_ready() const noexcept { return false; }
 
-        void await_suspend(std::coroutine_handle<> handle) {
+        template <typename Promise>
+        void await_suspend(std::coroutine_handle<Promise> handle) {
             logicAssert(_executor, "Yielding is only meaningful with an executor!");
-            _executor->schedule([handle]() { handle.resume(); });
+            if constexpr (std::is_base_of_v<LazyPromiseBase, Promise>) {
+                handle.promise()._queued.start(handle.promise()._trace);
+            }
+            _executor->schedule([handle]() {
+                if constexpr (std::is_base_of_v<LazyPromiseBase, Promise>) {
+                    handle.promise()._queued.stop("yield");
+                }
+                handle.resume();
+            });
         }
 
         void await_resume() noexcept {}
@@ -51,11 +66,103 @@ public:
 
     FinalAwaiter final_suspend() noexcept { return {}; }
 
+    /// Awaitables with a coAwait method, a Lazy or the awaiters of AsioCoroutineUtil.h, are
+    /// handed the executor of this coroutine, which a Lazy then runs on as well. Anything else is
+    /// awaited as it is.
+    template <typename Awaitable>
+    decltype(auto) await_transform(Awaitable&& awaitable) {
+        if constexpr (HasCoAwaitMethod<std::decay_t<Awaitable>>::value) {
+            return std::forward<Awaitable>(awaitable).coAwait(_executor);
+        } else {
+            return std::forward<Awaitable>(awaitable);
+        }
+    }
+
 public:
     std::coroutine_handle<> _handle;
     Executor* _executor;
+    /// Inherited from the awaiting Lazy unless bound with Lazy::withCancellation.
+    CancellationToken _cancellation;
+    /// Inherited from the awaiting Lazy unless bound with bindTrace.
+    RequestTrace* _trace = nullptr;
+    /// Time spent in the queue of '_executor', kept here rather than in the scheduled function
+    /// so that the function fits into std::function without an allocation.
+    TraceTimer _queued;
 };
 
+/// Cancellation token of the coroutine behind 'handle', empty unless it is a Lazy.
+template <typename Promise>
+CancellationToken cancellationOf(std::coroutine_handle<Promise> handle) noexcept {
+    if constexpr (std::is_base_of_v<LazyPromiseBase, Promise>) {
+        return handle.promise()._cancellation;
+    } else {
+        return {};
+    }
+}
+
+struct CurrentCancellationAwaiter {
+    CancellationToken token;
+
+    bool await_ready() const noexcept { return false; }
+
+    template <typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+        token = cancellationOf(handle);
+        return false;
+    }
+
+    CancellationToken await_resume() const noexcept { return token; }
+};
+
+/// 'co_await currentCancellation()' gives the cancellation token of the calling Lazy, so that
+/// long computations can check it between steps.
+inline CurrentCancellationAwaiter currentCancellation() noexcept { return {}; }
+
+/// Trace of the coroutine behind 'handle', null unless it is a Lazy with one.
+template <typename Promise>
+RequestTrace* traceOf(std::coroutine_handle<Promise> handle) noexcept {
+    if constexpr (std::is_base_of_v<LazyPromiseBase, Promise>) {
+        return handle.promise()._trace;
+    } else {
+        return nullptr;
+    }
+}
+
+struct BindTraceAwaiter {
+    RequestTrace* trace;
+
+    bool await_ready() const noexcept { return false; }
+
+    template <typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+        if constexpr (std::is_base_of_v<LazyPromiseBase, Promise>) handle.promise()._trace = trace;
+        return false;
+    }
+
+    void await_resume() const noexcept {}
+};
+
+/// 'co_await bindTrace(trace)' records the awaited operations of the calling Lazy, and of the
+/// Lazys it awaits from then on, into 'trace' while that is active.
+inline BindTraceAwaiter bindTrace(RequestTrace* trace) noexcept { return {trace}; }
+
+struct CurrentTraceAwaiter {
+    RequestTrace* trace = nullptr;
+
+    bool await_ready() const noexcept { return false; }
+
+    template <typename Promise>
+    bool await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+        trace = traceOf(handle);
+        return false;
+    }
+
+    RequestTrace* await_resume() const noexcept { return trace; }
+};
+
+/// 'co_await currentTrace()' gives the trace of the calling Lazy, for timing work done inline.
+inline CurrentTraceAwaiter currentTrace() noexcept { return {}; }
+
 template <typename T>
 class LazyPromise : public LazyPromiseBase {
 public:
@@ -195,24 +302,42 @@ public:
 
         explicit AwaiterBase(Handle co) : Base(co) {}
 
-        INLINE auto await_suspend(std::coroutine_handle<> handle) noexcept {
-            this->_handle.promise()._handle = handle;
+        template <typename Promise>
+        INLINE auto await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            auto& promise = this->_handle.promise();
+            promise._handle = handle;
+            if (!promise._cancellation) promise._cancellation = cancellationOf(handle);
+            if (!promise._trace) promise._trace = traceOf(handle);
 
             using R = std::conditional_t<reschedule, void, std::coroutine_handle<>>;
-            return awaitSuspendImpl<R>();
+            // Only a Lazy waits for the result; a detached start must not run it inline, its
+            // caller carries on right after.
+            return awaitSuspendImpl<R>(std::is_base_of_v<LazyPromiseBase, Promise>);
         }
 
     private:
         template <std::same_as<std::coroutine_handle<>> R>
-        auto awaitSuspendImpl() noexcept {
+        auto awaitSuspendImpl(bool) noexcept {
             return this->_handle;
         }
 
+        /// Already on the executor, an awaited RescheduleLazy is resumed inline, see
+        /// Executor::dispatch. Nothing of this awaiter is touched afterwards, the awaiting
+        /// coroutine may have completed by then.
         template <std::same_as<void> R>
-        auto awaitSuspendImpl() noexcept {
+        auto awaitSuspendImpl(bool awaited) noexcept {
             auto& pr = this->_handle.promise();
             logicAssert(pr._executor, "RescheduleLazy need executor");
-            pr._executor->schedule([h = this->_handle]() { h.resume(); });
+            pr._queued.start(pr._trace);
+            auto resume = [h = this->_handle]() {
+                h.promise()._queued.stop("schedule");
+                h.resume();
+            };
+            if (awaited) {
+                pr._executor->dispatch(std::move(resume));
+            } else {
+                pr._executor->schedule(std::move(resume));
+            }
         }
     };
 
@@ -281,6 +406,13 @@ public:
         this->_co.promise()._executor = ex;
         return typename Base::ValueAwaiter(std::exchange(this->_co, nullptr));
     }
+
+    /// Bind a cancellation token instead of inheriting the one of the awaiting Lazy.
+    Lazy<T> withCancellation(CancellationToken token) && {
+        logicAssert(this->_co.operator bool(), "Lazy does not have a coroutine_handle");
+        this->_co.promise()._cancellation = token;
+        return Lazy<T>(std::exchange(this->_co, nullptr));
+    }
 };
 
 /// RescheduleLazy is a Lazy with an executor.
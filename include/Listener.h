@@ -0,0 +1,109 @@
+#ifndef TINY_HTTP_SERVER_LISTENER_H
+#define TINY_HTTP_SERVER_LISTENER_H
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <boost/asio.hpp>
+#include <cerrno>
+#include <system_error>
+#include <vector>
+
+#include "AsioCoroutineUtil.h"
+#include "Lazy.h"
+
+#define asio boost::asio
+#define tcp asio::ip::tcp
+
+struct ListenerOptions {
+    /// Length of the queue of established connections waiting to be accepted.
+    int backlog = 4096;
+    /// Only report a connection once its first data arrived or after this many seconds
+    /// (TCP_DEFER_ACCEPT). Zero disables it.
+    int deferAcceptSeconds = 0;
+    /// Queue length of pending TCP Fast Open requests. Zero disables Fast Open.
+    int fastOpenQueueLength = 0;
+    /// Upper bound of connections accepted per wakeup.
+    std::size_t acceptBatchSize = 64;
+};
+
+/// A listening socket that drains every pending connection per wakeup.
+/// Instead of resuming the accepting coroutine once per connection, the non-blocking listener
+/// is polled for readability and then accept4 is called until EAGAIN.
+class Listener {
+public:
+    Listener(asio::io_context& ioContext, unsigned short port, const ListenerOptions& options)
+        : _acceptor(ioContext), _options(options) {
+        tcp::endpoint endpoint(tcp::v4(), port);
+        _acceptor.open(endpoint.protocol());
+        _acceptor.set_option(tcp::acceptor::reuse_address(true));
+        if (options.deferAcceptSeconds > 0) {
+            setOption(IPPROTO_TCP, TCP_DEFER_ACCEPT, options.deferAcceptSeconds);
+        }
+        if (options.fastOpenQueueLength > 0) {
+            setOption(IPPROTO_TCP, TCP_FASTOPEN, options.fastOpenQueueLength);
+        }
+        _acceptor.bind(endpoint);
+        _acceptor.listen(options.backlog);
+        _acceptor.non_blocking(true);
+    }
+
+    /// Adopt an already listening socket, e.g. one inherited from the process being replaced.
+    Listener(asio::io_context& ioContext, int fd, const ListenerOptions& options)
+        : _acceptor(ioContext), _options(options) {
+        _acceptor.assign(tcp::v4(), fd);
+        _acceptor.non_blocking(true);
+    }
+
+    tcp::acceptor& acceptor() { return _acceptor; }
+
+    /// Stop accepting, a pending acceptBatch completes with operation_aborted.
+    /// Connections queued on the socket stay there for other processes sharing it.
+    void close() {
+        boost::system::error_code ec;
+        _acceptor.close(ec);
+    }
+
+    /// Append the descriptors of all pending connections to 'fds', waiting for at least one.
+    /// The descriptors are non-blocking and owned by the caller.
+    Lazy<std::error_code> acceptBatch(std::vector<int>& fds) {
+        while (true) {
+            if (auto ec = drain(fds); ec || !fds.empty()) co_return ec;
+            if (auto ec = co_await asyncWaitReadable(_acceptor); ec) co_return ec;
+        }
+    }
+
+private:
+    std::error_code drain(std::vector<int>& fds) {
+        while (fds.size() < _options.acceptBatchSize) {
+            int fd = ::accept4(_acceptor.native_handle(), nullptr, nullptr,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd >= 0) {
+                fds.push_back(fd);
+                continue;
+            }
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            // Report hard errors (e.g. EMFILE) only when there is nothing to hand out.
+            if (fds.empty()) return {errno, std::system_category()};
+            break;
+        }
+        return {};
+    }
+
+    void setOption(int level, int name, int value) {
+        if (::setsockopt(_acceptor.native_handle(), level, name, &value, sizeof(value)) != 0) {
+            throw std::system_error(errno, std::system_category(), "setsockopt");
+        }
+    }
+
+private:
+    tcp::acceptor _acceptor;
+    ListenerOptions _options;
+};
+
+#undef tcp
+#undef asio
+
+#endif  // TINY_HTTP_SERVER_LISTENER_H
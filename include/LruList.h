@@ -0,0 +1,100 @@
+#ifndef TINY_HTTP_SERVER_LRU_LIST_H
+#define TINY_HTTP_SERVER_LRU_LIST_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+/// Entries ordered from the most to the least recently used one, indexed by the string each
+/// holds in 'Key'. List nodes never move, so the index keys view the entries' own strings.
+/// Not synchronized.
+template <typename Entry, std::string Entry::*Key>
+class LruList {
+public:
+    using iterator = typename std::list<Entry>::iterator;
+
+    /// The entry of 'key' where it is, null when there is none.
+    Entry* find(std::string_view key) {
+        auto it = _index.find(key);
+        return it == _index.end() ? nullptr : &*it->second;
+    }
+
+    /// The entry of 'key', made the most recently used one. Null when there is none.
+    Entry* touch(std::string_view key) {
+        auto it = _index.find(key);
+        if (it == _index.end()) return nullptr;
+        _entries.splice(_entries.begin(), _entries, it->second);
+        return &*it->second;
+    }
+
+    /// Make 'entry', which is in this list, the most recently used one.
+    void moveToFront(Entry& entry) {
+        _entries.splice(_entries.begin(), _entries, _index.at(entry.*Key));
+    }
+
+    /// Add 'entry' as the most recently used one. Its key must not be in the list yet.
+    Entry& pushFront(Entry entry) {
+        _entries.push_front(std::move(entry));
+        _index.emplace(_entries.front().*Key, _entries.begin());
+        return _entries.front();
+    }
+
+    /// Remove the entry at 'it', giving the one after it.
+    iterator erase(iterator it) {
+        _index.erase((*it).*Key);
+        return _entries.erase(it);
+    }
+
+    void erase(Entry& entry) { erase(_index.at(entry.*Key)); }
+
+    /// Remove the least recently used entry.
+    void popBack() { erase(std::prev(_entries.end())); }
+
+    /// Walks from the most recently used entry.
+    iterator begin() noexcept { return _entries.begin(); }
+
+    iterator end() noexcept { return _entries.end(); }
+
+    [[nodiscard]] std::size_t size() const noexcept { return _entries.size(); }
+
+    void reserve(std::size_t count) { _index.reserve(count); }
+
+    void clear() noexcept {
+        _index.clear();
+        _entries.clear();
+    }
+
+private:
+    std::list<Entry> _entries;
+    std::unordered_map<std::string_view, iterator> _index;
+};
+
+/// 'Count' instances of 'Shard', one picked by the hash of a key, so that process-wide caches
+/// take a lock of one shard instead of a global one.
+template <typename Shard, std::size_t Count = 16>
+class Sharded {
+public:
+    Shard& of(std::string_view key) {
+        return _shards[std::hash<std::string_view>{}(key) % Count];
+    }
+
+    /// Each shard's part of a limit of 'total', at least one.
+    static constexpr std::size_t share(std::size_t total) noexcept {
+        return std::max<std::size_t>(total / Count, 1);
+    }
+
+    auto begin() noexcept { return _shards.begin(); }
+
+    auto end() noexcept { return _shards.end(); }
+
+private:
+    std::array<Shard, Count> _shards;
+};
+
+#endif  // TINY_HTTP_SERVER_LRU_LIST_H
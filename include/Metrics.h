@@ -0,0 +1,374 @@
+#ifndef TINY_HTTP_SERVER_METRICS_H
+#define TINY_HTTP_SERVER_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "HttpResponse.h"
+
+/// A monotonically increasing counter written by a single thread.
+/// Updates are a relaxed load plus a relaxed store instead of a read-modify-write, so the owning
+/// thread never locks the bus; scrapes read the value concurrently.
+class Counter {
+public:
+    void add(std::uint64_t n = 1) noexcept {
+        _value.store(_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::uint64_t load() const noexcept { return _value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<std::uint64_t> _value{0};
+};
+
+/// A single-writer gauge. A value may go negative in one shard when the decrement happens on
+/// another thread than the increment; only the sum over all shards is meaningful.
+class Gauge {
+public:
+    void add(std::int64_t n = 1) noexcept {
+        _value.store(_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void sub(std::int64_t n = 1) noexcept { add(-n); }
+
+    std::int64_t load() const noexcept { return _value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<std::int64_t> _value{0};
+};
+
+/// Log-linear histogram of microsecond values: every power of two is split into 4 linear
+/// sub-buckets, which keeps the relative error under 25% with a fixed number of buckets.
+class LatencyHistogram {
+public:
+    static constexpr unsigned kSubBucketBits = 2;
+    static constexpr unsigned kSubBuckets = 1u << kSubBucketBits;
+    /// Largest tracked magnitude is 2^kMaxBits microseconds (~67s), bigger values only count
+    /// towards +Inf.
+    static constexpr unsigned kMaxBits = 26;
+    static constexpr std::size_t kBucketCount = (kMaxBits - kSubBucketBits + 1) * kSubBuckets;
+    /// Slot after the finite buckets that collects values of 2^kMaxBits and above.
+    static constexpr std::size_t kOverflowIndex = kBucketCount;
+
+    static constexpr std::size_t bucketIndex(std::uint64_t micros) noexcept {
+        if (micros < kSubBuckets) return static_cast<std::size_t>(micros);
+        unsigned msb = static_cast<unsigned>(std::bit_width(micros)) - 1;
+        if (msb >= kMaxBits) return kOverflowIndex;
+        unsigned shift = msb - kSubBucketBits;
+        auto sub = static_cast<std::size_t>((micros >> shift) & (kSubBuckets - 1));
+        return (msb - kSubBucketBits + 1) * kSubBuckets + sub;
+    }
+
+    /// Inclusive upper bound of a bucket in microseconds.
+    static constexpr std::uint64_t bucketUpperBound(std::size_t index) noexcept {
+        if (index < kSubBuckets) return index;
+        unsigned shift = static_cast<unsigned>(index / kSubBuckets) - 1;
+        std::uint64_t sub = index % kSubBuckets;
+        return ((kSubBuckets + sub + 1) << shift) - 1;
+    }
+
+    void record(std::uint64_t micros) noexcept {
+        _buckets[bucketIndex(micros)].add();
+        _sum.add(micros);
+    }
+
+    std::uint64_t bucket(std::size_t index) const noexcept { return _buckets[index].load(); }
+
+    std::uint64_t sum() const noexcept { return _sum.load(); }
+
+private:
+    std::array<Counter, kBucketCount + 1> _buckets;
+    Counter _sum;
+};
+
+/// Statuses that get their own request counter.
+constexpr std::array kTrackedStatuses = {StatusType::ok,
+                                         StatusType::created,
+                                         StatusType::accepted,
+                                         StatusType::no_content,
+                                         StatusType::multiple_choices,
+                                         StatusType::moved_permanently,
+                                         StatusType::moved_temporarily,
+                                         StatusType::not_modified,
+                                         StatusType::bad_request,
+                                         StatusType::unauthorized,
+                                         StatusType::forbidden,
+                                         StatusType::not_found,
+                                         StatusType::too_many_requests,
+                                         StatusType::request_header_fields_too_large,
+                                         StatusType::internal_server_error,
+                                         StatusType::not_implemented,
+                                         StatusType::bad_gateway,
+                                         StatusType::service_unavailable,
+                                         StatusType::gateway_timeout};
+
+/// Counters of one io_context thread, padded to its own cache lines so that shards never share
+/// a line with each other.
+struct alignas(64) MetricsShard {
+    Counter accepts;
+    Gauge activeConnections;
+    Counter bytesIn;
+    Counter bytesOut;
+    Counter parseFailures;
+    Counter accessLogDrops;
+    Counter webSocketMessagesIn;
+    Counter webSocketMessagesOut;
+    Counter upstreamConnects;
+    Counter upstreamEjections;
+    Counter proxyClientAborts;
+    Counter dnsLookups;
+    Counter dnsCacheHits;
+    Counter connectionsShed;
+    Counter acceptPauses;
+    Counter requestsShed;
+    Counter requestsShedQueueDelay;
+    Counter rateLimited;
+    Counter rateLimitEvictions;
+    Counter fileOpens;
+    Counter openFileCacheHits;
+    Counter tlsHandshakes;
+    Counter tlsResumedHandshakes;
+    Counter tlsHandshakeFailures;
+    Counter kernelTlsConnections;
+    Counter fileReadsCached;
+    Counter fileReadsOffloaded;
+    Counter requestsTraced;
+    Counter slowRequests;
+    Counter forcedYields;
+    std::array<Counter, 3> laneTasks;
+    Counter responseCacheHits;
+    Counter responseCacheStaleHits;
+    Counter responseCacheMisses;
+    Counter responseCacheCoalesced;
+    Counter responseCachePasses;
+    Counter responseCacheEvictions;
+    std::array<Counter, kTrackedStatuses.size()> requests;
+    LatencyHistogram latency;
+
+    void countRequest(StatusType status) noexcept {
+        for (std::size_t i = 0; i < kTrackedStatuses.size(); ++i) {
+            if (kTrackedStatuses[i] == status) {
+                requests[i].add();
+                return;
+            }
+        }
+    }
+};
+
+/// Process-wide registry of metric shards.
+/// Each thread lazily registers its own shard (the only time a lock is taken) and afterwards
+/// updates it without synchronization. Values are only summed up when they are scraped.
+class Metrics {
+public:
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    /// Shard of the calling thread.
+    static MetricsShard& local() {
+        thread_local MetricsShard& shard = instance().registerShard();
+        return shard;
+    }
+
+    /// Number of open connections summed over all threads.
+    std::int64_t activeConnections() {
+        std::int64_t active = 0;
+        std::lock_guard lock(_mutex);
+        for (const auto& shard : _shards) active += shard->activeConnections.load();
+        return active;
+    }
+
+    /// Render all metrics in the Prometheus text exposition format.
+    std::string renderPrometheus() {
+        std::uint64_t accepts = 0, bytesIn = 0, bytesOut = 0, parseFailures = 0, logDrops = 0;
+        std::uint64_t latencySum = 0, wsIn = 0, wsOut = 0, upstreamConnects = 0, ejections = 0;
+        std::uint64_t dnsLookups = 0, dnsCacheHits = 0, connectionsShed = 0, acceptPauses = 0;
+        std::uint64_t requestsShed = 0, requestsShedQueueDelay = 0, rateLimited = 0;
+        std::uint64_t rateLimitEvictions = 0, fileOpens = 0, openFileCacheHits = 0;
+        std::uint64_t tlsHandshakes = 0, tlsResumed = 0, tlsFailures = 0, kernelTls = 0;
+        std::uint64_t fileReadsCached = 0, fileReadsOffloaded = 0, traced = 0, slow = 0;
+        std::uint64_t forcedYields = 0, clientAborts = 0;
+        std::array<std::uint64_t, 3> laneTasks{};
+        std::uint64_t cacheHits = 0, cacheStaleHits = 0, cacheMisses = 0, cacheCoalesced = 0;
+        std::uint64_t cachePasses = 0, cacheEvictions = 0;
+        std::int64_t active = 0;
+        std::array<std::uint64_t, kTrackedStatuses.size()> requests{};
+        std::array<std::uint64_t, LatencyHistogram::kBucketCount + 1> buckets{};
+        {
+            std::lock_guard lock(_mutex);
+            for (const auto& shard : _shards) {
+                accepts += shard->accepts.load();
+                active += shard->activeConnections.load();
+                bytesIn += shard->bytesIn.load();
+                bytesOut += shard->bytesOut.load();
+                parseFailures += shard->parseFailures.load();
+                logDrops += shard->accessLogDrops.load();
+                wsIn += shard->webSocketMessagesIn.load();
+                wsOut += shard->webSocketMessagesOut.load();
+                upstreamConnects += shard->upstreamConnects.load();
+                ejections += shard->upstreamEjections.load();
+                clientAborts += shard->proxyClientAborts.load();
+                dnsLookups += shard->dnsLookups.load();
+                dnsCacheHits += shard->dnsCacheHits.load();
+                connectionsShed += shard->connectionsShed.load();
+                acceptPauses += shard->acceptPauses.load();
+                requestsShed += shard->requestsShed.load();
+                requestsShedQueueDelay += shard->requestsShedQueueDelay.load();
+                rateLimited += shard->rateLimited.load();
+                rateLimitEvictions += shard->rateLimitEvictions.load();
+                fileOpens += shard->fileOpens.load();
+                openFileCacheHits += shard->openFileCacheHits.load();
+                tlsHandshakes += shard->tlsHandshakes.load();
+                tlsResumed += shard->tlsResumedHandshakes.load();
+                tlsFailures += shard->tlsHandshakeFailures.load();
+                kernelTls += shard->kernelTlsConnections.load();
+                fileReadsCached += shard->fileReadsCached.load();
+                fileReadsOffloaded += shard->fileReadsOffloaded.load();
+                traced += shard->requestsTraced.load();
+                slow += shard->slowRequests.load();
+                forcedYields += shard->forcedYields.load();
+                for (std::size_t i = 0; i < laneTasks.size(); ++i) {
+                    laneTasks[i] += shard->laneTasks[i].load();
+                }
+                cacheHits += shard->responseCacheHits.load();
+                cacheStaleHits += shard->responseCacheStaleHits.load();
+                cacheMisses += shard->responseCacheMisses.load();
+                cacheCoalesced += shard->responseCacheCoalesced.load();
+                cachePasses += shard->responseCachePasses.load();
+                cacheEvictions += shard->responseCacheEvictions.load();
+                for (std::size_t i = 0; i < requests.size(); ++i) {
+                    requests[i] += shard->requests[i].load();
+                }
+                for (std::size_t i = 0; i < buckets.size(); ++i) {
+                    buckets[i] += shard->latency.bucket(i);
+                }
+                latencySum += shard->latency.sum();
+            }
+        }
+
+        std::string out;
+        out.reserve(8192);
+        auto metric = [&out](std::string_view name, std::string_view type, std::string_view help) {
+            out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+            out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+        };
+        auto sample = [&out](std::string_view name, std::string_view labels, auto value) {
+            out.append(name);
+            if (!labels.empty()) out.append("{").append(labels).append("}");
+            out.append(" ").append(std::to_string(value)).append("\n");
+        };
+
+        metric("http_accepts_total", "counter", "Accepted TCP connections.");
+        sample("http_accepts_total", "", accepts);
+        metric("http_active_connections", "gauge", "Currently open connections.");
+        sample("http_active_connections", "", active);
+        metric("http_bytes_received_total", "counter", "Bytes read from clients.");
+        sample("http_bytes_received_total", "", bytesIn);
+        metric("http_bytes_sent_total", "counter", "Bytes written to clients.");
+        sample("http_bytes_sent_total", "", bytesOut);
+        metric("http_parse_failures_total", "counter", "Requests rejected by the parser.");
+        sample("http_parse_failures_total", "", parseFailures);
+        metric("access_log_dropped_total", "counter", "Access log records dropped on full rings.");
+        sample("access_log_dropped_total", "", logDrops);
+        metric("websocket_messages_received_total", "counter", "WebSocket messages read.");
+        sample("websocket_messages_received_total", "", wsIn);
+        metric("websocket_messages_sent_total", "counter", "WebSocket messages written.");
+        sample("websocket_messages_sent_total", "", wsOut);
+        metric("proxy_upstream_connects_total", "counter", "Connections opened to upstreams.");
+        sample("proxy_upstream_connects_total", "", upstreamConnects);
+        metric("proxy_upstream_ejections_total", "counter", "Upstreams ejected after failures.");
+        sample("proxy_upstream_ejections_total", "", ejections);
+        metric("proxy_client_aborts_total", "counter", "Proxied requests whose client left.");
+        sample("proxy_client_aborts_total", "", clientAborts);
+        metric("dns_lookups_total", "counter", "Host names sent to the resolver.");
+        sample("dns_lookups_total", "", dnsLookups);
+        metric("dns_cache_hits_total", "counter", "Host names answered from the cache.");
+        sample("dns_cache_hits_total", "", dnsCacheHits);
+        metric("http_connections_shed_total", "counter", "Connections refused at the cap.");
+        sample("http_connections_shed_total", "", connectionsShed);
+        metric("http_accept_pauses_total", "counter", "Times accepting paused at the cap.");
+        sample("http_accept_pauses_total", "", acceptPauses);
+        metric("http_requests_shed_total", "counter", "Requests answered with 503 on overload.");
+        sample("http_requests_shed_total", "reason=\"in_flight\"", requestsShed);
+        sample("http_requests_shed_total", "reason=\"queue_delay\"", requestsShedQueueDelay);
+        metric("http_rate_limited_total", "counter", "Requests refused with 429.");
+        sample("http_rate_limited_total", "", rateLimited);
+        metric("rate_limit_evictions_total", "counter", "Active client buckets taken over.");
+        sample("rate_limit_evictions_total", "", rateLimitEvictions);
+        metric("static_file_opens_total", "counter", "Static files opened, including failures.");
+        sample("static_file_opens_total", "", fileOpens);
+        metric("open_file_cache_hits_total", "counter", "Static files served from the cache.");
+        sample("open_file_cache_hits_total", "", openFileCacheHits);
+        metric("tls_handshakes_total", "counter", "Completed TLS handshakes.");
+        sample("tls_handshakes_total", "resumed=\"false\"", tlsHandshakes - tlsResumed);
+        sample("tls_handshakes_total", "resumed=\"true\"", tlsResumed);
+        metric("tls_handshake_failures_total", "counter", "TLS handshakes that failed.");
+        sample("tls_handshake_failures_total", "", tlsFailures);
+        metric("tls_kernel_offload_total", "counter", "TLS connections sending through kTLS.");
+        sample("tls_kernel_offload_total", "", kernelTls);
+        metric("file_reads_total", "counter", "Static file reads, by where they were made.");
+        sample("file_reads_total", "path=\"page_cache\"", fileReadsCached);
+        sample("file_reads_total", "path=\"offloaded\"", fileReadsOffloaded);
+        metric("trace_requests_total", "counter", "Requests sampled for tracing or logged slow.");
+        sample("trace_requests_total", "kind=\"sampled\"", traced);
+        sample("trace_requests_total", "kind=\"slow\"", slow);
+        metric("scheduler_forced_yields_total", "counter",
+               "Connections made to yield after running over their budget.");
+        sample("scheduler_forced_yields_total", "", forcedYields);
+        metric("scheduler_lane_tasks_total", "counter", "Functions scheduled, by lane.");
+        sample("scheduler_lane_tasks_total", "lane=\"high\"", laneTasks[0]);
+        sample("scheduler_lane_tasks_total", "lane=\"normal\"", laneTasks[1]);
+        sample("scheduler_lane_tasks_total", "lane=\"low\"", laneTasks[2]);
+        metric("proxy_cache_requests_total", "counter", "Cacheable proxied requests, by outcome.");
+        sample("proxy_cache_requests_total", "result=\"hit\"", cacheHits);
+        sample("proxy_cache_requests_total", "result=\"stale\"", cacheStaleHits);
+        sample("proxy_cache_requests_total", "result=\"miss\"", cacheMisses);
+        sample("proxy_cache_requests_total", "result=\"coalesced\"", cacheCoalesced);
+        sample("proxy_cache_requests_total", "result=\"pass\"", cachePasses);
+        metric("proxy_cache_evictions_total", "counter", "Cached responses evicted for space.");
+        sample("proxy_cache_evictions_total", "", cacheEvictions);
+
+        metric("http_requests_total", "counter", "Responses sent, by status code.");
+        for (std::size_t i = 0; i < requests.size(); ++i) {
+            auto label = "code=\"" + std::to_string(static_cast<int>(kTrackedStatuses[i])) + "\"";
+            sample("http_requests_total", label, requests[i]);
+        }
+
+        metric("http_request_duration_seconds", "histogram", "Request service time.");
+        std::uint64_t cumulative = 0;
+        for (std::size_t i = 0; i < LatencyHistogram::kBucketCount; ++i) {
+            cumulative += buckets[i];
+            auto le = static_cast<double>(LatencyHistogram::bucketUpperBound(i)) / 1e6;
+            sample("http_request_duration_seconds_bucket", "le=\"" + std::to_string(le) + "\"",
+                   cumulative);
+        }
+        cumulative += buckets[LatencyHistogram::kOverflowIndex];
+        sample("http_request_duration_seconds_bucket", "le=\"+Inf\"", cumulative);
+        sample("http_request_duration_seconds_sum", "",
+               static_cast<double>(latencySum) / 1e6);
+        sample("http_request_duration_seconds_count", "", cumulative);
+        return out;
+    }
+
+private:
+    Metrics() = default;
+
+    MetricsShard& registerShard() {
+        std::lock_guard lock(_mutex);
+        _shards.push_back(std::make_unique<MetricsShard>());
+        return *_shards.back();
+    }
+
+private:
+    std::mutex _mutex;
+    std::vector<std::unique_ptr<MetricsShard>> _shards;
+};
+
+#endif  // TINY_HTTP_SERVER_METRICS_H
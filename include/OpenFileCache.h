@@ -0,0 +1,174 @@
+#ifndef TINY_HTTP_SERVER_OPEN_FILE_CACHE_H
+#define TINY_HTTP_SERVER_OPEN_FILE_CACHE_H
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include "LruList.h"
+#include "Metrics.h"
+
+struct OpenFileCacheOptions {
+    /// Files kept open, the least recently used ones are closed beyond this. Disabled while 0.
+    std::size_t maxEntries = 1024;
+    /// How long an entry is used as it is. After that the file is looked at again with stat,
+    /// and reopened when it changed, so replaced files are picked up after at most this long.
+    std::chrono::milliseconds validity = std::chrono::seconds(5);
+    /// Also remember files that could not be opened, e.g. missing ones, for 'validity'.
+    bool cacheErrors = true;
+};
+
+/// A regular file opened for reading, closed once the cache and every reader let go of it.
+/// Readers use pread, so one descriptor serves any number of threads at once.
+class OpenFile {
+public:
+    OpenFile(int fd, const struct stat& st) noexcept
+        : _fd(fd),
+          _size(static_cast<std::uint64_t>(st.st_size)),
+          _mtime(st.st_mtim),
+          _inode(st.st_ino),
+          _device(st.st_dev) {}
+
+    OpenFile(const OpenFile&) = delete;
+
+    OpenFile& operator=(const OpenFile&) = delete;
+
+    ~OpenFile() { ::close(_fd); }
+
+    [[nodiscard]] int fd() const noexcept { return _fd; }
+
+    [[nodiscard]] std::uint64_t size() const noexcept { return _size; }
+
+    [[nodiscard]] const timespec& mtime() const noexcept { return _mtime; }
+
+    [[nodiscard]] ino_t inode() const noexcept { return _inode; }
+
+    /// Whether 'st' describes this very version of the file.
+    [[nodiscard]] bool sameAs(const struct stat& st) const noexcept {
+        return st.st_ino == _inode && st.st_dev == _device &&
+               static_cast<std::uint64_t>(st.st_size) == _size &&
+               st.st_mtim.tv_sec == _mtime.tv_sec && st.st_mtim.tv_nsec == _mtime.tv_nsec;
+    }
+
+private:
+    int _fd;
+    std::uint64_t _size;
+    timespec _mtime;
+    ino_t _inode;
+    dev_t _device;
+};
+
+/// Process-wide cache of open static files, in the spirit of nginx's open_file_cache.
+/// A hit costs no system call at all. Entries are trusted for 'validity', then revalidated with
+/// a single stat, and files that failed to open are cached as well so that requests for missing
+/// ones do not hit the file system every time. Entries are spread over shards, each with its
+/// own lock and LRU list; file system calls are made outside of the locks.
+class OpenFileCache {
+    using Clock = std::chrono::steady_clock;
+
+public:
+    using File = std::shared_ptr<const OpenFile>;
+
+    static OpenFileCache& instance() {
+        static OpenFileCache cache;
+        return cache;
+    }
+
+    void setOptions(const OpenFileCacheOptions& options) {
+        _options = options;
+        for (auto& shard : _shards) {
+            std::lock_guard lock(shard.mutex);
+            shard.entries.clear();
+        }
+    }
+
+    /// Open the regular file at 'path' for reading. Anything but a regular file fails with
+    /// no_such_file_or_directory.
+    std::pair<std::error_code, File> open(std::string_view path) {
+        if (_options.maxEntries == 0) return openFile(std::string(path));
+
+        auto now = Clock::now();
+        Shard& shard = _shards.of(path);
+        std::error_code error;
+        File file;
+        {
+            std::lock_guard lock(shard.mutex);
+            if (const Entry* entry = shard.entries.touch(path)) {
+                if (now < entry->checkedAt + _options.validity) {
+                    Metrics::local().openFileCacheHits.add();
+                    return {entry->error, entry->file};
+                }
+                error = entry->error;
+                file = entry->file;
+            }
+        }
+
+        std::string key(path);
+        struct stat st {};
+        if (file && ::stat(key.c_str(), &st) == 0 && file->sameAs(st)) {
+            // Unchanged, trust it for another period.
+            Metrics::local().openFileCacheHits.add();
+            store(shard, std::move(key), error, file, now);
+            return {error, std::move(file)};
+        }
+        std::tie(error, file) = openFile(key);
+        if (!error || _options.cacheErrors) store(shard, std::move(key), error, file, now);
+        return {error, std::move(file)};
+    }
+
+private:
+    struct Entry {
+        std::string path;
+        std::error_code error;
+        File file;
+        Clock::time_point checkedAt;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        LruList<Entry, &Entry::path> entries;
+    };
+
+    OpenFileCache() = default;
+
+    void store(Shard& shard, std::string path, std::error_code error, File file,
+               Clock::time_point now) {
+        std::lock_guard lock(shard.mutex);
+        if (Entry* entry = shard.entries.find(path)) {
+            entry->error = error;
+            entry->file = std::move(file);
+            entry->checkedAt = now;
+            return;
+        }
+        if (shard.entries.size() >= _shards.share(_options.maxEntries)) shard.entries.popBack();
+        shard.entries.pushFront({std::move(path), error, std::move(file), now});
+    }
+
+    static std::pair<std::error_code, File> openFile(const std::string& path) {
+        Metrics::local().fileOpens.add();
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return {std::error_code(errno, std::system_category()), nullptr};
+        struct stat st {};
+        if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            ::close(fd);
+            return {std::make_error_code(std::errc::no_such_file_or_directory), nullptr};
+        }
+        return {{}, std::make_shared<const OpenFile>(fd, st)};
+    }
+
+private:
+    OpenFileCacheOptions _options;
+    Sharded<Shard> _shards;
+};
+
+#endif  // TINY_HTTP_SERVER_OPEN_FILE_CACHE_H
@@ -0,0 +1,128 @@
+#ifndef TINY_HTTP_SERVER_PRIORITY_LANES_H
+#define TINY_HTTP_SERVER_PRIORITY_LANES_H
+
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "Executor.h"
+#include "Metrics.h"
+
+#define asio boost::asio
+
+struct LaneOptions {
+    /// Functions run from the high, normal and low priority lane per pass over the lanes. Every
+    /// lane with work waiting gets its share of each pass, so none of them starves.
+    std::array<unsigned, 3> weights{8, 4, 1};
+    /// Requests whose path starts with one of these are served on the high priority lane, as
+    /// are the metrics and trace endpoints and the admin listener.
+    std::vector<std::string> highPriorityPaths{"/health"};
+    /// Static files up to this size are served on the high priority lane.
+    std::uint64_t smallFileSize = 16 << 10;
+    /// Static files from this size on are served on the low priority lane, like proxied requests.
+    std::uint64_t bulkFileSize = 1 << 20;
+};
+
+/// The queues work scheduled on an io_context waits in, one per Priority. Functions are not
+/// posted one by one but run by a drain handler, which takes up to the weight of every lane in
+/// a pass, highest priority first, and posts itself again while work is left. Whatever the
+/// io_context queued meanwhile, socket completions above all, runs between two passes.
+class PriorityLanes : public asio::execution_context::service {
+public:
+    using key_type = PriorityLanes;
+    static inline asio::execution_context::id id;
+
+    using Func = std::function<void()>;
+
+    static constexpr std::size_t kLanes = 3;
+
+    explicit PriorityLanes(asio::execution_context& ctx)
+        : asio::execution_context::service(ctx), _ioContext(static_cast<asio::io_context&>(ctx)) {}
+
+    /// Lanes of an io_context.
+    static PriorityLanes& of(asio::io_context& ioContext) {
+        return asio::use_service<PriorityLanes>(ioContext);
+    }
+
+    static void setWeights(const std::array<unsigned, kLanes>& weights) noexcept {
+        for (std::size_t i = 0; i < kLanes; ++i) _weights[i] = weights[i] > 0 ? weights[i] : 1;
+    }
+
+    /// Queue 'func' on the lane of 'priority', from any thread.
+    void push(Func func, Priority priority) {
+        auto lane = static_cast<std::size_t>(priority);
+        Metrics::local().laneTasks[lane].add();
+        bool idle;
+        {
+            std::lock_guard lock(_mutex);
+            _lanes[lane].push_back(std::move(func));
+            idle = !std::exchange(_draining, true);
+        }
+        if (idle) asio::post(_ioContext, [this] { drain(); });
+    }
+
+    /// 'co_await lanes.enter(priority)' continues the coroutine from the lane of 'priority',
+    /// behind the work already waiting there.
+    auto enter(Priority priority) noexcept {
+        struct Awaiter {
+            PriorityLanes& lanes;
+            Priority priority;
+
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) {
+                lanes.push([handle] { handle.resume(); }, priority);
+            }
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{*this, priority};
+    }
+
+private:
+    void drain() {
+        {
+            std::lock_guard lock(_mutex);
+            for (std::size_t i = 0; i < kLanes; ++i) {
+                for (unsigned n = 0; n < _weights[i] && !_lanes[i].empty(); ++n) {
+                    _pass.push_back(std::move(_lanes[i].front()));
+                    _lanes[i].pop_front();
+                }
+            }
+        }
+        // Only the thread running the drain handler touches the pass, there is one at a time.
+        for (auto& func : _pass) func();
+        _pass.clear();
+        bool more;
+        {
+            std::lock_guard lock(_mutex);
+            more = !_lanes[0].empty() || !_lanes[1].empty() || !_lanes[2].empty();
+            _draining = more;
+        }
+        if (more) asio::post(_ioContext, [this] { drain(); });
+    }
+
+    void shutdown() override {
+        std::lock_guard lock(_mutex);
+        for (auto& lane : _lanes) lane.clear();
+    }
+
+    static inline std::array<unsigned, kLanes> _weights{8, 4, 1};
+
+    asio::io_context& _ioContext;
+    std::mutex _mutex;
+    std::array<std::deque<Func>, kLanes> _lanes;
+    bool _draining = false;
+    std::vector<Func> _pass;
+};
+
+#undef asio
+
+#endif  // TINY_HTTP_SERVER_PRIORITY_LANES_H
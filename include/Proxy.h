@@ -0,0 +1,977 @@
+#ifndef TINY_HTTP_SERVER_PROXY_H
+#define TINY_HTTP_SERVER_PROXY_H
+
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <array>
+#include <boost/asio.hpp>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "AsioCoroutineUtil.h"
+#include "BufferPool.h"
+#include "HttpRequest.h"
+#include "HttpResponse.h"
+#include "Lazy.h"
+#include "Metrics.h"
+#include "ResponseCache.h"
+#include "Tls.h"
+
+#define asio boost::asio
+#define tcp asio::ip::tcp
+
+struct ProxyOptions {
+    /// Requests whose path starts with this are forwarded to the upstreams.
+    std::string pathPrefix = "/";
+    /// Upstreams as "host:port". Proxying is disabled while empty.
+    std::vector<std::string> upstreams;
+    /// Idle keep-alive connections kept per upstream on every io thread.
+    std::size_t maxIdlePerUpstream = 32;
+    /// Idle connections older than this are closed instead of reused.
+    std::chrono::milliseconds idleTimeout = std::chrono::seconds(30);
+    /// Consecutive failures after which an upstream is ejected.
+    unsigned maxFailures = 3;
+    /// How long an ejected upstream gets no requests.
+    std::chrono::milliseconds ejectionTime = std::chrono::seconds(10);
+    /// Connecting to an upstream, including the lookup of its name, is given up after this.
+    std::chrono::milliseconds connectTimeout = std::chrono::seconds(5);
+    /// Time an upstream has to start its response once the request was sent.
+    std::chrono::milliseconds responseTimeout = std::chrono::seconds(60);
+    /// Micro-cache of the responses to GET and HEAD requests, disabled by default.
+    ResponseCacheOptions cache;
+};
+
+/// Tracks where a message body ends without decoding it, so that bodies are forwarded verbatim.
+class BodyFraming {
+public:
+    /// A body of 'length' bytes, zero for messages without one.
+    static BodyFraming ofLength(std::uint64_t length) {
+        BodyFraming framing;
+        framing._remaining = length;
+        framing._state = length ? State::data : State::done;
+        return framing;
+    }
+
+    static BodyFraming chunked() {
+        BodyFraming framing;
+        framing._chunked = true;
+        framing._state = State::size;
+        return framing;
+    }
+
+    /// A body that ends when the connection is closed.
+    static BodyFraming untilClose() {
+        BodyFraming framing;
+        framing._untilClose = true;
+        framing._state = State::data;
+        return framing;
+    }
+
+    /// How many of the 'len' bytes at 'data' belong to the body.
+    std::size_t consume(const char* data, std::size_t len) {
+        if (_untilClose) return len;
+        std::size_t i = 0;
+        while (i < len && _state != State::done && _state != State::failed) {
+            if (_state == State::data) {
+                auto n = static_cast<std::size_t>(std::min<std::uint64_t>(_remaining, len - i));
+                _remaining -= n;
+                i += n;
+                if (_remaining == 0) _state = _chunked ? State::dataCr : State::done;
+                continue;
+            }
+            char c = data[i++];
+            switch (_state) {
+                case State::size:
+                    if (int digit = hexValue(c); digit >= 0 && _remaining >> 56 == 0) {
+                        _remaining = _remaining << 4 | static_cast<std::uint64_t>(digit);
+                        _sizeDigits = true;
+                    } else if (_sizeDigits && (c == ';' || c == ' ' || c == '\t')) {
+                        _state = State::extension;
+                    } else if (_sizeDigits && c == '\r') {
+                        _state = State::sizeLf;
+                    } else {
+                        _state = State::failed;
+                    }
+                    break;
+                case State::extension:
+                    if (c == '\r') _state = State::sizeLf;
+                    break;
+                case State::sizeLf:
+                    if (c != '\n') {
+                        _state = State::failed;
+                    } else {
+                        _state = _remaining ? State::data : State::trailerStart;
+                    }
+                    break;
+                case State::dataCr:
+                    _state = c == '\r' ? State::dataLf : State::failed;
+                    break;
+                case State::dataLf:
+                    _state = c == '\n' ? State::size : State::failed;
+                    _sizeDigits = false;
+                    break;
+                case State::trailerStart:
+                    _state = c == '\r' ? State::trailerLf : State::trailer;
+                    break;
+                case State::trailer:
+                    if (c == '\n') _state = State::trailerStart;
+                    break;
+                case State::trailerLf:
+                    _state = c == '\n' ? State::done : State::failed;
+                    break;
+                default:
+                    break;
+            }
+        }
+        return i;
+    }
+
+    [[nodiscard]] bool done() const noexcept { return _state == State::done; }
+
+    [[nodiscard]] bool failed() const noexcept { return _state == State::failed; }
+
+    [[nodiscard]] bool endsWithClose() const noexcept { return _untilClose; }
+
+    /// Bytes of the body still to come, none unless its length is known up front.
+    [[nodiscard]] std::optional<std::uint64_t> remaining() const noexcept {
+        if (_chunked || _untilClose) return std::nullopt;
+        return _remaining;
+    }
+
+private:
+    static int hexValue(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+private:
+    enum class State {
+        size,
+        extension,
+        sizeLf,
+        data,
+        dataCr,
+        dataLf,
+        trailerStart,
+        trailer,
+        trailerLf,
+        done,
+        failed
+    };
+
+    State _state = State::done;
+    std::uint64_t _remaining = 0;
+    bool _chunked = false;
+    bool _untilClose = false;
+    bool _sizeDigits = false;
+};
+
+/// Keep-alive connections and passive health of the upstreams.
+/// There is one pool per io thread, so connections never cross threads and no lock is taken;
+/// balancing and ejection therefore only see the requests of their own thread.
+class UpstreamPool {
+    using Clock = std::chrono::steady_clock;
+
+public:
+    struct Upstream {
+        std::string host;
+        std::string port;
+        /// Requests of this thread currently forwarded to the upstream.
+        std::size_t outstanding = 0;
+        unsigned failures = 0;
+        Clock::time_point ejectedUntil;
+        /// Most recently released last.
+        std::vector<std::pair<tcp::socket, Clock::time_point>> idle;
+    };
+
+    /// Pool of the calling thread, which must run 'ioContext'.
+    static UpstreamPool& local(asio::io_context& ioContext, const ProxyOptions& options) {
+        thread_local UpstreamPool pool(ioContext, options);
+        return pool;
+    }
+
+    /// Power of two choices: of two random upstreams that are not ejected, the one with fewer
+    /// requests in flight. When all of them are ejected, all of them are candidates again.
+    Upstream& pick() {
+        auto now = Clock::now();
+        _candidates.clear();
+        for (auto& upstream : _upstreams) {
+            if (upstream.ejectedUntil <= now) _candidates.push_back(&upstream);
+        }
+        if (_candidates.empty()) {
+            for (auto& upstream : _upstreams) _candidates.push_back(&upstream);
+        }
+        std::size_t n = _candidates.size();
+        if (n == 1) return *_candidates[0];
+        std::size_t first = std::uniform_int_distribution<std::size_t>(0, n - 1)(_random);
+        std::size_t second =
+            (first + 1 + std::uniform_int_distribution<std::size_t>(0, n - 2)(_random)) % n;
+        Upstream* a = _candidates[first];
+        Upstream* b = _candidates[second];
+        return a->outstanding <= b->outstanding ? *a : *b;
+    }
+
+    /// Move the most recent usable idle connection into 'socket'.
+    bool takeIdle(Upstream& upstream, tcp::socket& socket) {
+        auto oldest = Clock::now() - _options.idleTimeout;
+        while (!upstream.idle.empty()) {
+            auto [idle, releasedAt] = std::move(upstream.idle.back());
+            upstream.idle.pop_back();
+            if (releasedAt >= oldest && usable(idle)) {
+                socket = std::move(idle);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Lazy<std::error_code> connect(Upstream& upstream, tcp::socket& socket) {
+        Metrics::local().upstreamConnects.add();
+        auto err = co_await asyncConnect(_ioContext, socket, upstream.host, upstream.port);
+        if (err) co_return err;
+        // A cancellation may have closed the socket right after it connected.
+        boost::system::error_code ec;
+        if (socket.set_option(tcp::no_delay(true), ec); ec) {
+            boost::system::error_code ignored;
+            socket.close(ignored);
+            co_return ec;
+        }
+        co_return std::error_code{};
+    }
+
+    void release(Upstream& upstream, tcp::socket socket) {
+        if (upstream.idle.size() >= _options.maxIdlePerUpstream) return;
+        upstream.idle.emplace_back(std::move(socket), Clock::now());
+    }
+
+    void succeeded(Upstream& upstream) noexcept { upstream.failures = 0; }
+
+    void failed(Upstream& upstream) {
+        if (++upstream.failures < _options.maxFailures) return;
+        upstream.failures = 0;
+        upstream.ejectedUntil = Clock::now() + _options.ejectionTime;
+        // Pooled connections of an ejected upstream are likely broken as well.
+        upstream.idle.clear();
+        Metrics::local().upstreamEjections.add();
+    }
+
+private:
+    UpstreamPool(asio::io_context& ioContext, const ProxyOptions& options)
+        : _ioContext(ioContext), _options(options), _random(std::random_device{}()) {
+        for (const auto& address : options.upstreams) {
+            auto colon = address.rfind(':');
+            Upstream upstream;
+            upstream.host = address.substr(0, colon);
+            upstream.port = colon == std::string::npos ? "80" : address.substr(colon + 1);
+            _upstreams.push_back(std::move(upstream));
+        }
+    }
+
+    /// An idle connection is usable as long as the upstream neither closed it nor sent anything.
+    static bool usable(tcp::socket& socket) {
+        char byte;
+        auto n = ::recv(socket.native_handle(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+
+private:
+    asio::io_context& _ioContext;
+    const ProxyOptions& _options;
+    std::vector<Upstream> _upstreams;
+    std::vector<Upstream*> _candidates;
+    std::minstd_rand _random;
+};
+
+/// Client side of a proxied exchange: its stream and the read buffer whose bytes from 'pos' to
+/// 'end' were received after the request head.
+struct ProxyClient {
+    ClientStream& stream;
+    const tcp::endpoint& remote;
+    PooledBuffer& buffer;
+    std::size_t& pos;
+    std::size_t& end;
+};
+
+struct ProxyResult {
+    /// Set when nothing was sent to the client, which is to be answered with this status.
+    std::optional<StatusType> error;
+    /// Status relayed from the upstream.
+    int status = 0;
+    std::size_t bytesWritten = 0;
+    /// The client connection cannot be reused, e.g. because the request body was not read.
+    bool close = false;
+};
+
+/// Forwards requests to upstreams over pooled HTTP/1.1 keep-alive connections.
+/// Bodies are streamed in both directions as they arrive, with their framing left intact.
+class ReverseProxy {
+public:
+    explicit ReverseProxy(const ProxyOptions& options) : _options(options) {}
+
+    [[nodiscard]] bool matches(const Request& request) const {
+        return !_options.upstreams.empty() && request.uri.starts_with(_options.pathPrefix);
+    }
+
+    /// Forward 'request' and relay the response. With 'keepAlive' unset the client is told that
+    /// the connection closes after the response. Requests with a key in the ResponseCache are
+    /// answered from it when they can, and misses fill it. Cancelling the token the forward
+    /// runs with, because the client went away, abandons it without blaming the upstream.
+    Lazy<ProxyResult> forward(ProxyClient client, const Request& request, bool keepAlive) {
+        auto& ioContext = static_cast<asio::io_context&>(client.stream.get_executor().context());
+        auto cancellation = co_await currentCancellation();
+        ProxyResult result;
+        BodyFraming requestBody = BodyFraming::ofLength(0);
+        if (auto error = requestFraming(request, requestBody)) {
+            result.error = *error;
+            result.close = true;
+            co_return result;
+        }
+        std::optional<ResponseCache::Fill> fill;
+        if (auto key = ResponseCache::instance().keyOf(request)) {
+            bool cookie = findHeader(request.headers, "Cookie") != nullptr;
+            auto lookup = ResponseCache::instance().lookup(*key, cookie);
+            if (lookup.flight) {
+                lookup.response = co_await lookup.flight->wait(ioContext);
+                if (!ResponseCache::servable(lookup.response, cookie)) lookup.response = nullptr;
+            }
+            if (lookup.response) {
+                if (lookup.fill) {
+                    fillDetached(ioContext, std::move(*lookup.fill), std::string(request.method),
+                                 requestHead(request, client.remote, requestBody));
+                }
+                co_return co_await serveCached(client, std::move(lookup.response), keepAlive);
+            }
+            // A flight that brought nothing to share leaves the request to forward on its own.
+            if (lookup.fill) fill.emplace(std::move(*lookup.fill));
+        }
+
+        bool hasBody = !requestBody.done();
+        if (auto* expect = request.header(KnownHeader::expect);
+            hasBody && expect && equalsIgnoreCase(expect->value, "100-continue")) {
+            // Upstreams never see the expectation, the body is streamed right after the head.
+            constexpr std::string_view kContinue = "HTTP/1.1 100 Continue\r\n\r\n";
+            auto [err, n] = co_await asyncWrite(client.stream, asio::buffer(kContinue));
+            if (err) {
+                result.close = true;
+                co_return result;
+            }
+        }
+
+        auto& pool = UpstreamPool::local(ioContext, _options);
+        Outstanding outstanding;
+        outstanding.moveTo(pool.pick());
+
+        auto head = requestHead(request, client.remote, requestBody);
+        auto buffer = BufferPool::local().acquire(BufferPool::kSizeClasses.size() - 1);
+        std::size_t end = 0;
+        std::size_t headSize = 0;
+        tcp::socket socket(ioContext);
+        // Requests without a body are safe to send again: when a pooled connection turns out to
+        // be closed by the upstream they are retried on a new one, and when connecting fails
+        // they get one more try on another upstream.
+        for (bool retried = false;;) {
+            auto& upstream = *outstanding.upstream;
+            bool reused = pool.takeIdle(upstream, socket);
+            if (!reused) {
+                auto connected = co_await withTimeout(ioContext, pool.connect(upstream, socket),
+                                                      _options.connectTimeout);
+                if (!connected || *connected) {
+                    if (cancellation.cancelled()) {
+                        // Requests coalesced onto this one still wait for the response.
+                        if (fill) {
+                            fillDetached(ioContext, std::move(*fill), std::string(request.method),
+                                         head);
+                        }
+                        co_return clientGone();
+                    }
+                    pool.failed(upstream);
+                    if (!hasBody && !std::exchange(retried, true)) {
+                        outstanding.moveTo(pool.pick());
+                        continue;
+                    }
+                    result.error =
+                        connected ? StatusType::bad_gateway : StatusType::gateway_timeout;
+                    result.close = hasBody;
+                    co_return result;
+                }
+            }
+            auto [err, n] = co_await asyncWrite(socket, asio::buffer(head));
+            if (!err && hasBody) {
+                bool clientFailed = false;
+                err = co_await sendBody(client, socket, requestBody, clientFailed);
+                if (clientFailed) {
+                    result.close = true;
+                    co_return result;
+                }
+            }
+            if (!err) {
+                auto headRead = co_await withTimeout(
+                    ioContext, readHead(socket, buffer, end, headSize), _options.responseTimeout);
+                if (!headRead) {
+                    // The upstream may still answer later, so the connection cannot be reused.
+                    boost::system::error_code ec;
+                    socket.close(ec);
+                    pool.failed(upstream);
+                    result.error = StatusType::gateway_timeout;
+                    result.close = !requestBody.done();
+                    co_return result;
+                }
+                err = *headRead;
+            }
+            if (!err) break;
+
+            boost::system::error_code ec;
+            socket.close(ec);
+            if (cancellation.cancelled()) {
+                if (fill) {
+                    fillDetached(ioContext, std::move(*fill), std::string(request.method), head);
+                }
+                co_return clientGone();
+            }
+            if (reused && !hasBody && end == 0) continue;
+            pool.failed(upstream);
+            result.error = StatusType::bad_gateway;
+            result.close = !requestBody.done();
+            co_return result;
+        }
+
+        auto& upstream = *outstanding.upstream;
+        auto response = parseHead({buffer.data(), headSize});
+        if (!response) {
+            pool.failed(upstream);
+            result.error = StatusType::bad_gateway;
+            result.close = !requestBody.done();
+            co_return result;
+        }
+        if (response->status >= 502 && response->status <= 504) {
+            pool.failed(upstream);
+        } else {
+            pool.succeeded(upstream);
+        }
+
+        BodyFraming responseBody = responseFraming(request.method, *response);
+        auto* connection = findHeader(response->headers, "Connection");
+        bool reusable = response->minorVersion >= 1 && !responseBody.endsWithClose() &&
+                        !(connection && equalsIgnoreCase(connection->value, "close"));
+        // Without a length the client learns about the end of the body from the close.
+        result.close = !keepAlive || responseBody.endsWithClose();
+        result.status = response->status;
+
+        std::size_t bodyBytes = responseBody.consume(buffer.data() + headSize, end - headSize);
+        if (headSize + bodyBytes < end) reusable = false;
+
+        // A response to cache is read as a whole and stored before anything goes to the client,
+        // so the requests coalesced onto this one never wait for its client. The read is bounded
+        // like the head and goes on when the client leaves. A response that cannot be cached lets
+        // the key pass, unless it is a server error: the next request tries again then.
+        if (fill) {
+            bool shared = false;
+            if (auto ttl = cacheTtl(*response, responseBody, fill->sharedOnly(), shared)) {
+                std::string body;
+                body.reserve(*responseBody.remaining());
+                body.append(buffer.data() + headSize, bodyBytes);
+                // An empty token would be replaced by the one of this request, bound to its client.
+                CancellationSource detached;
+                auto bodyRead =
+                    co_await withTimeout(ioContext,
+                                         readBody(socket, buffer, responseBody, body, reusable),
+                                         _options.responseTimeout)
+                        .withCancellation(detached.token());
+                if (!bodyRead || *bodyRead) {
+                    boost::system::error_code ec;
+                    socket.close(ec);
+                    pool.failed(upstream);
+                    result.error = bodyRead ? StatusType::bad_gateway : StatusType::gateway_timeout;
+                    result.close = true;
+                    co_return result;
+                }
+                if (reusable) pool.release(upstream, std::move(socket));
+                auto stored = fill->store({response->status, statusAndFields(*response, true),
+                                           std::move(body), {}, shared},
+                                          *ttl);
+                co_return co_await serveCached(client, std::move(stored), keepAlive);
+            }
+            if (response->status < 500 && !fill->sharedOnly()) fill->pass();
+            fill.reset();
+        }
+
+        auto responseHead = clientHead(*response, result.close);
+        auto [writeErr, written] = co_await asyncWrite(
+            client.stream,
+            std::array<asio::const_buffer, 2>{asio::buffer(responseHead),
+                                              asio::buffer(buffer.data() + headSize, bodyBytes)});
+        result.bytesWritten += written;
+        if (writeErr) {
+            result.close = true;
+            co_return result;
+        }
+
+        while (!responseBody.done() && !responseBody.failed()) {
+            if (client.stream.priority() == Priority::low) {
+                co_await client.stream.lanes().enter(Priority::low);
+            }
+            auto [readErr, n] =
+                co_await asyncReadSome(socket, asio::buffer(buffer.data(), buffer.size()));
+            if (readErr) {
+                // Only a body delimited by the close ends with eof, anything else is truncated.
+                result.close = true;
+                reusable = false;
+                break;
+            }
+            bodyBytes = responseBody.consume(buffer.data(), n);
+            if (bodyBytes < n) reusable = false;
+            auto [err, m] =
+                co_await asyncWrite(client.stream, asio::buffer(buffer.data(), bodyBytes));
+            result.bytesWritten += m;
+            if (err) {
+                result.close = true;
+                co_return result;
+            }
+        }
+        if (responseBody.failed()) result.close = true;
+        if (reusable && responseBody.done() && requestBody.done()) {
+            pool.release(upstream, std::move(socket));
+        }
+        co_return result;
+    }
+
+private:
+    struct ResponseHead {
+        int status = 0;
+        int minorVersion = 1;
+        std::string reason;
+        std::vector<Header> headers;
+    };
+
+    /// Requests in flight are counted against the upstream currently serving them.
+    struct Outstanding {
+        UpstreamPool::Upstream* upstream = nullptr;
+
+        void moveTo(UpstreamPool::Upstream& next) {
+            if (upstream) --upstream->outstanding;
+            upstream = &next;
+            ++next.outstanding;
+        }
+
+        ~Outstanding() {
+            if (upstream) --upstream->outstanding;
+        }
+    };
+
+    /// Outcome of a request whose client went away before the response, logged as 499 like
+    /// other proxies do.
+    static ProxyResult clientGone() {
+        Metrics::local().proxyClientAborts.add();
+        ProxyResult result;
+        result.status = 499;
+        result.close = true;
+        return result;
+    }
+
+    /// Refreshes of stale cache entries run detached on the io thread of the request that found
+    /// them, on its low priority lane.
+    static Executor& refreshExecutor(asio::io_context& ioContext) {
+        thread_local AsioExecutor executor(ioContext, Priority::low);
+        return executor;
+    }
+
+    /// Headers that only apply to a single connection and are not forwarded. Transfer-Encoding
+    /// is kept since bodies pass through with their framing, requestHead writes its own.
+    static bool isHopByHop(std::string_view name, const Header* connection) {
+        for (std::string_view hop :
+             {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade"}) {
+            if (equalsIgnoreCase(name, hop)) return true;
+        }
+        // Connection lists further hop-by-hop headers.
+        return connection && hasToken(connection->value, name);
+    }
+
+    /// How the body of 'request' is framed, or the status to reject it with. Framing that two
+    /// parsers could read differently, like Content-Length next to Transfer-Encoding or
+    /// conflicting lengths, is refused instead of being passed on.
+    static std::optional<StatusType> requestFraming(const Request& request, BodyFraming& body) {
+        const Header* encoding = nullptr;
+        std::optional<std::uint64_t> length;
+        for (const auto& h : request.headers) {
+            if (equalsIgnoreCase(h.name, "Transfer-Encoding")) {
+                if (encoding) return StatusType::bad_request;
+                encoding = &h;
+            } else if (equalsIgnoreCase(h.name, "Content-Length")) {
+                std::uint64_t value = 0;
+                auto [ptr, ec] =
+                    std::from_chars(h.value.data(), h.value.data() + h.value.size(), value);
+                if (ec != std::errc() || ptr != h.value.data() + h.value.size()) {
+                    return StatusType::bad_request;
+                }
+                if (length && *length != value) return StatusType::bad_request;
+                length = value;
+            }
+        }
+        if (encoding) {
+            if (length) return StatusType::bad_request;
+            if (!equalsIgnoreCase(encoding->value, "chunked")) return StatusType::not_implemented;
+            body = BodyFraming::chunked();
+        } else {
+            body = BodyFraming::ofLength(length.value_or(0));
+        }
+        return std::nullopt;
+    }
+
+    /// The request head sent upstream. Its framing comes from 'body', whatever the client
+    /// wrote in its Content-Length and Transfer-Encoding headers is dropped.
+    static std::string requestHead(const Request& request, const tcp::endpoint& remote,
+                                   const BodyFraming& body) {
+        auto* connection = request.header(KnownHeader::connection);
+        std::string clientAddress = remote.address().to_string();
+        std::string head;
+        head.reserve(512);
+        head.append(request.method).append(" ").append(request.uri).append(" HTTP/1.1\r\n");
+        bool forwarded = false;
+        for (const auto& h : request.headers) {
+            if (isHopByHop(h.name, connection) || equalsIgnoreCase(h.name, "Expect") ||
+                equalsIgnoreCase(h.name, "Content-Length") ||
+                equalsIgnoreCase(h.name, "Transfer-Encoding")) {
+                continue;
+            }
+            head.append(h.name).append(": ").append(h.value);
+            if (equalsIgnoreCase(h.name, "X-Forwarded-For")) {
+                head.append(", ").append(clientAddress);
+                forwarded = true;
+            }
+            head.append("\r\n");
+        }
+        if (!forwarded) head.append("X-Forwarded-For: ").append(clientAddress).append("\r\n");
+        if (auto length = body.remaining()) {
+            // An empty body keeps its explicit length, some upstreams insist on one for POST.
+            if (*length || request.header(KnownHeader::content_length)) {
+                head.append("Content-Length: ").append(std::to_string(*length)).append("\r\n");
+            }
+        } else {
+            head.append("Transfer-Encoding: chunked\r\n");
+        }
+        head.append("\r\n");
+        return head;
+    }
+
+    /// Status line and end-to-end header fields of 'response'. A 'cached' one gets its Age
+    /// when it is served.
+    static std::string statusAndFields(const ResponseHead& response, bool cached) {
+        auto* connection = findHeader(response.headers, "Connection");
+        std::string head;
+        head.reserve(512);
+        head.append("HTTP/1.1 ").append(std::to_string(response.status));
+        head.append(" ").append(response.reason).append("\r\n");
+        for (const auto& h : response.headers) {
+            if (isHopByHop(h.name, connection) || (cached && equalsIgnoreCase(h.name, "Age"))) {
+                continue;
+            }
+            head.append(h.name).append(": ").append(h.value).append("\r\n");
+        }
+        return head;
+    }
+
+    static std::string clientHead(const ResponseHead& response, bool close) {
+        auto head = statusAndFields(response, false);
+        if (close) head.append("Connection: close\r\n");
+        head.append("\r\n");
+        return head;
+    }
+
+    /// How the body of 'response' to a 'method' request is delimited.
+    static BodyFraming responseFraming(std::string_view method, const ResponseHead& response) {
+        if (method == "HEAD" || response.status == 204 || response.status == 304) {
+            return BodyFraming::ofLength(0);
+        }
+        if (auto* encoding = findHeader(response.headers, "Transfer-Encoding")) {
+            return equalsIgnoreCase(encoding->value, "chunked") ? BodyFraming::chunked()
+                                                                : BodyFraming::untilClose();
+        }
+        auto* length = findHeader(response.headers, "Content-Length");
+        std::uint64_t contentLength = 0;
+        if (length && std::from_chars(length->value.data(),
+                                      length->value.data() + length->value.size(), contentLength)
+                              .ec == std::errc()) {
+            return BodyFraming::ofLength(contentLength);
+        }
+        return BodyFraming::untilClose();
+    }
+
+    /// How long 'response' may be cached, none when it may not: its status is not cacheable by
+    /// default, its body is of unknown length or too large, it sets cookies, varies on headers
+    /// that are not part of the key, or its Cache-Control forbids it. 'shared' is set when it is
+    /// marked public or carries an s-maxage, with 'sharedOnly' it has to be. A max-age of its
+    /// own, s-maxage first, takes the place of the TTL.
+    static std::optional<std::chrono::milliseconds> cacheTtl(const ResponseHead& response,
+                                                             const BodyFraming& body,
+                                                             bool sharedOnly, bool& shared) {
+        const auto& options = ResponseCache::instance().options();
+        constexpr std::array kCacheable = {200, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501};
+        if (std::ranges::find(kCacheable, response.status) == kCacheable.end()) return {};
+        auto length = body.remaining();
+        if (!length || *length > options.maxEntrySize) return {};
+        if (findHeader(response.headers, "Set-Cookie")) return {};
+        if (auto* vary = findHeader(response.headers, "Vary")) {
+            for (std::string_view rest = vary->value; !rest.empty();) {
+                auto comma = rest.find(',');
+                auto name = trim(rest.substr(0, comma));
+                rest = comma == std::string_view::npos ? "" : rest.substr(comma + 1);
+                if (name.empty()) continue;
+                if (std::ranges::none_of(options.varyHeaders, [name](const std::string& header) {
+                        return equalsIgnoreCase(header, name);
+                    })) {
+                    return {};
+                }
+            }
+        }
+        std::optional<std::chrono::milliseconds> ttl = options.ttl;
+        std::optional<std::chrono::milliseconds> sharedTtl;
+        bool markedPublic = false;
+        if (auto* cacheControl = findHeader(response.headers, "Cache-Control")) {
+            for (std::string_view rest = cacheControl->value; !rest.empty();) {
+                auto comma = rest.find(',');
+                auto directive = trim(rest.substr(0, comma));
+                rest = comma == std::string_view::npos ? "" : rest.substr(comma + 1);
+                auto equals = directive.find('=');
+                auto name = trim(directive.substr(0, equals));
+                if (equalsIgnoreCase(name, "no-store") || equalsIgnoreCase(name, "no-cache") ||
+                    equalsIgnoreCase(name, "private")) {
+                    return {};
+                }
+                if (equalsIgnoreCase(name, "public")) markedPublic = true;
+                bool shared = equalsIgnoreCase(name, "s-maxage");
+                if (equals == std::string_view::npos ||
+                    !(shared || equalsIgnoreCase(name, "max-age"))) {
+                    continue;
+                }
+                auto value = trim(directive.substr(equals + 1));
+                std::uint32_t seconds = 0;
+                if (std::from_chars(value.data(), value.data() + value.size(), seconds).ec !=
+                    std::errc()) {
+                    continue;
+                }
+                (shared ? sharedTtl : ttl) = std::chrono::seconds(seconds);
+            }
+        }
+        shared = markedPublic || sharedTtl.has_value();
+        if (sharedOnly && !shared) return {};
+        if (sharedTtl) ttl = sharedTtl;
+        if (ttl->count() == 0) return {};
+        return ttl;
+    }
+
+    static std::string_view trim(std::string_view value) {
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+            value.remove_prefix(1);
+        }
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+            value.remove_suffix(1);
+        }
+        return value;
+    }
+
+    /// Answer from the cache, the upstream is not involved.
+    Lazy<ProxyResult> serveCached(ProxyClient& client, ResponseCache::Response cached,
+                                  bool keepAlive) {
+        ProxyResult result;
+        result.status = cached->status;
+        result.close = !keepAlive;
+        auto age = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now() - cached->storedAt);
+        std::string fields = "Age: " + std::to_string(age.count()) + "\r\n";
+        if (result.close) fields.append("Connection: close\r\n");
+        fields.append("\r\n");
+        auto [err, n] = co_await asyncWrite(
+            client.stream,
+            std::array<asio::const_buffer, 3>{asio::buffer(cached->head), asio::buffer(fields),
+                                              asio::buffer(cached->body)});
+        result.bytesWritten = n;
+        if (err) result.close = true;
+        co_return result;
+    }
+
+    /// Fetch the response of 'fill' with no client waiting for it, on the low priority lane: to
+    /// refresh a stale entry, or for the requests coalesced onto one whose client went away.
+    void fillDetached(asio::io_context& ioContext, ResponseCache::Fill fill, std::string method,
+                      std::string head) {
+        refresh(ioContext, _options, std::move(fill), std::move(method), std::move(head))
+            .via(&refreshExecutor(ioContext))
+            .detach();
+    }
+
+    /// The clientless fetch of fillDetached. It may outlive the connection that started it, so it
+    /// keeps nothing of it. Failures leave a stale entry to expire, the next request that finds
+    /// it stale tries again.
+    static Lazy<void> refresh(asio::io_context& ioContext, const ProxyOptions& options,
+                              ResponseCache::Fill fill, std::string method, std::string head) {
+        auto& pool = UpstreamPool::local(ioContext, options);
+        Outstanding outstanding;
+        outstanding.moveTo(pool.pick());
+        auto& upstream = *outstanding.upstream;
+        tcp::socket socket(ioContext);
+        if (!pool.takeIdle(upstream, socket)) {
+            auto connected = co_await withTimeout(ioContext, pool.connect(upstream, socket),
+                                                  options.connectTimeout);
+            if (!connected || *connected) {
+                pool.failed(upstream);
+                co_return;
+            }
+        }
+        auto buffer = BufferPool::local().acquire(BufferPool::kSizeClasses.size() - 1);
+        std::size_t end = 0;
+        std::size_t headSize = 0;
+        auto [err, n] = co_await asyncWrite(socket, asio::buffer(head));
+        if (!err) {
+            auto headRead = co_await withTimeout(
+                ioContext, readHead(socket, buffer, end, headSize), options.responseTimeout);
+            err = headRead ? *headRead : std::make_error_code(std::errc::timed_out);
+        }
+        auto response = err ? std::nullopt : parseHead({buffer.data(), headSize});
+        if (!response) {
+            pool.failed(upstream);
+            co_return;
+        }
+        if (response->status >= 502 && response->status <= 504) {
+            pool.failed(upstream);
+        } else {
+            pool.succeeded(upstream);
+        }
+
+        BodyFraming framing = responseFraming(method, *response);
+        bool shared = false;
+        auto ttl = cacheTtl(*response, framing, fill.sharedOnly(), shared);
+        if (!ttl) {
+            // Server errors leave the stale response in place until it expires.
+            if (response->status < 500 && !fill.sharedOnly()) fill.pass();
+            co_return;
+        }
+        std::string body;
+        body.reserve(*framing.remaining());
+        std::size_t bodyBytes = framing.consume(buffer.data() + headSize, end - headSize);
+        auto* connection = findHeader(response->headers, "Connection");
+        bool reusable = headSize + bodyBytes == end && response->minorVersion >= 1 &&
+                        !(connection && equalsIgnoreCase(connection->value, "close"));
+        body.append(buffer.data() + headSize, bodyBytes);
+        auto bodyRead = co_await withTimeout(
+            ioContext, readBody(socket, buffer, framing, body, reusable), options.responseTimeout);
+        if (!bodyRead || *bodyRead) {
+            pool.failed(upstream);
+            co_return;
+        }
+        if (reusable) pool.release(upstream, std::move(socket));
+        fill.store(
+            {response->status, statusAndFields(*response, true), std::move(body), {}, shared},
+            *ttl);
+    }
+
+    /// Read the rest of a body of known length into 'body'. 'reusable' is cleared when the
+    /// upstream sent more than the body.
+    static Lazy<std::error_code> readBody(tcp::socket& socket, PooledBuffer& buffer,
+                                          BodyFraming& framing, std::string& body,
+                                          bool& reusable) {
+        while (!framing.done()) {
+            auto [err, n] =
+                co_await asyncReadSome(socket, asio::buffer(buffer.data(), buffer.size()));
+            if (err) co_return err;
+            auto bytes = framing.consume(buffer.data(), n);
+            if (bytes < n) reusable = false;
+            body.append(buffer.data(), bytes);
+        }
+        co_return std::error_code{};
+    }
+
+    static std::optional<ResponseHead> parseHead(std::string_view head) {
+        ResponseHead response;
+        auto lineEnd = head.find("\r\n");
+        std::string_view line = head.substr(0, lineEnd);
+        if (line.size() < 12 || !line.starts_with("HTTP/1.") || line[8] != ' ') return {};
+        response.minorVersion = line[7] - '0';
+        auto [ptr, ec] = std::from_chars(line.data() + 9, line.data() + 12, response.status);
+        if (ec != std::errc() || ptr != line.data() + 12 || response.status < 100) return {};
+        if (line.size() > 13) response.reason = line.substr(13);
+
+        head.remove_prefix(lineEnd + 2);
+        while (!head.starts_with("\r\n")) {
+            lineEnd = head.find("\r\n");
+            line = head.substr(0, lineEnd);
+            auto colon = line.find(':');
+            if (colon == std::string_view::npos || colon == 0) return {};
+            auto value = trim(line.substr(colon + 1));
+            response.headers.push_back({std::string(line.substr(0, colon)), std::string(value)});
+            head.remove_prefix(lineEnd + 2);
+        }
+        return response;
+    }
+
+    /// Stream the request body from the client to the upstream. 'clientFailed' tells whether an
+    /// error came from the client side.
+    Lazy<std::error_code> sendBody(ProxyClient& client, tcp::socket& upstream,
+                                   BodyFraming& framing, bool& clientFailed) {
+        while (!framing.done()) {
+            if (client.pos == client.end) {
+                auto [err, n] = co_await asyncReadSome(
+                    client.stream, asio::buffer(client.buffer.data(), client.buffer.size()));
+                if (err) {
+                    clientFailed = true;
+                    co_return err;
+                }
+                Metrics::local().bytesIn.add(n);
+                client.pos = 0;
+                client.end = n;
+            }
+            char* data = client.buffer.data() + client.pos;
+            std::size_t n = framing.consume(data, client.end - client.pos);
+            client.pos += n;
+            if (framing.failed()) {
+                clientFailed = true;
+                co_return std::make_error_code(std::errc::protocol_error);
+            }
+            if (auto [err, m] = co_await asyncWrite(upstream, asio::buffer(data, n)); err) {
+                co_return err;
+            }
+        }
+        co_return std::error_code{};
+    }
+
+    /// Read until the buffer holds a complete response head, skipping interim 1xx responses.
+    static Lazy<std::error_code> readHead(tcp::socket& socket, PooledBuffer& buffer,
+                                          std::size_t& end, std::size_t& headSize) {
+        while (true) {
+            std::string_view received(buffer.data(), end);
+            if (auto pos = received.find("\r\n\r\n"); pos != std::string_view::npos) {
+                headSize = pos + 4;
+                bool interim = received.size() > 12 && received[9] == '1' &&
+                               !received.substr(9).starts_with("101");
+                if (!interim) co_return std::error_code{};
+                std::memmove(buffer.data(), buffer.data() + headSize, end - headSize);
+                end -= headSize;
+                continue;
+            }
+            if (end == buffer.size()) co_return std::make_error_code(std::errc::message_size);
+            auto [err, n] = co_await asyncReadSome(
+                socket, asio::buffer(buffer.data() + end, buffer.size() - end));
+            if (err) co_return err;
+            end += n;
+        }
+    }
+
+private:
+    const ProxyOptions& _options;
+};
+
+#undef tcp
+#undef asio
+
+#endif  // TINY_HTTP_SERVER_PROXY_H
@@ -0,0 +1,197 @@
+#ifndef TINY_HTTP_SERVER_RATE_LIMIT_H
+#define TINY_HTTP_SERVER_RATE_LIMIT_H
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <boost/asio/ip/address.hpp>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "HttpResponse.h"
+#include "Metrics.h"
+
+struct RateLimitOptions {
+    /// Sustained requests per second a client may send. Rate limiting is disabled while 0.
+    double requestsPerSecond = 0;
+    /// Requests a client may send at once after it was idle for a while.
+    double burst = 20;
+    /// Give every route of a client its own bucket, keyed by the request path without query.
+    bool perRoute = false;
+    /// Number of buckets. Memory stays fixed at 16 bytes per bucket: buckets that refilled are
+    /// reused for other clients, and when none is at hand the least recently used is taken.
+    std::size_t capacity = 1 << 18;
+    /// Body of 429 responses, the default error page while empty.
+    std::string body;
+    std::string contentType = "text/html";
+    /// Tell clients in Retry-After when their bucket has a token again.
+    bool retryAfter = true;
+};
+
+/// Process-wide per-client request rate limits.
+/// Each client has a token bucket stored as a single timestamp, the time at which it would be
+/// empty when nothing refilled it (the virtual scheduling form of GCRA). A request takes a token
+/// by moving that time one refill interval ahead, so refilling is computed from timestamps and
+/// needs no timer, and a bucket is updated with one compare-and-swap. Buckets live in an
+/// open-addressing table split into shards, without locks: concurrent requests of a new client
+/// may create two buckets, and a bucket taken over by another client while in use may grant one
+/// token too many, both of which merely loosen the limit for a moment.
+class RateLimiter {
+    using Clock = std::chrono::steady_clock;
+
+public:
+    static RateLimiter& instance() {
+        static RateLimiter limiter;
+        return limiter;
+    }
+
+    void setOptions(const RateLimitOptions& options) {
+        _options = options;
+        _slots.reset();
+        if (!enabled()) return;
+        _interval = static_cast<std::uint64_t>(1e9 / options.requestsPerSecond);
+        _tolerance = static_cast<std::uint64_t>(static_cast<double>(_interval) *
+                                                std::max(options.burst, 1.0));
+        _shardSize = std::bit_ceil(std::max<std::size_t>(options.capacity / kShards, kMaxProbes));
+        _slots = std::make_unique<Slot[]>(_shardSize * kShards);
+    }
+
+    [[nodiscard]] bool enabled() const noexcept { return _options.requestsPerSecond > 0; }
+
+    [[nodiscard]] const RateLimitOptions& options() const noexcept { return _options; }
+
+    /// Take a token of the client at 'address', for the route of 'uri' with perRoute. Returns
+    /// zero when the request may pass, otherwise how long until the bucket has a token again.
+    Clock::duration acquire(const boost::asio::ip::address& address, std::string_view uri,
+                            Clock::time_point now = Clock::now()) {
+        std::string_view route;
+        if (_options.perRoute) route = uri.substr(0, uri.find('?'));
+        auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch());
+        auto wait = acquireKey(keyOf(address, route), static_cast<std::uint64_t>(nanos.count()));
+        if (wait > 0) Metrics::local().rateLimited.add();
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds(wait));
+    }
+
+    /// The 429 for a client that has to wait 'wait' for its next token.
+    [[nodiscard]] Response rejection(Clock::duration wait) const {
+        Response response(StatusType::too_many_requests, _options.contentType);
+        if (!_options.body.empty()) response.setContent(_options.body);
+        if (_options.retryAfter) {
+            auto seconds = std::chrono::ceil<std::chrono::seconds>(wait);
+            response.addHeader("Retry-After",
+                               std::to_string(std::max(seconds, std::chrono::seconds(1)).count()));
+        }
+        return response;
+    }
+
+private:
+    static constexpr std::size_t kShardBits = 6;
+    static constexpr std::size_t kShards = 1 << kShardBits;
+    /// Slots looked at for a client before the least recently used of them is taken over.
+    static constexpr std::size_t kMaxProbes = 8;
+
+    struct alignas(16) Slot {
+        /// Hash of the client, 0 while the slot was never used.
+        std::atomic<std::uint64_t> key{0};
+        /// Nanoseconds on the steady clock at which the bucket would be empty. The bucket is
+        /// full, just like a new one, once this lies in the past.
+        std::atomic<std::uint64_t> emptyAt{0};
+    };
+
+    RateLimiter() = default;
+
+    /// Returns the nanoseconds to wait, 0 when a token was taken.
+    std::uint64_t acquireKey(std::uint64_t key, std::uint64_t now) {
+        Slot* slot = find(key, now);
+        // Fail open when the table is too contended to place the client.
+        if (!slot) return 0;
+        auto emptyAt = slot->emptyAt.load(std::memory_order_relaxed);
+        while (true) {
+            auto next = std::max(emptyAt, now) + _interval;
+            if (next - now > _tolerance) return next - _tolerance - now;
+            if (slot->emptyAt.compare_exchange_weak(emptyAt, next, std::memory_order_relaxed)) {
+                return 0;
+            }
+        }
+    }
+
+    Slot* find(std::uint64_t key, std::uint64_t now) {
+        Slot* shard = &_slots[(key >> (64 - kShardBits)) * _shardSize];
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            // Keys are never removed, so the client cannot sit behind a slot never used.
+            Slot* reusable = nullptr;
+            std::uint64_t reusableKey = 0;
+            Slot* oldest = nullptr;
+            std::uint64_t oldestKey = 0;
+            std::uint64_t oldestEmptyAt = std::numeric_limits<std::uint64_t>::max();
+            for (std::size_t i = 0; i < kMaxProbes; ++i) {
+                Slot& slot = shard[(key + i) & (_shardSize - 1)];
+                auto slotKey = slot.key.load(std::memory_order_acquire);
+                if (slotKey == key) return &slot;
+                if (slotKey == 0) {
+                    if (!reusable) {
+                        reusable = &slot;
+                        reusableKey = 0;
+                    }
+                    break;
+                }
+                auto emptyAt = slot.emptyAt.load(std::memory_order_relaxed);
+                if (!reusable && emptyAt <= now) {
+                    reusable = &slot;
+                    reusableKey = slotKey;
+                }
+                if (emptyAt < oldestEmptyAt) {
+                    oldest = &slot;
+                    oldestKey = slotKey;
+                    oldestEmptyAt = emptyAt;
+                }
+            }
+            // A refilled bucket equals a new one and is reused as it is. Taking over a bucket
+            // still in use resets it.
+            Slot* target = reusable ? reusable : oldest;
+            auto expected = reusable ? reusableKey : oldestKey;
+            if (target->key.compare_exchange_strong(expected, key, std::memory_order_acq_rel)) {
+                if (!reusable) {
+                    target->emptyAt.store(0, std::memory_order_relaxed);
+                    Metrics::local().rateLimitEvictions.add();
+                }
+                return target;
+            }
+            if (expected == key) return target;
+        }
+        return nullptr;
+    }
+
+    /// IPv6 clients are keyed by their /64, which a single host usually owns as a whole.
+    static std::uint64_t keyOf(const boost::asio::ip::address& address, std::string_view route) {
+        std::uint64_t value = 0;
+        if (address.is_v4()) {
+            value = address.to_v4().to_uint();
+        } else {
+            auto bytes = address.to_v6().to_bytes();
+            for (std::size_t i = 0; i < 8; ++i) value = value << 8 | bytes[i];
+            value ^= 0x9e3779b97f4a7c15ull;
+        }
+        if (!route.empty()) value ^= std::hash<std::string_view>{}(route) * 0xff51afd7ed558ccdull;
+        // splitmix64 finalizer, the shard comes from the high bits and probing from the low ones.
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+        value ^= value >> 31;
+        return value != 0 ? value : 1;
+    }
+
+private:
+    RateLimitOptions _options;
+    std::uint64_t _interval = 0;
+    std::uint64_t _tolerance = 0;
+    std::size_t _shardSize = 0;
+    std::unique_ptr<Slot[]> _slots;
+};
+
+#endif  // TINY_HTTP_SERVER_RATE_LIMIT_H
@@ -0,0 +1,44 @@
+#ifndef TINY_HTTP_SERVER_REQUEST_ARENA_H
+#define TINY_HTTP_SERVER_REQUEST_ARENA_H
+
+#include <cstddef>
+#include <memory_resource>
+
+/// Memory of a connection for everything that lives as long as one request: the parsed request,
+/// its response and scratch data of the handler. Allocation bumps a pointer, freeing is a no-op,
+/// and reset() hands back all of it at once. The chunks come from a pool of the io thread, so a
+/// connection serving requests of similar size does not call malloc at all once warm.
+class RequestArena {
+public:
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    /// Has to be created on the io thread that serves the connection, see Server::dispatch.
+    RequestArena() : _resource(kInitialSize, &threadPool()) {}
+
+    RequestArena(const RequestArena&) = delete;
+
+    RequestArena& operator=(const RequestArena&) = delete;
+
+    [[nodiscard]] allocator_type allocator() noexcept { return &_resource; }
+
+    /// Release everything allocated since the last reset, nothing allocated from the arena may
+    /// be used afterwards.
+    void reset() noexcept { _resource.release(); }
+
+private:
+    static constexpr std::size_t kInitialSize = 4 << 10;
+
+    /// Arenas hand their chunks back to the pool they took them from. Like BufferPool the pool
+    /// is never destroyed, arenas of connections torn down after their thread exited may still
+    /// release into it.
+    static std::pmr::memory_resource& threadPool() {
+        thread_local auto* pool = new std::pmr::unsynchronized_pool_resource(
+            std::pmr::pool_options{.max_blocks_per_chunk = 16,
+                                   .largest_required_pool_block = 256 << 10});
+        return *pool;
+    }
+
+    std::pmr::monotonic_buffer_resource _resource;
+};
+
+#endif  // TINY_HTTP_SERVER_REQUEST_ARENA_H
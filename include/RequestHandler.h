@@ -0,0 +1,108 @@
+#ifndef TINY_HTTP_SERVER_REQUEST_HANDLER_H
+#define TINY_HTTP_SERVER_REQUEST_HANDLER_H
+
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+
+#include "HttpRequest.h"
+#include "HttpResponse.h"
+#include "Metrics.h"
+#include "OpenFileCache.h"
+#include "ServerOptions.h"
+#include "Trace.h"
+#include "UrlPath.h"
+
+/// Maps a request to its response, independent of the protocol it arrived with.
+class RequestHandler {
+public:
+    /// An 'admin' handler only serves the metrics endpoint.
+    RequestHandler(const ServerOptions& options, bool admin = false)
+        : _options(options), _admin(admin), _serveMetrics(admin || options.adminPort == 0) {}
+
+    /// The response, and any scratch data on the way, is allocated like 'request', from the arena
+    /// of its connection.
+    Response handle(const Request& request) {
+        auto response = respond(request);
+        response.setPriority(priorityOf(request, response));
+        return response;
+    }
+
+    /// Lane the route of 'request' is served from before its response is known: the high
+    /// priority one for the admin listener, the metrics and trace endpoints and
+    /// LaneOptions::highPriorityPaths, the normal one otherwise.
+    [[nodiscard]] Priority routePriority(const Request& request) const {
+        if (_admin) return Priority::high;
+        std::string_view uri(request.uri);
+        if (uri == _options.metricsPath || uri == Tracer::instance().options().exportPath) {
+            return Priority::high;
+        }
+        for (const auto& path : _options.lanes.highPriorityPaths) {
+            if (uri.starts_with(path)) return Priority::high;
+        }
+        return Priority::normal;
+    }
+
+private:
+    /// High priority routes keep their lane. Answers from memory and small files are latency
+    /// critical as well, large files are bulk.
+    Priority priorityOf(const Request& request, const Response& response) const {
+        if (routePriority(request) == Priority::high || !response.file()) return Priority::high;
+        if (response.fileSize() <= _options.lanes.smallFileSize) return Priority::high;
+        if (response.fileSize() >= _options.lanes.bulkFileSize) return Priority::low;
+        return Priority::normal;
+    }
+
+    Response respond(const Request& request) {
+        auto alloc = request.get_allocator();
+        if (_serveMetrics && std::string_view(request.uri) == _options.metricsPath) {
+            Response response(StatusType::ok, "text/plain; version=0.0.4", alloc);
+            response.setContent(Metrics::instance().renderPrometheus());
+            return response;
+        }
+        if (_serveMetrics && Tracer::instance().options().sampleEvery > 0 &&
+            std::string_view(request.uri) == Tracer::instance().options().exportPath) {
+            Response response(StatusType::ok, "application/json", alloc);
+            response.setContent(Tracer::instance().renderChromeTrace());
+            return response;
+        }
+        if (_admin) return Response(StatusType::not_found, "text/html", alloc);
+
+        // Request path must be absolute and stay within the document root.
+        auto reqPath = UrlPath::Cache::local().resolve(request.uri);
+        if (!reqPath) return Response(StatusType::bad_request, "text/html", alloc);
+        return serveFile(*reqPath, alloc);
+    }
+
+    Response serveFile(std::string_view reqPath, const Response::allocator_type& alloc) {
+        if (reqPath.back() == '/') return Response(StatusType::ok, "text/html", alloc);
+
+        // Get the file extension.
+        std::size_t lastSlashPos = reqPath.find_last_of('/');
+        std::size_t lastDotPos = reqPath.find_last_of('.');
+        std::string_view extension;
+        if (lastDotPos != std::string_view::npos && lastDotPos > lastSlashPos) {
+            extension = reqPath.substr(lastDotPos + 1);
+        }
+
+        // Open the file to send back.
+        std::pmr::string fullPath(_options.docRoot, alloc);
+        fullPath.append(reqPath);
+        auto [err, file] = OpenFileCache::instance().open(fullPath);
+        if (err) return Response(StatusType::not_found, "text/html", alloc);
+
+        // Fill out the response to be sent to the client, the file is streamed by the writer.
+        Response response(StatusType::ok, MimeType::extensionToType(extension), alloc);
+        auto size = file->size();
+        response.setFile(std::move(file), size);
+        return response;
+    }
+
+private:
+    const ServerOptions& _options;
+    bool _admin;
+    bool _serveMetrics;
+};
+
+#endif  // TINY_HTTP_SERVER_REQUEST_HANDLER_H
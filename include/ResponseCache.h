@@ -0,0 +1,356 @@
+#ifndef TINY_HTTP_SERVER_RESPONSE_CACHE_H
+#define TINY_HTTP_SERVER_RESPONSE_CACHE_H
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "HttpRequest.h"
+#include "LruList.h"
+#include "Metrics.h"
+
+#define asio boost::asio
+
+struct ResponseCacheOptions {
+    /// How long a proxied response is served from the cache when the upstream does not give a
+    /// max-age of its own. Caching is disabled while zero.
+    std::chrono::milliseconds ttl{0};
+    /// How long past its expiry an entry is still served while a single request refreshes it.
+    std::chrono::milliseconds staleWhileRevalidate = std::chrono::seconds(10);
+    /// Bytes of cached responses in total, the least recently used ones are evicted beyond.
+    std::size_t maxBytes = 64 << 20;
+    /// Larger responses are not cached, they are streamed as before.
+    std::size_t maxEntrySize = 1 << 20;
+    /// Request headers that are part of the key. Responses varying on others are not cached.
+    std::vector<std::string> varyHeaders{"Accept-Encoding"};
+};
+
+/// A response as served from the cache.
+struct CachedResponse {
+    int status = 0;
+    /// Status line and end-to-end header fields, without the empty line ending the head.
+    std::string head;
+    std::string body;
+    std::chrono::steady_clock::time_point storedAt;
+    /// Marked public or given an s-maxage, it may be served to requests with cookies too.
+    bool shared = false;
+};
+
+/// Process-wide micro-cache of proxied responses, keyed by method, request target, Host and the
+/// values of the selected Vary headers. Entries are fresh for their TTL, then served stale
+/// for a while longer as a single request refreshes them. Misses of a key are coalesced: the
+/// first one fetches the response, the others await that flight instead of stampeding to the
+/// upstream. Responses that cannot be cached are remembered for the TTL, their requests then
+/// pass straight through. Entries are spread over shards, each with its own lock, LRU list and
+/// share of 'maxBytes'.
+class ResponseCache {
+    using Clock = std::chrono::steady_clock;
+
+public:
+    using Response = std::shared_ptr<const CachedResponse>;
+
+    /// A computation of a response shared by every request that awaits it.
+    class Flight {
+    public:
+        /// 'co_await flight.wait(ioContext)' gives the response once the flight landed, null
+        /// when it brought none to share. The waiter is resumed on 'ioContext'.
+        auto wait(asio::io_context& ioContext) noexcept {
+            struct Awaiter {
+                Flight& flight;
+                asio::io_context& ioContext;
+
+                bool await_ready() const noexcept { return false; }
+                bool await_suspend(std::coroutine_handle<> handle) {
+                    std::lock_guard lock(flight._mutex);
+                    if (flight._landed) return false;
+                    flight._waiters.emplace_back(handle, &ioContext);
+                    return true;
+                }
+                /// Never written again once landed.
+                Response await_resume() const noexcept { return flight._response; }
+            };
+            return Awaiter{*this, ioContext};
+        }
+
+        void land(Response response) {
+            std::vector<std::pair<std::coroutine_handle<>, asio::io_context*>> waiters;
+            {
+                std::lock_guard lock(_mutex);
+                _response = std::move(response);
+                _landed = true;
+                waiters.swap(_waiters);
+            }
+            for (auto [handle, ioContext] : waiters) {
+                asio::post(*ioContext, [handle] { handle.resume(); });
+            }
+        }
+
+    private:
+        std::mutex _mutex;
+        bool _landed = false;
+        Response _response;
+        std::vector<std::pair<std::coroutine_handle<>, asio::io_context*>> _waiters;
+    };
+
+    /// The duty to land the flight of a key, held by the request that missed or the refresh of a
+    /// stale entry. Dropped before it stored anything, it lands the flight empty.
+    class Fill {
+    public:
+        Fill(ResponseCache& cache, std::string key, std::shared_ptr<Flight> flight,
+             bool sharedOnly)
+            : _cache(&cache),
+              _key(std::move(key)),
+              _flight(std::move(flight)),
+              _sharedOnly(sharedOnly) {}
+
+        Fill(Fill&&) noexcept = default;
+
+        Fill& operator=(Fill&&) = delete;
+
+        ~Fill() {
+            if (_flight) _cache->abandon(_key, std::move(_flight));
+        }
+
+        /// Cache 'response' for 'ttl' and hand it to the waiters. Gives the response as cached.
+        Response store(CachedResponse response, std::chrono::milliseconds ttl) {
+            return _cache->store(_key, std::move(response), ttl, std::move(_flight));
+        }
+
+        /// The response cannot be cached: requests of the key pass through for the TTL.
+        void pass() { _cache->pass(_key, std::move(_flight)); }
+
+        /// Set when the request carried cookies, see lookup. Only a shared response may be
+        /// stored then, and one that is not says nothing about the requests without cookies, so
+        /// it does not make the key pass either.
+        [[nodiscard]] bool sharedOnly() const noexcept { return _sharedOnly; }
+
+    private:
+        ResponseCache* _cache;
+        std::string _key;
+        std::shared_ptr<Flight> _flight;
+        bool _sharedOnly;
+    };
+
+    struct Lookup {
+        /// Set on hits, fresh or stale.
+        Response response;
+        /// Set when the request is to fetch the response, or for a stale hit to refresh it.
+        std::optional<Fill> fill;
+        /// Set when the request is to await the flight of another one.
+        std::shared_ptr<Flight> flight;
+    };
+
+    static ResponseCache& instance() {
+        static ResponseCache cache;
+        return cache;
+    }
+
+    void setOptions(const ResponseCacheOptions& options) {
+        _options = options;
+        for (auto& shard : _shards) {
+            std::lock_guard lock(shard.mutex);
+            shard.entries.clear();
+            shard.bytes = 0;
+        }
+    }
+
+    [[nodiscard]] const ResponseCacheOptions& options() const noexcept { return _options; }
+
+    /// Key of 'request', none when it is not to be cached: caching is disabled, it is neither a
+    /// GET nor a HEAD, or it carries a body or credentials. Cookies are not part of it, requests
+    /// with cookies are looked up 'sharedOnly' instead. The request target is taken as sent,
+    /// the upstream may tell apart what decoding or normalizing would merge, and the Host is part
+    /// of it so that virtual hosts never share entries.
+    std::optional<std::string> keyOf(const Request& request) const {
+        if (_options.ttl.count() == 0) return std::nullopt;
+        if (request.method != "GET" && request.method != "HEAD") return std::nullopt;
+        if (request.header(KnownHeader::content_length) ||
+            request.header(KnownHeader::transfer_encoding) ||
+            findHeader(request.headers, "Authorization")) {
+            return std::nullopt;
+        }
+        std::string key(request.method);
+        key.append(" ").append(request.uri).append("\n");
+        if (auto* host = request.header(KnownHeader::host)) key.append(host->value);
+        for (const auto& name : _options.varyHeaders) {
+            key.append("\n");
+            if (auto* header = findHeader(request.headers, name)) key.append(header->value);
+        }
+        return key;
+    }
+
+    /// Whether 'response' may answer a request looked up with 'sharedOnly'.
+    static bool servable(const Response& response, bool sharedOnly) noexcept {
+        return response && (!sharedOnly || response->shared);
+    }
+
+    /// What a request of 'key' does: serve the response found, with a stale one also refresh it,
+    /// await the flight of another request, or fetch the response itself. With neither set it
+    /// passes through. A 'sharedOnly' request, one with cookies, is served shared responses
+    /// only and passes through entries holding others, like Authorization does for all of them.
+    Lookup lookup(const std::string& key, bool sharedOnly) {
+        auto now = Clock::now();
+        Shard& shard = _shards.of(key);
+        auto& metrics = Metrics::local();
+        Lookup result;
+        std::lock_guard lock(shard.mutex);
+        Entry* found = shard.entries.touch(key);
+        Entry& entry = found ? *found : entryOf(shard, key);
+        if (entry.response && !servable(entry.response, sharedOnly) && now < entry.staleUntil) {
+            metrics.responseCachePasses.add();
+            return result;
+        }
+        if (entry.response && now < entry.freshUntil) {
+            metrics.responseCacheHits.add();
+            result.response = entry.response;
+            return result;
+        }
+        if (entry.pass && now < entry.freshUntil) {
+            metrics.responseCachePasses.add();
+            return result;
+        }
+        if (entry.response && now < entry.staleUntil) {
+            metrics.responseCacheStaleHits.add();
+            result.response = entry.response;
+            if (!entry.flight) {
+                entry.flight = std::make_shared<Flight>();
+                result.fill.emplace(*this, key, entry.flight, sharedOnly);
+            }
+            return result;
+        }
+        if (entry.flight) {
+            metrics.responseCacheCoalesced.add();
+            result.flight = entry.flight;
+            return result;
+        }
+        metrics.responseCacheMisses.add();
+        entry.pass = false;
+        entry.flight = std::make_shared<Flight>();
+        result.fill.emplace(*this, key, entry.flight, sharedOnly);
+        evict(shard);
+        return result;
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        Response response;
+        Clock::time_point freshUntil;
+        Clock::time_point staleUntil;
+        /// Requests pass through until 'freshUntil'.
+        bool pass = false;
+        std::shared_ptr<Flight> flight;
+        std::size_t bytes = 0;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        LruList<Entry, &Entry::key> entries;
+        std::size_t bytes = 0;
+    };
+
+    ResponseCache() = default;
+
+    /// Entry of 'key', added when there is none, e.g. because it was evicted in the meantime.
+    static Entry& entryOf(Shard& shard, const std::string& key) {
+        if (Entry* entry = shard.entries.find(key)) return *entry;
+        Entry& entry = shard.entries.pushFront({key, nullptr, {}, {}, false, nullptr, 0});
+        account(shard, entry);
+        return entry;
+    }
+
+    /// Entries without a response count as well, so that passing keys are bounded too.
+    static void account(Shard& shard, Entry& entry) {
+        shard.bytes -= entry.bytes;
+        entry.bytes = sizeof(Entry) + entry.key.size();
+        if (const auto& response = entry.response) {
+            entry.bytes += response->head.size() + response->body.size();
+        }
+        shard.bytes += entry.bytes;
+    }
+
+    Response store(const std::string& key, CachedResponse cached, std::chrono::milliseconds ttl,
+                   std::shared_ptr<Flight> flight) {
+        auto now = Clock::now();
+        cached.storedAt = now;
+        auto response = std::make_shared<const CachedResponse>(std::move(cached));
+        Shard& shard = _shards.of(key);
+        {
+            std::lock_guard lock(shard.mutex);
+            Entry& entry = entryOf(shard, key);
+            if (entry.flight == flight) entry.flight.reset();
+            entry.response = response;
+            entry.pass = false;
+            entry.freshUntil = now + ttl;
+            entry.staleUntil = entry.freshUntil + _options.staleWhileRevalidate;
+            account(shard, entry);
+            // Evicting for its own bytes must not drop it.
+            shard.entries.moveToFront(entry);
+            evict(shard);
+        }
+        flight->land(response);
+        return response;
+    }
+
+    void pass(const std::string& key, std::shared_ptr<Flight> flight) {
+        Shard& shard = _shards.of(key);
+        {
+            std::lock_guard lock(shard.mutex);
+            Entry& entry = entryOf(shard, key);
+            if (entry.flight == flight) entry.flight.reset();
+            entry.response.reset();
+            entry.pass = true;
+            entry.freshUntil = Clock::now() + _options.ttl;
+            account(shard, entry);
+            shard.entries.moveToFront(entry);
+            evict(shard);
+        }
+        flight->land(nullptr);
+    }
+
+    /// A flight that failed: a stale response stays until it expires, anything else goes.
+    void abandon(const std::string& key, std::shared_ptr<Flight> flight) {
+        Shard& shard = _shards.of(key);
+        {
+            std::lock_guard lock(shard.mutex);
+            if (Entry* entry = shard.entries.find(key); entry && entry->flight == flight) {
+                entry->flight.reset();
+                if (!entry->response && !entry->pass) {
+                    shard.bytes -= entry->bytes;
+                    shard.entries.erase(*entry);
+                }
+            }
+        }
+        flight->land(nullptr);
+    }
+
+    /// Drop the least recently used entries while the shard is over its share of 'maxBytes'.
+    /// Entries in flight keep their place, their requests would stampede otherwise.
+    void evict(Shard& shard) {
+        auto capacity = _shards.share(_options.maxBytes);
+        auto it = shard.entries.end();
+        while (shard.bytes > capacity && it != shard.entries.begin()) {
+            --it;
+            if (it->flight) continue;
+            shard.bytes -= it->bytes;
+            it = shard.entries.erase(it);
+            Metrics::local().responseCacheEvictions.add();
+        }
+    }
+
+private:
+    ResponseCacheOptions _options;
+    Sharded<Shard> _shards;
+};
+
+#undef asio
+
+#endif  // TINY_HTTP_SERVER_RESPONSE_CACHE_H
@@ -0,0 +1,67 @@
+#ifndef TINY_HTTP_SERVER_RUN_BUDGET_H
+#define TINY_HTTP_SERVER_RUN_BUDGET_H
+
+#include <chrono>
+#include <cstdint>
+
+struct FairnessOptions {
+    /// Stream operations a connection may complete in a row without going back to the event
+    /// loop, unlimited while 0. The next one waits at the back of the queue of its io_context.
+    std::uint32_t maxOperationsPerRun = 32;
+    /// The same bound as time spent in a run, unlimited while zero.
+    std::chrono::microseconds timeSlice{500};
+};
+
+/// What the io thread spent on the coroutine it is running since that last waited, so that a
+/// connection whose operations all complete right away, like a TLS session with pipelined
+/// requests already received, cannot starve the others of its io_context. Each io thread runs a
+/// single executor, so the budget is kept per thread.
+class RunBudget {
+    using Clock = std::chrono::steady_clock;
+
+public:
+    static RunBudget& instance() {
+        static RunBudget budget;
+        return budget;
+    }
+
+    void setOptions(const FairnessOptions& options) { _options = options; }
+
+    [[nodiscard]] const FairnessOptions& options() const noexcept { return _options; }
+
+    /// Account an operation of the running coroutine. Returns whether the run is over budget,
+    /// the coroutine yields before the operation then. The time slice is measured from the second
+    /// operation of a run on, so the many connections waiting for every operation never read the
+    /// clock.
+    bool charge() noexcept {
+        auto& run = current();
+        ++run.operations;
+        if (_options.maxOperationsPerRun > 0 && run.operations > _options.maxOperationsPerRun) {
+            return true;
+        }
+        if (_options.timeSlice.count() == 0 || run.operations < 2) return false;
+        auto now = Clock::now();
+        if (run.operations == 2) run.startedAt = now;
+        return now - run.startedAt > _options.timeSlice;
+    }
+
+    /// The running coroutine is about to wait, or resumed after yielding: a new run starts.
+    static void restart() noexcept { current() = {}; }
+
+private:
+    struct Run {
+        std::uint32_t operations = 0;
+        Clock::time_point startedAt;
+    };
+
+    RunBudget() = default;
+
+    static Run& current() noexcept {
+        thread_local Run run;
+        return run;
+    }
+
+    FairnessOptions _options;
+};
+
+#endif  // TINY_HTTP_SERVER_RUN_BUDGET_H
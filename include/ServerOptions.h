@@ -0,0 +1,78 @@
+#ifndef TINY_HTTP_SERVER_SERVER_OPTIONS_H
+#define TINY_HTTP_SERVER_SERVER_OPTIONS_H
+
+#include <chrono>
+#include <string>
+#include <unordered_map>
+
+#include "AccessLog.h"
+#include "Admission.h"
+#include "DnsCache.h"
+#include "FileIo.h"
+#include "Listener.h"
+#include "OpenFileCache.h"
+#include "PriorityLanes.h"
+#include "Proxy.h"
+#include "RateLimit.h"
+#include "RunBudget.h"
+#include "Tls.h"
+#include "Trace.h"
+#include "WebSocket.h"
+
+/// Most of these configure process-wide singletons. The Server constructor hands them over
+/// through their setOptions, which has to happen before anything is served: the options are
+/// read on every thread without synchronization.
+struct ServerOptions {
+    /// Directory that static files are served from.
+    std::string docRoot = "./";
+    /// Socket options of the listeners.
+    ListenerOptions listener;
+    /// HTTPS listener, served like the main one once the TLS handshake completed.
+    TlsOptions tls;
+    /// Open descriptors and metadata of the files served from 'docRoot'.
+    OpenFileCacheOptions openFileCache;
+    /// Reads of static files, made off the io threads and streamed to the client.
+    FileIoOptions fileIo;
+
+    /// Requests whose head grows beyond this are answered with 431.
+    std::size_t maxHeaderSize = 32 << 10;
+
+    /// Request path the Prometheus metrics are exposed on.
+    std::string metricsPath = "/metrics";
+    /// When non-zero, metrics are served on a separate listener bound to this port
+    /// instead of the main one.
+    unsigned short adminPort = 0;
+
+    /// Access logging is disabled while 'accessLog.path' is empty.
+    AccessLogOptions accessLog;
+    /// Sampled request traces, exported next to the metrics, and logging of slow requests.
+    TraceOptions trace;
+
+    /// Connection and request limits, and shedding on overload. The admin listener is exempt.
+    AdmissionOptions admission;
+    /// Per-client request rate limits, answered with 429. The admin listener is exempt.
+    RateLimitOptions rateLimit;
+    /// How long a connection may keep its io thread before the others get their turn.
+    FairnessOptions fairness;
+    /// Which requests are served on which lane of their io_context, and the share of each lane.
+    LaneOptions lanes;
+
+    /// Requests forwarded to upstream servers instead of being served from 'docRoot'.
+    ProxyOptions proxy;
+    /// Lookups of the upstream host names.
+    DnsCacheOptions dns;
+
+    /// Request paths that accept a WebSocket upgrade and the handlers serving them.
+    std::unordered_map<std::string, WebSocketHandler> webSocketRoutes;
+    /// Messages growing beyond this, summed over their fragments, close the WebSocket with 1009.
+    std::size_t maxWebSocketMessageSize = 1 << 20;
+
+    /// Unix socket a newer process connects to for taking over the listeners. When it exists at
+    /// startup, the listeners of the running process are inherited instead of bound.
+    /// Graceful upgrades are disabled while empty.
+    std::string upgradeSocketPath;
+    /// How long a replaced process waits for in-flight requests before it exits anyway.
+    std::chrono::milliseconds drainTimeout = std::chrono::seconds(30);
+};
+
+#endif  // TINY_HTTP_SERVER_SERVER_OPTIONS_H
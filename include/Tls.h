@@ -0,0 +1,405 @@
+#ifndef TINY_HTTP_SERVER_TLS_H
+#define TINY_HTTP_SERVER_TLS_H
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <cerrno>
+#include <csignal>
+#include <chrono>
+#include <cstddef>
+#include <new>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <variant>
+
+#include "AsioCoroutineUtil.h"
+#include "Lazy.h"
+#include "Metrics.h"
+#include "PriorityLanes.h"
+#include "RunBudget.h"
+#include "Trace.h"
+
+#define asio boost::asio
+#define tcp asio::ip::tcp
+
+struct TlsOptions {
+    /// Port of the HTTPS listener. TLS is disabled while 0.
+    unsigned short port = 0;
+    /// PEM files with the certificate followed by its intermediates, and with the private key.
+    std::string certificateChainFile;
+    std::string privateKeyFile;
+    /// Let clients resume with stateless session tickets. Without them, sessions are only
+    /// resumed from the server side cache.
+    bool sessionTickets = true;
+    /// Sessions kept in the cache shared by all io threads, and how long they can be resumed.
+    std::size_t sessionCacheSize = 20480;
+    std::chrono::seconds sessionTimeout = std::chrono::minutes(5);
+    /// Have OpenSSL hand the record layer to the kernel (kTLS) where it can, after which data is
+    /// encrypted by the kernel right on the socket.
+    bool kernelTls = true;
+    /// Connections that did not complete the handshake within this are closed.
+    std::chrono::milliseconds handshakeTimeout = std::chrono::seconds(10);
+};
+
+/// Certificate, key and session cache of an HTTPS listener, shared by all of its connections.
+class TlsContext {
+public:
+    explicit TlsContext(const TlsOptions& options) : _context(asio::ssl::context::tls_server) {
+        _context.set_options(asio::ssl::context::default_workarounds |
+                             asio::ssl::context::no_sslv2 | asio::ssl::context::no_sslv3 |
+                             asio::ssl::context::no_tlsv1 | asio::ssl::context::no_tlsv1_1);
+        _context.use_certificate_chain_file(options.certificateChainFile);
+        _context.use_private_key_file(options.privateKeyFile, asio::ssl::context::pem);
+
+        // OpenSSL writes with write(2) rather than send(MSG_NOSIGNAL) like asio does, so a peer
+        // that went away must not kill the process.
+        std::signal(SIGPIPE, SIG_IGN);
+
+        SSL_CTX* ctx = _context.native_handle();
+        // Clients closing without close_notify end the stream like an orderly shutdown does.
+        SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION);
+        if (!options.sessionTickets) SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+#ifdef SSL_OP_ENABLE_KTLS
+        if (options.kernelTls) SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+        // Idle keep-alive connections give their record buffers back, like the read buffers.
+        SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, static_cast<long>(options.sessionCacheSize));
+        SSL_CTX_set_timeout(ctx, static_cast<long>(options.sessionTimeout.count()));
+        SSL_CTX_set_session_id_context(ctx, kSessionIdContext, sizeof(kSessionIdContext) - 1);
+        SSL_CTX_set_alpn_select_cb(ctx, selectProtocol, nullptr);
+    }
+
+    TlsContext(const TlsContext&) = delete;
+
+    TlsContext& operator=(const TlsContext&) = delete;
+
+    [[nodiscard]] SSL_CTX* native() noexcept { return _context.native_handle(); }
+
+private:
+    static constexpr unsigned char kSessionIdContext[] = "TinyHttpServer";
+    /// ALPN protocols in order of preference, in wire format.
+    static constexpr unsigned char kProtocols[] = "\x02h2\x08http/1.1";
+
+    static int selectProtocol(SSL*, const unsigned char** out, unsigned char* outLength,
+                              const unsigned char* in, unsigned int inLength, void*) {
+        auto* selected = const_cast<unsigned char**>(out);
+        if (SSL_select_next_proto(selected, outLength, kProtocols, sizeof(kProtocols) - 1, in,
+                                  inLength) != OPENSSL_NPN_NEGOTIATED) {
+            // No protocol in common, carry on without ALPN and speak HTTP/1.1.
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+        return SSL_TLSEXT_ERR_OK;
+    }
+
+    asio::ssl::context _context;
+};
+
+/// Server side of a TLS connection on an accepted socket, owned by Connection like the socket.
+/// OpenSSL reads and writes the non-blocking socket itself and the coroutine waits for readiness
+/// whenever it wants more. Unlike with asio::ssl::stream, whose engine runs OpenSSL on memory
+/// BIOs, records need no extra copy and OpenSSL can switch the socket to kTLS.
+class TlsSession {
+public:
+    TlsSession(TlsContext& context, tcp::socket& socket)
+        : _socket(socket), _ssl(SSL_new(context.native())) {
+        if (!_ssl) throw std::bad_alloc();
+        boost::system::error_code ec;
+        _socket.non_blocking(true, ec);
+        SSL_set_fd(_ssl, _socket.native_handle());
+        SSL_set_accept_state(_ssl);
+    }
+
+    TlsSession(const TlsSession&) = delete;
+
+    TlsSession& operator=(const TlsSession&) = delete;
+
+    ~TlsSession() {
+        // Best effort close_notify, never waiting for the socket. Not allowed after an error.
+        if (!_failed && SSL_is_init_finished(_ssl)) {
+            ERR_clear_error();
+            SSL_shutdown(_ssl);
+        }
+        SSL_free(_ssl);
+    }
+
+    Lazy<std::error_code> handshake() {
+        auto& metrics = Metrics::local();
+        while (true) {
+            ERR_clear_error();
+            int result = SSL_do_handshake(_ssl);
+            if (result == 1) break;
+            if (auto err = co_await waitFor(SSL_get_error(_ssl, result)); err) {
+                metrics.tlsHandshakeFailures.add();
+                co_return err;
+            }
+        }
+        metrics.tlsHandshakes.add();
+        if (resumed()) metrics.tlsResumedHandshakes.add();
+        if (kernelSend()) metrics.kernelTlsConnections.add();
+        co_return std::error_code{};
+    }
+
+    Lazy<std::pair<std::error_code, std::size_t>> readSome(asio::mutable_buffer buffer) {
+        auto* trace = co_await currentTrace();
+        while (true) {
+            ERR_clear_error();
+            std::size_t n = 0;
+            // Time in OpenSSL, waiting for the socket is traced by the wait.
+            TraceTimer timer;
+            timer.start(trace);
+            int result = SSL_read_ex(_ssl, buffer.data(), buffer.size(), &n);
+            timer.stop("tls");
+            if (result == 1) co_return std::make_pair(std::error_code{}, n);
+            if (auto err = co_await waitFor(SSL_get_error(_ssl, result)); err) {
+                co_return std::make_pair(err, std::size_t{0});
+            }
+        }
+    }
+
+    /// Write all of 'buffers'. Small buffers, like the pieces of a response head, are gathered
+    /// into records of up to kRecordSize instead of one record each.
+    template <typename ConstBufferSequence>
+    Lazy<std::pair<std::error_code, std::size_t>> write(const ConstBufferSequence& buffers) {
+        std::size_t written = 0;
+        auto end = asio::buffer_sequence_end(buffers);
+        for (auto it = asio::buffer_sequence_begin(buffers); it != end; ++it) {
+            asio::const_buffer buffer(*it);
+            if (buffer.size() < kRecordSize) {
+                _gather.append(static_cast<const char*>(buffer.data()), buffer.size());
+                if (_gather.size() < kRecordSize) continue;
+            }
+            if (auto err = co_await flushGathered(written); err) {
+                co_return std::make_pair(err, written);
+            }
+            if (buffer.size() >= kRecordSize) {
+                if (auto err = co_await writeAll(buffer); err) {
+                    co_return std::make_pair(err, written);
+                }
+                written += buffer.size();
+            }
+        }
+        auto err = co_await flushGathered(written);
+        co_return std::make_pair(err, written);
+    }
+
+    /// Whether decrypted data is buffered, which the socket becoming readable would not tell.
+    [[nodiscard]] bool pending() const noexcept { return SSL_has_pending(_ssl) == 1; }
+
+    [[nodiscard]] bool resumed() const noexcept { return SSL_session_reused(_ssl) == 1; }
+
+    /// Whether records are encrypted by the kernel.
+    [[nodiscard]] bool kernelSend() const noexcept {
+        return BIO_get_ktls_send(SSL_get_wbio(_ssl)) == 1;
+    }
+
+    /// The protocol agreed on with ALPN, empty without.
+    [[nodiscard]] std::string_view alpn() const noexcept {
+        const unsigned char* data = nullptr;
+        unsigned int length = 0;
+        SSL_get0_alpn_selected(_ssl, &data, &length);
+        return {reinterpret_cast<const char*>(data), length};
+    }
+
+private:
+    /// Largest TLS record payload.
+    static constexpr std::size_t kRecordSize = 16 << 10;
+
+    /// Wait for what the failed call with 'error' needs, or give the error it failed with.
+    Lazy<std::error_code> waitFor(int error) {
+        // Waiting for the socket ends the run of the connection, see RunBudget.
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) RunBudget::restart();
+        switch (error) {
+            case SSL_ERROR_WANT_READ:
+                co_return co_await asyncWaitReadable(_socket);
+            case SSL_ERROR_WANT_WRITE:
+                co_return co_await asyncWaitWritable(_socket);
+            case SSL_ERROR_ZERO_RETURN:
+                co_return boost::system::error_code(asio::error::eof);
+            case SSL_ERROR_SYSCALL:
+                _failed = true;
+                if (errno == 0) co_return boost::system::error_code(asio::error::eof);
+                co_return std::error_code(errno, std::system_category());
+            default:
+                _failed = true;
+                co_return boost::system::error_code(static_cast<int>(ERR_get_error()),
+                                                    asio::error::get_ssl_category());
+        }
+    }
+
+    Lazy<std::error_code> writeAll(asio::const_buffer buffer) {
+        auto* trace = co_await currentTrace();
+        while (buffer.size() > 0) {
+            ERR_clear_error();
+            std::size_t n = 0;
+            TraceTimer timer;
+            timer.start(trace);
+            // Retried with the same arguments until the whole buffer went out.
+            int result = SSL_write_ex(_ssl, buffer.data(), buffer.size(), &n);
+            timer.stop("tls");
+            if (result == 1) {
+                buffer += n;
+                continue;
+            }
+            if (auto err = co_await waitFor(SSL_get_error(_ssl, result)); err) co_return err;
+        }
+        co_return std::error_code{};
+    }
+
+    Lazy<std::error_code> flushGathered(std::size_t& written) {
+        if (_gather.empty()) co_return std::error_code{};
+        auto err = co_await writeAll(asio::buffer(_gather));
+        if (!err) written += _gather.size();
+        _gather.clear();
+        co_return err;
+    }
+
+    tcp::socket& _socket;
+    SSL* _ssl;
+    /// Set after a fatal error, the session must not be used for a shutdown then.
+    bool _failed = false;
+    std::string _gather;
+};
+
+/// The byte stream of a client connection: the socket itself, or a TLS session running on it.
+/// Protocol code reads and writes it through the overloads below without caring which it is.
+class ClientStream {
+public:
+    explicit ClientStream(tcp::socket& socket, TlsSession* tls = nullptr) noexcept
+        : _socket(socket), _tls(tls) {}
+
+    [[nodiscard]] tcp::socket& socket() noexcept { return _socket; }
+
+    [[nodiscard]] TlsSession* tls() noexcept { return _tls; }
+
+    auto get_executor() { return _socket.get_executor(); }
+
+    /// Lane of its io_context the stream is served from: it yields to that lane when over its
+    /// RunBudget, and bulk responses wait on the low priority one between their chunks.
+    void setPriority(Priority priority) noexcept { _priority = priority; }
+
+    [[nodiscard]] Priority priority() const noexcept { return _priority; }
+
+    PriorityLanes& lanes() {
+        if (!_lanes) {
+            _lanes = &PriorityLanes::of(static_cast<asio::io_context&>(get_executor().context()));
+        }
+        return *_lanes;
+    }
+
+private:
+    tcp::socket& _socket;
+    TlsSession* _tls;
+    Priority _priority = Priority::normal;
+    PriorityLanes* _lanes = nullptr;
+};
+
+/// The awaiter of an operation on a ClientStream: 'SocketAwaiter' on the socket of a plain
+/// stream, the Lazy of the TLS session otherwise, or the result when it is known right away.
+/// Awaited in place like the socket awaiters, so plain streams cost no coroutine frame.
+/// A connection over its RunBudget yields to the others of its io_context before the operation.
+template <typename SocketAwaiter>
+class ClientStreamAwaiter {
+    using Result = decltype(std::declval<SocketAwaiter&>().await_resume());
+    using TlsAwaiter = typename Lazy<Result>::ValueAwaiter;
+
+public:
+    ClientStreamAwaiter(ClientStream& stream, SocketAwaiter awaiter)
+        : _stream(stream), _awaiter(std::in_place_index<0>, std::move(awaiter)) {}
+
+    ClientStreamAwaiter(ClientStream& stream, Lazy<Result> tls)
+        : _stream(stream), _awaiter(std::in_place_index<1>, std::move(tls)) {}
+
+    ClientStreamAwaiter(ClientStream& stream, Result result)
+        : _stream(stream), _awaiter(std::in_place_index<3>, std::move(result)) {}
+
+    bool await_ready() noexcept {
+        _yield = RunBudget::instance().charge();
+        return !_yield && _awaiter.index() == 3;
+    }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) {
+        if (!_yield) return start(handle);
+        Metrics::local().forcedYields.add();
+        // To the back of its lane, the operation starts once the others had their turn.
+        _stream.lanes().push(
+            [this, handle] {
+                RunBudget::restart();
+                start(handle).resume();
+            },
+            _stream.priority());
+        return std::noop_coroutine();
+    }
+
+    Result await_resume() {
+        switch (_awaiter.index()) {
+            case 0:
+                return std::get<0>(_awaiter).await_resume();
+            case 2:
+                return std::get<2>(_awaiter).await_resume();
+            default:
+                return std::get<3>(std::move(_awaiter));
+        }
+    }
+
+    /// The TLS session's Lazy runs on the executor of the caller.
+    ClientStreamAwaiter coAwait(Executor* executor) noexcept {
+        _executor = executor;
+        return std::move(*this);
+    }
+
+private:
+    /// Start the operation, giving the coroutine to continue with.
+    template <typename Promise>
+    std::coroutine_handle<> start(std::coroutine_handle<Promise> handle) {
+        if (_awaiter.index() == 3) return handle;
+        if (auto* awaiter = std::get_if<0>(&_awaiter)) {
+            // Not suspending means it completed right away, 'handle' carries on then.
+            if (!awaiter->await_suspend(handle)) return handle;
+            RunBudget::restart();
+            return std::noop_coroutine();
+        }
+        auto tls = std::get<1>(std::move(_awaiter));
+        return _awaiter.template emplace<2>(tls.coAwait(_executor)).await_suspend(handle);
+    }
+
+    ClientStream& _stream;
+    std::variant<SocketAwaiter, Lazy<Result>, TlsAwaiter, Result> _awaiter;
+    Executor* _executor = nullptr;
+    bool _yield = false;
+};
+
+template <typename AsioBuffer>
+inline ClientStreamAwaiter<ReadSomeAwaiter<tcp::socket, AsioBuffer>> asyncReadSome(
+    ClientStream& stream, AsioBuffer&& buffer) noexcept {
+    if (auto* tls = stream.tls()) return {stream, tls->readSome(buffer)};
+    return {stream, ReadSomeAwaiter<tcp::socket, AsioBuffer>(stream.socket(),
+                                                             std::forward<AsioBuffer>(buffer))};
+}
+
+template <typename AsioBuffer>
+inline ClientStreamAwaiter<WriteAwaiter<tcp::socket, AsioBuffer>> asyncWrite(
+    ClientStream& stream, AsioBuffer&& buffer) noexcept {
+    if (auto* tls = stream.tls()) return {stream, tls->write(buffer)};
+    return {stream, WriteAwaiter<tcp::socket, AsioBuffer>(stream.socket(),
+                                                          std::forward<AsioBuffer>(buffer))};
+}
+
+/// Wait until there is something to read, which may already be buffered by the TLS session.
+inline ClientStreamAwaiter<WaitAwaiter<tcp::socket>> asyncWaitReadable(
+    ClientStream& stream) noexcept {
+    if (auto* tls = stream.tls(); tls && tls->pending()) return {stream, std::error_code{}};
+    return {stream, WaitAwaiter<tcp::socket>(stream.socket(), tcp::socket::wait_read)};
+}
+
+#undef tcp
+#undef asio
+
+#endif  // TINY_HTTP_SERVER_TLS_H
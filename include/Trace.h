@@ -0,0 +1,333 @@
+#ifndef TINY_HTTP_SERVER_TRACE_H
+#define TINY_HTTP_SERVER_TRACE_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "Common.h"
+
+struct TraceOptions {
+    /// Keep the spans of 1 of every 'sampleEvery' requests for export, none while 0.
+    std::uint32_t sampleEvery = 0;
+    /// Requests taking longer than this log the breakdown of their spans, sampled or not.
+    /// Disabled while zero.
+    std::chrono::microseconds slowThreshold{0};
+    /// Request path the sampled requests are exposed on as Chrome trace JSON, wherever the
+    /// metrics are served.
+    std::string exportPath = "/debug/trace";
+    /// Spans kept per thread until they are exported, the oldest requests are dropped beyond.
+    std::size_t maxSpansPerThread = 1 << 16;
+};
+
+/// Timestamps of spans: ticks of the time stamp counter where there is one, which is read in a
+/// few cycles, and nanoseconds of the steady clock elsewhere. See Tracer::ticksPerMicrosecond.
+inline std::uint64_t traceNow() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                          std::chrono::steady_clock::now().time_since_epoch())
+                                          .count());
+#endif
+}
+
+struct TraceSpan {
+    /// A string literal.
+    const char* name;
+    std::uint64_t begin;
+    std::uint64_t end;
+};
+
+/// The spans of the request a connection is serving, recorded on the connection's thread. Bound
+/// to the connection's coroutine with bindTrace, awaiters find it through their caller, see
+/// traceOf. Spans are only recorded between start() and stop(), i.e. not while idle.
+class RequestTrace {
+public:
+    static constexpr std::size_t kMaxSpans = 64;
+    static constexpr std::size_t kMaxNames = 8;
+
+    /// Name of a span and the time spent in all spans of that name.
+    struct Total {
+        const char* name;
+        std::uint64_t ticks;
+        std::uint32_t count;
+    };
+
+    void start(bool sampled) noexcept {
+        _active = true;
+        _sampled = sampled;
+        _spanCount = 0;
+        _totalCount = 0;
+        _startedAt = traceNow();
+    }
+
+    void stop() noexcept {
+        _active = false;
+        _stoppedAt = traceNow();
+    }
+
+    [[nodiscard]] bool active() const noexcept { return _active; }
+
+    [[nodiscard]] bool sampled() const noexcept { return _sampled; }
+
+    /// Spans beyond kMaxSpans are still accounted in the totals.
+    void add(const char* name, std::uint64_t begin, std::uint64_t end) noexcept {
+        if (!_active) return;
+        if (_sampled && _spanCount < kMaxSpans) _spans[_spanCount++] = {name, begin, end};
+        for (std::size_t i = 0; i < _totalCount; ++i) {
+            if (_totals[i].name == name) {
+                _totals[i].ticks += end - begin;
+                ++_totals[i].count;
+                return;
+            }
+        }
+        if (_totalCount < kMaxNames) _totals[_totalCount++] = {name, end - begin, 1};
+    }
+
+    [[nodiscard]] std::uint64_t startedAt() const noexcept { return _startedAt; }
+
+    [[nodiscard]] std::uint64_t stoppedAt() const noexcept { return _stoppedAt; }
+
+    /// Only recorded for sampled requests.
+    [[nodiscard]] std::span<const TraceSpan> spans() const noexcept {
+        return {_spans.data(), _spanCount};
+    }
+
+    [[nodiscard]] std::span<const Total> totals() const noexcept {
+        return {_totals.data(), _totalCount};
+    }
+
+private:
+    bool _active = false;
+    bool _sampled = false;
+    std::uint64_t _startedAt = 0;
+    std::uint64_t _stoppedAt = 0;
+    std::size_t _spanCount = 0;
+    std::size_t _totalCount = 0;
+    std::array<TraceSpan, kMaxSpans> _spans;
+    std::array<Total, kMaxNames> _totals;
+};
+
+/// Times an awaited operation: started in await_suspend with the trace of the awaiting
+/// coroutine, stopped in await_resume. Does nothing unless that trace is active.
+class TraceTimer {
+public:
+    void start(RequestTrace* trace) noexcept {
+        if (!trace || !trace->active()) return;
+        _trace = trace;
+        _begin = traceNow();
+    }
+
+    void stop(const char* name) noexcept {
+        if (!_trace) return;
+        _trace->add(name, _begin, traceNow());
+        _trace = nullptr;
+    }
+
+private:
+    RequestTrace* _trace = nullptr;
+    std::uint64_t _begin = 0;
+};
+
+/// Keeps the traces of sampled requests in per-thread buffers until they are exported as Chrome
+/// trace event JSON, which Perfetto and chrome://tracing open, and logs the breakdown of slow
+/// requests to stderr. Each request shows up as its own track under the thread that served it.
+class Tracer {
+    using Clock = std::chrono::steady_clock;
+
+public:
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    void setOptions(const TraceOptions& options) { _options = options; }
+
+    [[nodiscard]] const TraceOptions& options() const noexcept { return _options; }
+
+    [[nodiscard]] bool enabled() const noexcept {
+        return _options.sampleEvery > 0 || _options.slowThreshold.count() > 0;
+    }
+
+    /// Whether the spans of the next request of the calling thread are kept.
+    bool sample() noexcept {
+        thread_local std::uint32_t seen = 0;
+        return _options.sampleEvery > 0 && seen++ % _options.sampleEvery == 0;
+    }
+
+    /// Account the stopped trace of a request. Returns whether it was slow.
+    bool finish(const RequestTrace& trace, std::string_view method, std::string_view uri,
+                int status) {
+        if (trace.sampled()) keep(trace, method, uri, status);
+        auto threshold = _options.slowThreshold.count();
+        if (threshold == 0) return false;
+        double micros = toMicros(trace.stoppedAt() - trace.startedAt());
+        if (micros < static_cast<double>(threshold)) return false;
+        logSlow(trace, method, uri, status, micros);
+        return true;
+    }
+
+    /// The requests kept since the previous call, which are dropped from the buffers.
+    std::string renderChromeTrace() {
+        std::vector<std::pair<std::size_t, std::deque<Request>>> taken;
+        {
+            std::lock_guard lock(_mutex);
+            for (std::size_t i = 0; i < _buffers.size(); ++i) {
+                std::lock_guard bufferLock(_buffers[i]->mutex);
+                taken.emplace_back(i, std::exchange(_buffers[i]->requests, {}));
+                _buffers[i]->spans = 0;
+            }
+        }
+
+        std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        bool first = true;
+        char buf[256];
+        auto event = [&](std::string_view name, std::size_t pid, std::uint64_t tid,
+                         std::uint64_t begin, std::uint64_t end, std::string_view args) {
+            if (!first) out.append(",");
+            first = false;
+            out.append("{\"ph\":\"X\",\"name\":");
+            appendJsonString(out, name);
+            int n = std::snprintf(buf, sizeof(buf),
+                                  ",\"pid\":%zu,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f", pid,
+                                  static_cast<unsigned long long>(tid), toMicros(begin - _epoch),
+                                  toMicros(end - begin));
+            out.append(buf, static_cast<std::size_t>(n));
+            if (!args.empty()) out.append(",\"args\":{").append(args).append("}");
+            out.append("}");
+        };
+        for (auto& [index, requests] : taken) {
+            if (requests.empty()) continue;
+            int n = std::snprintf(buf, sizeof(buf),
+                                  "%s{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%zu,"
+                                  "\"args\":{\"name\":\"thread %zu\"}}",
+                                  first ? "" : ",", index + 1, index);
+            out.append(buf, static_cast<std::size_t>(n));
+            first = false;
+            for (const auto& request : requests) {
+                std::string args = "\"status\":" + std::to_string(request.status);
+                event(request.label, index + 1, request.id, request.startedAt,
+                      request.stoppedAt, args);
+                for (const auto& span : request.spans) {
+                    event(span.name, index + 1, request.id, span.begin, span.end, {});
+                }
+            }
+        }
+        out.append("]}\n");
+        return out;
+    }
+
+private:
+    /// A sampled request waiting for its export.
+    struct Request {
+        std::uint64_t id;
+        std::string label;
+        int status;
+        std::uint64_t startedAt;
+        std::uint64_t stoppedAt;
+        std::vector<TraceSpan> spans;
+    };
+
+    struct Buffer {
+        std::mutex mutex;
+        std::deque<Request> requests;
+        std::size_t spans = 0;
+        std::uint64_t nextId = 0;
+    };
+
+    Tracer() : _epoch(traceNow()), _epochTime(Clock::now()) {}
+
+    /// Ticks per microsecond measured over the lifetime of the process, so that it gets more
+    /// precise the longer it runs.
+    double ticksPerMicrosecond() const noexcept {
+        auto ticks = static_cast<double>(traceNow() - _epoch);
+        auto elapsed = std::chrono::duration<double, std::micro>(Clock::now() - _epochTime);
+        return elapsed.count() > 0 && ticks > 0 ? ticks / elapsed.count() : 1.0;
+    }
+
+    double toMicros(std::uint64_t ticks) const noexcept {
+        return static_cast<double>(ticks) / ticksPerMicrosecond();
+    }
+
+    void keep(const RequestTrace& trace, std::string_view method, std::string_view uri,
+              int status) {
+        thread_local Buffer& buffer = registerBuffer();
+        auto spans = trace.spans();
+        std::lock_guard lock(buffer.mutex);
+        buffer.requests.push_back({buffer.nextId++, std::string(method) + " " + std::string(uri),
+                                   status, trace.startedAt(), trace.stoppedAt(),
+                                   std::vector<TraceSpan>(spans.begin(), spans.end())});
+        buffer.spans += spans.size() + 1;
+        while (buffer.spans > _options.maxSpansPerThread && buffer.requests.size() > 1) {
+            buffer.spans -= buffer.requests.front().spans.size() + 1;
+            buffer.requests.pop_front();
+        }
+    }
+
+    Buffer& registerBuffer() {
+        std::lock_guard lock(_mutex);
+        _buffers.push_back(std::make_unique<Buffer>());
+        return *_buffers.back();
+    }
+
+    /// One line per request, written at once so that lines of several threads do not mix.
+    void logSlow(const RequestTrace& trace, std::string_view method, std::string_view uri,
+                 int status, double micros) const {
+        std::string line = "slow request: ";
+        line.append(method).append(" ").append(uri).append(" ").append(std::to_string(status));
+        char buf[128];
+        int n = std::snprintf(buf, sizeof(buf), " %.0fus:", micros);
+        line.append(buf, static_cast<std::size_t>(n));
+        double accounted = 0;
+        for (const auto& total : trace.totals()) {
+            double spent = toMicros(total.ticks);
+            accounted += spent;
+            n = std::snprintf(buf, sizeof(buf), " %s %.0fus x%u,", total.name, spent, total.count);
+            line.append(buf, static_cast<std::size_t>(n));
+        }
+        n = std::snprintf(buf, sizeof(buf), " other %.0fus\n", std::max(micros - accounted, 0.0));
+        line.append(buf, static_cast<std::size_t>(n));
+        std::fwrite(line.data(), 1, line.size(), stderr);
+    }
+
+    static void appendJsonString(std::string& out, std::string_view value) {
+        out.push_back('"');
+        for (char c : value) {
+            if (c == '"' || c == '\\') {
+                out.push_back('\\');
+                out.push_back(c);
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out.append(escaped);
+            } else {
+                out.push_back(c);
+            }
+        }
+        out.push_back('"');
+    }
+
+private:
+    TraceOptions _options;
+    std::uint64_t _epoch;
+    Clock::time_point _epochTime;
+    std::mutex _mutex;
+    std::vector<std::unique_ptr<Buffer>> _buffers;
+};
+
+#endif  // TINY_HTTP_SERVER_TRACE_H
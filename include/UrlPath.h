@@ -0,0 +1,139 @@
+#ifndef TINY_HTTP_SERVER_URL_PATH_H
+#define TINY_HTTP_SERVER_URL_PATH_H
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "LruList.h"
+
+namespace UrlPath {
+namespace detail {
+/// Hex digit values, -1 for characters that are none.
+constexpr auto kHexValues = [] {
+    std::array<std::int8_t, 256> table{};
+    table.fill(-1);
+    for (int c = '0'; c <= '9'; ++c) table[c] = static_cast<std::int8_t>(c - '0');
+    for (int c = 'a'; c <= 'f'; ++c) table[c] = static_cast<std::int8_t>(c - 'a' + 10);
+    for (int c = 'A'; c <= 'F'; ++c) table[c] = static_cast<std::int8_t>(c - 'A' + 10);
+    return table;
+}();
+
+constexpr std::uint64_t broadcast(char c) {
+    return 0x0101010101010101ull * static_cast<std::uint8_t>(c);
+}
+
+/// High bit set in every byte of 'word' that is zero, and possibly in bytes above one that is.
+constexpr std::uint64_t zeroBytes(std::uint64_t word) {
+    return (word - 0x0101010101010101ull) & ~word & 0x8080808080808080ull;
+}
+
+/// First '%' or '+' in [begin, end), or 'end'. Plain runs are skipped eight bytes at a time.
+inline const char* findEscape(const char* begin, const char* end) {
+    while (end - begin >= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, begin, sizeof(word));
+        if (zeroBytes(word ^ broadcast('%')) | zeroBytes(word ^ broadcast('+'))) break;
+        begin += 8;
+    }
+    while (begin != end && *begin != '%' && *begin != '+') ++begin;
+    return begin;
+}
+}  // namespace detail
+
+/// Percent-decode 'path', '+' decoding to a space. Fails on malformed escapes and on NUL.
+inline std::optional<std::string> decode(std::string_view path) {
+    std::string out;
+    out.reserve(path.size());
+    const char* pos = path.data();
+    const char* end = pos + path.size();
+    while (true) {
+        const char* escape = detail::findEscape(pos, end);
+        out.append(pos, escape);
+        if (escape == end) return out;
+        if (*escape == '+') {
+            out += ' ';
+            pos = escape + 1;
+            continue;
+        }
+        if (end - escape < 3) return std::nullopt;
+        int high = detail::kHexValues[static_cast<std::uint8_t>(escape[1])];
+        int low = detail::kHexValues[static_cast<std::uint8_t>(escape[2])];
+        if (high < 0 || low < 0 || (high | low) == 0) return std::nullopt;
+        out += static_cast<char>(high << 4 | low);
+        pos = escape + 3;
+    }
+}
+
+/// Resolve "." and ".." segments and repeated slashes of the absolute, decoded 'path'.
+/// Fails when the path is relative or ".." leads above the root, so the result always stays
+/// within the directory it is appended to. A trailing slash is kept.
+inline std::optional<std::string> canonicalize(std::string_view path) {
+    if (path.empty() || path[0] != '/') return std::nullopt;
+    std::string out;
+    out.reserve(path.size());
+    bool directory = false;
+    std::size_t pos = 0;
+    while (pos < path.size()) {
+        auto slash = path.find('/', pos);
+        if (slash == std::string_view::npos) slash = path.size();
+        auto segment = path.substr(pos, slash - pos);
+        pos = slash + 1;
+        directory = true;
+        if (segment.empty() || segment == ".") continue;
+        if (segment == "..") {
+            if (out.empty()) return std::nullopt;
+            out.resize(out.rfind('/'));
+            continue;
+        }
+        out.append("/").append(segment);
+        directory = slash != path.size();
+    }
+    if (out.empty() || directory) out += '/';
+    return out;
+}
+
+/// The canonical file path of the request target 'uri': query and fragment are dropped, the
+/// rest is decoded and canonicalized.
+inline std::optional<std::string> resolve(std::string_view uri) {
+    auto decoded = decode(uri.substr(0, uri.find_first_of("?#")));
+    if (!decoded) return std::nullopt;
+    return canonicalize(*decoded);
+}
+
+/// Per-thread LRU of resolved request targets, so that hot URLs are decoded once. Rejected
+/// targets are not cached.
+class Cache {
+public:
+    static constexpr std::size_t kCapacity = 256;
+
+    static Cache& local() {
+        thread_local Cache cache;
+        return cache;
+    }
+
+    /// resolve(uri). The view stays valid until the next call on this thread.
+    std::optional<std::string_view> resolve(std::string_view uri) {
+        if (const Entry* entry = _entries.touch(uri)) return entry->path;
+        auto path = UrlPath::resolve(uri);
+        if (!path) return std::nullopt;
+        if (_entries.size() == kCapacity) _entries.popBack();
+        return _entries.pushFront({std::string(uri), std::move(*path)}).path;
+    }
+
+private:
+    struct Entry {
+        std::string uri;
+        std::string path;
+    };
+
+    Cache() { _entries.reserve(kCapacity); }
+
+    LruList<Entry, &Entry::uri> _entries;
+};
+}  // namespace UrlPath
+
+#endif  // TINY_HTTP_SERVER_URL_PATH_H
@@ -0,0 +1,461 @@
+#ifndef TINY_HTTP_SERVER_WEB_SOCKET_H
+#define TINY_HTTP_SERVER_WEB_SOCKET_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <array>
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include <openssl/sha.h>
+
+#include "AsioCoroutineUtil.h"
+#include "Lazy.h"
+#include "Metrics.h"
+#include "Tls.h"
+
+#define asio boost::asio
+#define tcp asio::ip::tcp
+
+/// Client-to-server payload unmasking (RFC 6455 section 5.3).
+/// Every variant XORs 'data' in place with the 4-byte masking key, 'offset' being the position of
+/// data[0] within the frame payload so that a payload can be unmasked in pieces.
+namespace WebSocketMask {
+
+/// The key rotated to 'offset' and repeated to the widest vector size.
+struct Pattern {
+    alignas(32) std::array<std::uint8_t, 32> bytes;
+};
+
+inline Pattern makePattern(const std::array<std::uint8_t, 4>& key, std::size_t offset) {
+    Pattern pattern;
+    for (std::size_t i = 0; i < pattern.bytes.size(); ++i) {
+        pattern.bytes[i] = key[(offset + i) % 4];
+    }
+    return pattern;
+}
+
+/// Unmask data[i, len) a word at a time, 'i' must be a multiple of 4.
+inline void unmaskTail(char* data, std::size_t i, std::size_t len, const Pattern& pattern) {
+    std::uint64_t word;
+    std::memcpy(&word, pattern.bytes.data(), sizeof(word));
+    for (; i + 8 <= len; i += 8) {
+        std::uint64_t value;
+        std::memcpy(&value, data + i, sizeof(value));
+        value ^= word;
+        std::memcpy(data + i, &value, sizeof(value));
+    }
+    for (; i < len; ++i) data[i] = static_cast<char>(data[i] ^ pattern.bytes[i % 4]);
+}
+
+inline void unmaskScalar(char* data, std::size_t len, const std::array<std::uint8_t, 4>& key,
+                         std::size_t offset) {
+    unmaskTail(data, 0, len, makePattern(key, offset));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) inline void unmaskSse2(char* data, std::size_t len,
+                                                       const std::array<std::uint8_t, 4>& key,
+                                                       std::size_t offset) {
+    auto pattern = makePattern(key, offset);
+    __m128i mask = _mm_load_si128(reinterpret_cast<const __m128i*>(pattern.bytes.data()));
+    std::size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        auto* p = reinterpret_cast<__m128i*>(data + i);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), mask));
+    }
+    unmaskTail(data, i, len, pattern);
+}
+
+__attribute__((target("avx2"))) inline void unmaskAvx2(char* data, std::size_t len,
+                                                       const std::array<std::uint8_t, 4>& key,
+                                                       std::size_t offset) {
+    auto pattern = makePattern(key, offset);
+    __m256i mask = _mm256_load_si256(reinterpret_cast<const __m256i*>(pattern.bytes.data()));
+    std::size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        auto* p = reinterpret_cast<__m256i*>(data + i);
+        _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), mask));
+        _mm256_storeu_si256(p + 1, _mm256_xor_si256(_mm256_loadu_si256(p + 1), mask));
+    }
+    for (; i + 32 <= len; i += 32) {
+        auto* p = reinterpret_cast<__m256i*>(data + i);
+        _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), mask));
+    }
+    unmaskTail(data, i, len, pattern);
+}
+#endif
+
+using UnmaskFunction = void (*)(char*, std::size_t, const std::array<std::uint8_t, 4>&,
+                                std::size_t);
+
+/// The widest variant the CPU supports, picked once at runtime so that the build needs no
+/// -mavx2.
+inline UnmaskFunction bestUnmask() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) return unmaskAvx2;
+    if (__builtin_cpu_supports("sse2")) return unmaskSse2;
+#endif
+    return unmaskScalar;
+}
+
+inline void unmask(char* data, std::size_t len, const std::array<std::uint8_t, 4>& key,
+                   std::size_t offset) {
+    static const UnmaskFunction function = bestUnmask();
+    function(data, len, key, offset);
+}
+
+}  // namespace WebSocketMask
+
+enum class WebSocketOpcode : std::uint8_t {
+    continuation = 0x0,
+    text = 0x1,
+    binary = 0x2,
+    close = 0x8,
+    ping = 0x9,
+    pong = 0xa
+};
+
+struct WebSocketMessage {
+    WebSocketOpcode opcode = WebSocketOpcode::text;
+    std::string payload;
+};
+
+/// Server side of an upgraded WebSocket connection, the socket stays owned by Connection.
+/// read() and write() may be used concurrently by two coroutines, frames are never interleaved.
+class WebSocket {
+    using Socket = ClientStream;
+
+public:
+    WebSocket(Socket& socket, std::size_t maxMessageSize, std::string received)
+        : _socket(socket),
+          _maxMessageSize(maxMessageSize),
+          _buffer(std::move(received)),
+          _end(_buffer.size()),
+          _writers(static_cast<asio::io_context&>(socket.get_executor().context())) {}
+
+    /// Response completing the opening handshake for the client's Sec-WebSocket-Key.
+    static std::string handshakeResponse(std::string_view key) {
+        constexpr std::string_view kGuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        std::string input(key);
+        input.append(kGuid);
+        std::array<std::uint8_t, SHA_DIGEST_LENGTH> bytes;
+        SHA1(reinterpret_cast<const unsigned char*>(input.data()), input.size(), bytes.data());
+
+        std::string response =
+            "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: ";
+        constexpr std::string_view kAlphabet =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        for (std::size_t i = 0; i < bytes.size(); i += 3) {
+            std::uint32_t group = bytes[i] << 16;
+            if (i + 1 < bytes.size()) group |= bytes[i + 1] << 8;
+            if (i + 2 < bytes.size()) group |= bytes[i + 2];
+            response += kAlphabet[(group >> 18) & 0x3f];
+            response += kAlphabet[(group >> 12) & 0x3f];
+            response += i + 1 < bytes.size() ? kAlphabet[(group >> 6) & 0x3f] : '=';
+            response += i + 2 < bytes.size() ? kAlphabet[group & 0x3f] : '=';
+        }
+        response += "\r\n\r\n";
+        return response;
+    }
+
+    /// Next text or binary message. Fragments are reassembled and pings answered on the way.
+    /// Completes with eof once the peer closed the connection.
+    Lazy<std::pair<std::error_code, WebSocketMessage>> read() {
+        WebSocketMessage message;
+        bool fragmented = false;
+        while (true) {
+            if (_closeReceived) co_return std::make_pair(kEof, WebSocketMessage{});
+
+            FrameHeader header;
+            while (!parseHeader(header)) {
+                if (auto err = co_await fill(); err) {
+                    co_return std::make_pair(err, WebSocketMessage{});
+                }
+            }
+            bool control = static_cast<std::uint8_t>(header.opcode) & 0x8;
+            std::uint16_t violation = 0;
+            if (header.reserved || !header.masked) {
+                violation = kProtocolError;
+            } else if (control) {
+                if (!header.fin || header.length > 125) violation = kProtocolError;
+            } else if ((header.opcode == WebSocketOpcode::continuation) != fragmented) {
+                violation = kProtocolError;
+            } else if (message.payload.size() + header.length > _maxMessageSize) {
+                violation = kMessageTooBig;
+            }
+            if (header.opcode > WebSocketOpcode::binary && !control) violation = kProtocolError;
+            if (header.opcode > WebSocketOpcode::pong) violation = kProtocolError;
+            if (violation) {
+                co_await close(violation);
+                _closeReceived = true;
+                auto err = std::make_error_code(violation == kMessageTooBig
+                                                    ? std::errc::message_size
+                                                    : std::errc::protocol_error);
+                co_return std::make_pair(err, WebSocketMessage{});
+            }
+
+            std::string controlPayload;
+            std::string& target = control ? controlPayload : message.payload;
+            if (auto err = co_await readPayload(header, target); err) {
+                co_return std::make_pair(err, WebSocketMessage{});
+            }
+
+            switch (header.opcode) {
+                case WebSocketOpcode::ping:
+                    if (auto err = co_await sendFrame(WebSocketOpcode::pong, controlPayload); err) {
+                        co_return std::make_pair(err, WebSocketMessage{});
+                    }
+                    continue;
+                case WebSocketOpcode::pong:
+                    continue;
+                case WebSocketOpcode::close: {
+                    _closeReceived = true;
+                    // Echo a valid status code, as the close handshake asks for.
+                    std::uint16_t code = kNormalClosure;
+                    if (controlPayload.size() == 1) {
+                        code = kProtocolError;
+                    } else if (controlPayload.size() >= 2) {
+                        code = static_cast<std::uint16_t>(
+                            static_cast<std::uint8_t>(controlPayload[0]) << 8 |
+                            static_cast<std::uint8_t>(controlPayload[1]));
+                        if (!validCloseCode(code)) {
+                            code = kProtocolError;
+                        } else if (!validUtf8(std::string_view(controlPayload).substr(2))) {
+                            code = kInvalidPayload;
+                        }
+                    }
+                    co_await close(code);
+                    co_return std::make_pair(kEof, WebSocketMessage{});
+                }
+                default:
+                    break;
+            }
+
+            if (!fragmented) message.opcode = header.opcode;
+            fragmented = !header.fin;
+            if (!fragmented) {
+                if (message.opcode == WebSocketOpcode::text && !validUtf8(message.payload)) {
+                    co_await close(kInvalidPayload);
+                    _closeReceived = true;
+                    co_return std::make_pair(std::make_error_code(std::errc::illegal_byte_sequence),
+                                             WebSocketMessage{});
+                }
+                Metrics::local().webSocketMessagesIn.add();
+                co_return std::make_pair(std::error_code{}, std::move(message));
+            }
+        }
+    }
+
+    /// Send one unfragmented message. 'payload' must stay valid until completion.
+    Lazy<std::error_code> write(std::string_view payload,
+                                WebSocketOpcode opcode = WebSocketOpcode::text) {
+        if (_closeSent) co_return std::make_error_code(std::errc::not_connected);
+        auto err = co_await sendFrame(opcode, payload);
+        if (!err) Metrics::local().webSocketMessagesOut.add();
+        co_return err;
+    }
+
+    /// Start the close handshake unless it was already started, reads then complete with eof.
+    Lazy<std::error_code> close(std::uint16_t code = kNormalClosure) {
+        if (_closeSent) co_return std::error_code{};
+        std::array<char, 2> payload{static_cast<char>(code >> 8), static_cast<char>(code)};
+        auto err = co_await sendFrame(WebSocketOpcode::close, {payload.data(), payload.size()});
+        _closeSent = true;
+        co_return err;
+    }
+
+public:
+    static constexpr std::uint16_t kNormalClosure = 1000;
+    static constexpr std::uint16_t kGoingAway = 1001;
+    static constexpr std::uint16_t kProtocolError = 1002;
+    static constexpr std::uint16_t kInvalidPayload = 1007;
+    static constexpr std::uint16_t kMessageTooBig = 1009;
+
+private:
+    struct FrameHeader {
+        bool fin;
+        bool reserved;
+        bool masked;
+        WebSocketOpcode opcode;
+        std::uint64_t length;
+        std::array<std::uint8_t, 4> key;
+    };
+
+    /// Whether a peer may send 'code' in a close frame: one defined for use on the wire, or one
+    /// of the ranges left to libraries and applications.
+    static bool validCloseCode(std::uint16_t code) {
+        return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) ||
+               (code >= 3000 && code <= 4999);
+    }
+
+    /// Whether 'text' is well-formed UTF-8: no overlong forms, surrogates or code points beyond
+    /// U+10FFFF.
+    static bool validUtf8(std::string_view text) {
+        auto* p = reinterpret_cast<const std::uint8_t*>(text.data());
+        std::size_t len = text.size();
+        std::size_t i = 0;
+        while (i < len) {
+            // Runs of ASCII are checked 8 bytes at a time.
+            while (i + 8 <= len) {
+                std::uint64_t word;
+                std::memcpy(&word, p + i, sizeof(word));
+                if (word & 0x8080808080808080ULL) break;
+                i += 8;
+            }
+            if (i == len) break;
+            std::uint8_t c = p[i];
+            if (c < 0x80) {
+                ++i;
+                continue;
+            }
+            std::size_t size;
+            std::uint8_t min = 0x80;
+            std::uint8_t max = 0xbf;
+            if (c >= 0xc2 && c <= 0xdf) {
+                size = 2;
+            } else if (c >= 0xe0 && c <= 0xef) {
+                size = 3;
+                if (c == 0xe0) min = 0xa0;
+                if (c == 0xed) max = 0x9f;
+            } else if (c >= 0xf0 && c <= 0xf4) {
+                size = 4;
+                if (c == 0xf0) min = 0x90;
+                if (c == 0xf4) max = 0x8f;
+            } else {
+                return false;
+            }
+            if (len - i < size || p[i + 1] < min || p[i + 1] > max) return false;
+            for (std::size_t j = 2; j < size; ++j) {
+                if ((p[i + j] & 0xc0) != 0x80) return false;
+            }
+            i += size;
+        }
+        return true;
+    }
+
+    /// Consume a frame header from the buffer, false if it is not complete yet.
+    bool parseHeader(FrameHeader& header) {
+        std::size_t available = _end - _pos;
+        if (available < 2) return false;
+        auto* p = reinterpret_cast<const std::uint8_t*>(_buffer.data() + _pos);
+        std::size_t size = 2;
+        header.fin = p[0] & 0x80;
+        header.reserved = p[0] & 0x70;
+        header.opcode = static_cast<WebSocketOpcode>(p[0] & 0x0f);
+        header.masked = p[1] & 0x80;
+        header.length = p[1] & 0x7f;
+        if (header.length == 126) {
+            size += 2;
+        } else if (header.length == 127) {
+            size += 8;
+        }
+        if (header.masked) size += 4;
+        if (available < size) return false;
+
+        if (header.length >= 126) {
+            std::size_t bytes = header.length == 126 ? 2 : 8;
+            header.length = 0;
+            for (std::size_t i = 0; i < bytes; ++i) header.length = header.length << 8 | p[2 + i];
+        }
+        if (header.masked) std::memcpy(header.key.data(), p + size - 4, 4);
+        _pos += size;
+        return true;
+    }
+
+    /// Append the unmasked payload of the current frame to 'target'.
+    Lazy<std::error_code> readPayload(const FrameHeader& header, std::string& target) {
+        std::uint64_t done = 0;
+        while (done < header.length) {
+            if (_pos == _end) {
+                if (auto err = co_await fill(); err) co_return err;
+            }
+            auto length = static_cast<std::size_t>(
+                std::min<std::uint64_t>(header.length - done, _end - _pos));
+            char* data = _buffer.data() + _pos;
+            WebSocketMask::unmask(data, length, header.key, done);
+            target.append(data, length);
+            _pos += length;
+            done += length;
+        }
+        co_return std::error_code{};
+    }
+
+    /// Read more bytes into the buffer, keeping the unconsumed ones.
+    Lazy<std::error_code> fill() {
+        if (_pos > 0) {
+            std::memmove(_buffer.data(), _buffer.data() + _pos, _end - _pos);
+            _end -= _pos;
+            _pos = 0;
+        }
+        if (_buffer.size() - _end < kReadSize) _buffer.resize(_end + kReadSize);
+        auto [err, bytesTransferred] = co_await asyncReadSome(
+            _socket, asio::buffer(_buffer.data() + _end, _buffer.size() - _end));
+        if (err) co_return err;
+        Metrics::local().bytesIn.add(bytesTransferred);
+        _end += bytesTransferred;
+        co_return std::error_code{};
+    }
+
+    Lazy<std::error_code> sendFrame(WebSocketOpcode opcode, std::string_view payload) {
+        while (_writing) co_await _writers.wait();
+        _writing = true;
+
+        std::array<std::uint8_t, 10> header;
+        std::size_t size = 2;
+        header[0] = 0x80 | static_cast<std::uint8_t>(opcode);
+        if (payload.size() < 126) {
+            header[1] = static_cast<std::uint8_t>(payload.size());
+        } else if (payload.size() <= 0xffff) {
+            header[1] = 126;
+            header[2] = static_cast<std::uint8_t>(payload.size() >> 8);
+            header[3] = static_cast<std::uint8_t>(payload.size());
+            size = 4;
+        } else {
+            header[1] = 127;
+            for (std::size_t i = 0; i < 8; ++i) {
+                header[2 + i] = static_cast<std::uint8_t>(payload.size() >> (56 - 8 * i));
+            }
+            size = 10;
+        }
+        std::array<asio::const_buffer, 2> buffers{asio::buffer(header.data(), size),
+                                                  asio::buffer(payload)};
+        auto [err, bytesWritten] = co_await asyncWrite(_socket, std::move(buffers));
+        Metrics::local().bytesOut.add(bytesWritten);
+
+        _writing = false;
+        _writers.notifyOne();
+        co_return err;
+    }
+
+private:
+    static constexpr std::size_t kReadSize = 8 << 10;
+    static inline const std::error_code kEof{boost::system::error_code(asio::error::eof)};
+
+    Socket& _socket;
+    std::size_t _maxMessageSize;
+    std::string _buffer;
+    std::size_t _pos = 0;
+    std::size_t _end;
+    bool _writing = false;
+    WaitQueue _writers;
+    bool _closeSent = false;
+    bool _closeReceived = false;
+};
+
+/// Serves one WebSocket connection; the close handshake is completed after it returns.
+using WebSocketHandler = std::function<Lazy<void>(WebSocket&)>;
+
+#undef tcp
+#undef asio
+
+#endif  // TINY_HTTP_SERVER_WEB_SOCKET_H
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <string>
 #include <thread>
+#include <utility>
 
 #include "AsioCoroutineUtil.h"
 #include "Lazy.h"
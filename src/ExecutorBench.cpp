@@ -0,0 +1,69 @@
+// Measures a hop onto an executor, i.e. a co_await of a RescheduleLazy, made by a coroutine that
+// already runs on that executor: resumed inline by AsioExecutor::dispatch, against posted
+// through the queue of the io_context as every hop used to be. Hops are nested into chains,
+// those deeper than AsioExecutor::kMaxDispatchDepth are posted again past that depth.
+//
+// Usage: TinyHttpExecutorBench [hops per scenario]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "AsioCoroutineUtil.h"
+#include "Lazy.h"
+#include "SyncAwait.h"
+
+using namespace boost;
+
+namespace {
+
+/// Every hop goes through the queue.
+class PostingExecutor : public AsioExecutor {
+public:
+    using AsioExecutor::AsioExecutor;
+
+    bool dispatch(Func func) override { return schedule(std::move(func)); }
+};
+
+/// 'depth' hops, each one awaited by the previous.
+Lazy<void> chain(Executor* executor, unsigned depth) {
+    if (depth > 1) co_await chain(executor, depth - 1).via(executor);
+}
+
+Lazy<void> run(Executor* executor, std::uint64_t chains, unsigned depth) {
+    for (std::uint64_t i = 0; i < chains; ++i) co_await chain(executor, depth).via(executor);
+}
+
+void bench(const char* name, Executor& executor, std::uint64_t hops, unsigned depth) {
+    auto chains = hops / depth;
+    auto start = std::chrono::steady_clock::now();
+    syncAwait(run(&executor, chains, depth).via(&executor));
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    std::printf("%-7s chains of %3u: %7.1f ns/hop\n", name, depth,
+                elapsed.count() / static_cast<double>(chains * depth));
+    std::fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    std::uint64_t hops = argc > 1 ? std::stoull(argv[1]) : 2000000;
+
+    asio::io_context ioContext;
+    asio::io_context::work work(ioContext);
+    std::thread thread([&ioContext] { ioContext.run(); });
+    AsioExecutor inlineExecutor(ioContext);
+    PostingExecutor postingExecutor(ioContext);
+
+    for (unsigned depth : {1u, AsioExecutor::kMaxDispatchDepth, 64u}) {
+        bench("posted", postingExecutor, hops, depth);
+        bench("inline", inlineExecutor, hops, depth);
+    }
+
+    ioContext.stop();
+    thread.join();
+    return 0;
+}
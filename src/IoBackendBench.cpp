@@ -0,0 +1,205 @@
+// Compares the epoll and io_uring backends of the socket awaiters.
+// For each backend a server with keep-alive connections is driven by a forked client process
+// for a few seconds; throughput and the server's syscalls per request are reported.
+//
+// Usage: TinyHttpIoBench [connections] [seconds] [io threads]
+
+#include <dlfcn.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "AsioCoroutineUtil.h"
+#include "Connection.h"
+#include "Lazy.h"
+#include "SyncAwait.h"
+
+using namespace boost;
+using asio::ip::tcp;
+
+namespace {
+
+std::atomic<std::uint64_t> gSyscalls{0};
+
+}  // namespace
+
+// Every libc entry point asio uses on the I/O path is interposed to count syscalls made by the
+// server process. io_uring_enter is issued through syscall(2) and counted by IoUringService.
+#define COUNTED(ret, name, params, args)                                                    \
+    extern "C" ret name params {                                                           \
+        static auto real = reinterpret_cast<ret(*) params>(dlsym(RTLD_NEXT, #name));       \
+        gSyscalls.fetch_add(1, std::memory_order_relaxed);                                 \
+        return real args;                                                                  \
+    }
+
+COUNTED(ssize_t, read, (int fd, void* buf, size_t n), (fd, buf, n))
+COUNTED(ssize_t, write, (int fd, const void* buf, size_t n), (fd, buf, n))
+COUNTED(ssize_t, readv, (int fd, const iovec* iov, int n), (fd, iov, n))
+COUNTED(ssize_t, writev, (int fd, const iovec* iov, int n), (fd, iov, n))
+COUNTED(ssize_t, recvmsg, (int fd, msghdr* msg, int flags), (fd, msg, flags))
+COUNTED(ssize_t, sendmsg, (int fd, const msghdr* msg, int flags), (fd, msg, flags))
+COUNTED(int, accept, (int fd, sockaddr* addr, socklen_t* len), (fd, addr, len))
+COUNTED(int, accept4, (int fd, sockaddr* addr, socklen_t* len, int flags), (fd, addr, len, flags))
+COUNTED(int, epoll_wait, (int fd, epoll_event* events, int max, int timeout),
+        (fd, events, max, timeout))
+COUNTED(int, epoll_ctl, (int fd, int op, int target, epoll_event* event), (fd, op, target, event))
+
+#undef COUNTED
+
+namespace {
+
+constexpr std::string_view kRequest = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+
+/// Blocking keep-alive client loop, returns the number of completed requests.
+std::uint64_t runClient(unsigned short port, std::chrono::steady_clock::time_point deadline) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) return 0;
+
+    std::uint64_t requests = 0;
+    std::string response;
+    char buf[4096];
+    while (std::chrono::steady_clock::now() < deadline) {
+        if (::send(fd, kRequest.data(), kRequest.size(), MSG_NOSIGNAL) < 0) break;
+        response.clear();
+        std::size_t expected = std::string::npos;
+        while (expected == std::string::npos || response.size() < expected) {
+            auto n = ::recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) return requests;
+            response.append(buf, static_cast<std::size_t>(n));
+            auto headEnd = response.find("\r\n\r\n");
+            if (expected == std::string::npos && headEnd != std::string::npos) {
+                auto pos = response.find("Content-Length: ");
+                expected = headEnd + 4 + std::stoul(response.substr(pos + 16));
+            }
+        }
+        ++requests;
+    }
+    ::close(fd);
+    return requests;
+}
+
+Lazy<void> serve(tcp::socket socket, const ServerOptions& options) {
+    Connection con(std::move(socket), options);
+    co_await con.start();
+}
+
+Lazy<void> acceptLoop(tcp::acceptor& acceptor, std::vector<asio::io_context*>& contexts,
+                      std::vector<std::unique_ptr<AsioExecutor>>& executors,
+                      const ServerOptions& options) {
+    for (std::size_t next = 0;; ++next) {
+        std::size_t i = next % contexts.size();
+        tcp::socket socket(*contexts[i]);
+        if (auto err = co_await asyncAccept(acceptor, socket); err) co_return;
+        // Connections run on the io_context of their socket.
+        serve(std::move(socket), options).via(executors[i].get()).detach();
+    }
+}
+
+/// Run one benchmark round in the current process with the backend picked from the environment.
+void runBackend(std::size_t connections, int seconds, std::size_t threads) {
+    std::vector<std::unique_ptr<asio::io_context>> owned;
+    std::vector<asio::io_context*> contexts;
+    for (std::size_t i = 0; i < threads; ++i) {
+        owned.push_back(std::make_unique<asio::io_context>());
+        contexts.push_back(owned.back().get());
+    }
+    tcp::acceptor acceptor(*contexts[0], tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    auto port = acceptor.local_endpoint().port();
+
+    int pipeFds[2];
+    if (::pipe(pipeFds) != 0) throw std::system_error(errno, std::generic_category());
+    pid_t client = ::fork();
+    if (client == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+        std::atomic<std::uint64_t> total{0};
+        std::vector<std::thread> workers;
+        for (std::size_t i = 0; i < connections; ++i) {
+            workers.emplace_back([&] { total += runClient(port, deadline); });
+        }
+        for (auto& t : workers) t.join();
+        std::uint64_t value = total;
+        [[maybe_unused]] auto n = ::write(pipeFds[1], &value, sizeof(value));
+        ::_exit(0);
+    }
+
+    ServerOptions options;
+    std::vector<std::unique_ptr<AsioExecutor>> executors;
+    std::vector<asio::io_context::work> works;
+    std::vector<std::thread> ioThreads;
+    for (auto* ctx : contexts) {
+        executors.push_back(std::make_unique<AsioExecutor>(*ctx));
+        works.emplace_back(*ctx);
+        ioThreads.emplace_back([ctx] { ctx->run(); });
+    }
+    acceptLoop(acceptor, contexts, executors, options).via(executors[0].get()).detach();
+
+    auto syscallsBefore = gSyscalls.load();
+    std::uint64_t requests = 0;
+    [[maybe_unused]] auto n = ::read(pipeFds[0], &requests, sizeof(requests));
+    auto syscalls = gSyscalls.load() - syscallsBefore;
+    ::waitpid(client, nullptr, 0);
+
+    for (auto* ctx : contexts) ctx->stop();
+    for (auto& t : ioThreads) t.join();
+
+    std::string backend = "epoll";
+    std::uint64_t enters = 0;
+#ifdef TINY_HTTP_SERVER_IO_URING
+    for (auto* ctx : contexts) {
+        auto& uring = asio::use_service<IoUringService>(*ctx);
+        if (uring.available()) backend = "io_uring";
+        enters += uring.enterCount();
+    }
+#endif
+    auto perRequest = [requests](std::uint64_t count) {
+        return requests ? static_cast<double>(count) / static_cast<double>(requests) : 0.0;
+    };
+    std::printf("%-9s requests/s: %10.0f  syscalls/request: %5.2f  (io_uring_enter: %5.2f)\n",
+                backend.c_str(), static_cast<double>(requests) / seconds,
+                perRequest(syscalls + enters), perRequest(enters));
+    std::fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    std::size_t connections = argc > 1 ? std::stoul(argv[1]) : 32;
+    int seconds = argc > 2 ? std::stoi(argv[2]) : 3;
+    std::size_t threads = argc > 3 ? std::stoul(argv[3]) : 2;
+
+    // Each backend runs in its own process so that the io_context services start from scratch.
+    for (const char* backend : {"epoll", "io_uring"}) {
+        pid_t pid = ::fork();
+        if (pid == 0) {
+            ::setenv("TINY_HTTP_SERVER_IO_BACKEND", backend, 1);
+            try {
+                runBackend(connections, seconds, threads);
+            } catch (std::exception& e) {
+                std::cerr << "Exception: " << e.what() << "\n";
+            }
+            ::_exit(0);
+        }
+        ::waitpid(pid, nullptr, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,177 @@
+// Measures a socket operation awaited in place, as asyncWrite and asyncReadSome give them now,
+// against awaited through a Lazy whose only body awaits it, as they were given before: time and
+// heap allocations per operation. Over loopback TCP, one byte writes and reads through
+// ClientStream like the connections of the server, the system calls dominate the time. Reads of
+// a socket that completes them through the queue of the io_context without any system call
+// leave the cost of awaiting alone.
+//
+// Usage: TinyHttpIoOpBench [operations per scenario and round]
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "AsioCoroutineUtil.h"
+#include "Lazy.h"
+#include "SyncAwait.h"
+#include "Tls.h"
+
+using namespace boost;
+using asio::ip::tcp;
+
+namespace {
+
+std::atomic<std::uint64_t> allocations{0};
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size == 0 ? 1 : size)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+
+/// Completes every read right away, through the queue of the io_context like a socket would.
+class PostingSocket {
+public:
+    explicit PostingSocket(asio::io_context& ioContext) : _ioContext(ioContext) {}
+
+    template <typename MutableBuffer, typename Handler>
+    void async_read_some(const MutableBuffer& buffer, Handler handler) {
+        asio::post(_ioContext, [handler = std::move(handler), n = buffer.size()]() mutable {
+            handler(boost::system::error_code{}, n);
+        });
+    }
+
+    void cancel(boost::system::error_code&) {}
+
+private:
+    asio::io_context& _ioContext;
+};
+
+/// The frames every operation used to come with.
+template <typename Stream, typename AsioBuffer>
+Lazy<std::pair<std::error_code, std::size_t>> wrappedReadSome(Stream& stream, AsioBuffer buffer) {
+    co_return co_await asyncReadSome(stream, std::move(buffer));
+}
+
+template <typename AsioBuffer>
+Lazy<std::pair<std::error_code, std::size_t>> wrappedWrite(ClientStream& stream,
+                                                           AsioBuffer buffer) {
+    co_return co_await asyncWrite(stream, std::move(buffer));
+}
+
+void check(std::pair<std::error_code, std::size_t> result) {
+    if (result.first || result.second != 1) {
+        std::fprintf(stderr, "I/O failed: %s\n", result.first.message().c_str());
+        std::exit(1);
+    }
+}
+
+/// A write on one end and a read on the other, two operations per round trip.
+template <bool wrapped>
+Lazy<void> pingPong(ClientStream& client, ClientStream& server, std::uint64_t roundTrips) {
+    char out = 'x';
+    char in = 0;
+    for (std::uint64_t i = 0; i < roundTrips; ++i) {
+        if constexpr (wrapped) {
+            check(co_await wrappedWrite(client, asio::buffer(&out, 1)));
+            check(co_await wrappedReadSome(server, asio::buffer(&in, 1)));
+        } else {
+            check(co_await asyncWrite(client, asio::buffer(&out, 1)));
+            check(co_await asyncReadSome(server, asio::buffer(&in, 1)));
+        }
+    }
+}
+
+template <bool wrapped>
+Lazy<void> postedReads(PostingSocket& socket, std::uint64_t reads) {
+    char in = 0;
+    for (std::uint64_t i = 0; i < reads; ++i) {
+        if constexpr (wrapped) {
+            check(co_await wrappedReadSome(socket, asio::buffer(&in, 1)));
+        } else {
+            check(co_await asyncReadSome(socket, asio::buffer(&in, 1)));
+        }
+    }
+}
+
+struct Result {
+    double nanos = 1e18;
+    double allocations = 0;
+};
+
+/// Keeps the best of several rounds of 'ops' operations, the system calls vary a lot.
+template <typename Run>
+void measure(Result& best, Executor& executor, std::uint64_t ops, Run run) {
+    auto allocated = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    syncAwait(run().via(&executor));
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    auto count = static_cast<double>(ops);
+    if (elapsed.count() / count < best.nanos) {
+        best = {elapsed.count() / count,
+                static_cast<double>(allocations.load() - allocated) / count};
+    }
+}
+
+void print(const char* name, const Result& result) {
+    std::printf("%-17s %7.1f ns/op %6.2f allocations/op\n", name, result.nanos,
+                result.allocations);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    std::uint64_t ops = argc > 1 ? std::stoull(argv[1]) : 400000;
+
+    asio::io_context ioContext;
+    tcp::acceptor acceptor(ioContext, tcp::endpoint(asio::ip::make_address("127.0.0.1"), 0));
+    tcp::socket clientSocket(ioContext);
+    tcp::socket serverSocket(ioContext);
+    clientSocket.connect(acceptor.local_endpoint());
+    acceptor.accept(serverSocket);
+    clientSocket.set_option(tcp::no_delay(true));
+    ClientStream client(clientSocket);
+    ClientStream server(serverSocket);
+    PostingSocket posting(ioContext);
+
+    asio::io_context::work work(ioContext);
+    std::thread thread([&ioContext] { ioContext.run(); });
+    AsioExecutor executor(ioContext);
+
+    // Warms up the recycled handler memory of asio, which would count as allocations otherwise.
+    Result warmUp;
+    measure(warmUp, executor, 2000, [&] { return pingPong<false>(client, server, 1000); });
+    measure(warmUp, executor, 1000, [&] { return postedReads<false>(posting, 1000); });
+
+    Result loopbackWrapped, loopbackDirect, postedWrapped, postedDirect;
+    for (int round = 0; round < 5; ++round) {
+        measure(loopbackWrapped, executor, ops,
+                [&] { return pingPong<true>(client, server, ops / 2); });
+        measure(loopbackDirect, executor, ops,
+                [&] { return pingPong<false>(client, server, ops / 2); });
+        measure(postedWrapped, executor, ops, [&] { return postedReads<true>(posting, ops); });
+        measure(postedDirect, executor, ops, [&] { return postedReads<false>(posting, ops); });
+    }
+    print("loopback wrapped", loopbackWrapped);
+    print("loopback direct", loopbackDirect);
+    print("posted wrapped", postedWrapped);
+    print("posted direct", postedDirect);
+
+    ioContext.stop();
+    thread.join();
+    return 0;
+}
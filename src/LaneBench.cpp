@@ -0,0 +1,121 @@
+// Measures the latency of a short request on an io_context saturated by bulk streams, with the
+// chunks of the streams run straight from their completions in the queue of the io_context, as
+// they were before, against waiting on the low priority lane of PriorityLanes before every chunk,
+// as large downloads and proxied responses do now. A bulk stream completes a write through the
+// queue and then spends the CPU time of reading and writing a chunk. The request arrives as a
+// timer expiry in the queue, like a read completion, and is answered with one more completion,
+// like its write; its latency is counted from the expiry. The chunks per second the streams
+// complete show what the lanes cost the bulk work.
+//
+// Usage: TinyHttpLaneBench [microseconds of work per chunk] [seconds per scenario]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "AsioCoroutineUtil.h"
+#include "Lazy.h"
+#include "PriorityLanes.h"
+
+using namespace boost;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+/// Resumes through the queue of the io_context, like a completed socket operation.
+struct Completion {
+    asio::io_context& ioContext;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+        asio::post(ioContext, [handle] { handle.resume(); });
+    }
+    void await_resume() const noexcept {}
+};
+
+void work(std::chrono::microseconds duration) {
+    auto until = Clock::now() + duration;
+    while (Clock::now() < until) {
+    }
+}
+
+struct Scenario {
+    asio::io_context& ioContext;
+    bool lanes;
+    std::chrono::microseconds chunkWork;
+    std::atomic<bool> stop{false};
+    std::atomic<unsigned> running{0};
+    std::uint64_t chunks = 0;
+    std::vector<double> latencies;
+};
+
+Lazy<void> bulkStream(Scenario& scenario) {
+    auto& lanes = PriorityLanes::of(scenario.ioContext);
+    while (!scenario.stop) {
+        co_await Completion{scenario.ioContext};
+        if (scenario.lanes) co_await lanes.enter(Priority::low);
+        work(scenario.chunkWork);
+        ++scenario.chunks;
+    }
+    --scenario.running;
+}
+
+Lazy<void> requests(Scenario& scenario) {
+    asio::steady_timer timer(scenario.ioContext);
+    while (!scenario.stop) {
+        timer.expires_after(std::chrono::milliseconds(1));
+        co_await asyncWait(timer);
+        co_await Completion{scenario.ioContext};
+        std::chrono::duration<double, std::micro> latency = Clock::now() - timer.expiry();
+        scenario.latencies.push_back(latency.count());
+    }
+    --scenario.running;
+}
+
+void bench(bool lanes, unsigned streams, std::chrono::microseconds chunkWork, double seconds) {
+    asio::io_context ioContext;
+    asio::io_context::work keepRunning(ioContext);
+    AsioExecutor executor(ioContext);
+    Scenario scenario{ioContext, lanes, chunkWork, {false}, {0}, 0, {}};
+    scenario.running = streams + 1;
+    for (unsigned i = 0; i < streams; ++i) bulkStream(scenario).via(&executor).detach();
+    requests(scenario).via(&executor).detach();
+
+    std::thread thread([&ioContext] { ioContext.run(); });
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    scenario.stop = true;
+    while (scenario.running > 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    ioContext.stop();
+    thread.join();
+
+    auto& latencies = scenario.latencies;
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        auto i = static_cast<std::size_t>(p * static_cast<double>(latencies.size() - 1));
+        return latencies[i];
+    };
+    std::printf("%-5s %3u streams: request p50 %8.1f us  p99 %8.1f us  %9.0f chunks/s\n",
+                lanes ? "lanes" : "fifo", streams, percentile(0.5), percentile(0.99),
+                static_cast<double>(scenario.chunks) / seconds);
+    std::fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    std::chrono::microseconds chunkWork(argc > 1 ? std::stoul(argv[1]) : 20);
+    double seconds = argc > 2 ? std::stod(argv[2]) : 2;
+
+    for (unsigned streams : {1u, 8u, 64u}) {
+        bench(false, streams, chunkWork, seconds);
+        bench(true, streams, chunkWork, seconds);
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+// Measures the per-request cost of the rate limiter.
+// Every scenario sends requests from a number of distinct client addresses in a scattered order,
+// from one client whose bucket stays hot in cache up to millions that exceed the table and make
+// buckets get taken over. Worker threads share one limiter like io threads do.
+//
+// Usage: TinyHttpRateLimitBench [requests per thread] [threads] [capacity]
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Metrics.h"
+#include "RateLimit.h"
+
+namespace {
+
+/// Spread consecutive client numbers over the whole IPv4 space.
+std::uint32_t clientAddress(std::uint64_t client) {
+    client = (client ^ (client >> 33)) * 0xff51afd7ed558ccdull;
+    return static_cast<std::uint32_t>(client ^ (client >> 29));
+}
+
+void bench(std::uint64_t clients, std::uint64_t requests, unsigned threads) {
+    std::atomic<std::uint64_t> limited{0}, evictions{0};
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            auto& limiter = RateLimiter::instance();
+            auto& metrics = Metrics::local();
+            auto evictionsBefore = metrics.rateLimitEvictions.load();
+            std::uint64_t denied = 0;
+            // A large odd stride scatters consecutive requests over the clients.
+            std::uint64_t client = t * 7919;
+            for (std::uint64_t i = 0; i < requests; ++i) {
+                client = (client + 0x9e3779b97f4a7c15ull) % clients;
+                auto address = boost::asio::ip::make_address_v4(clientAddress(client));
+                if (limiter.acquire(address, "/") != std::chrono::steady_clock::duration::zero()) {
+                    ++denied;
+                }
+            }
+            limited += denied;
+            evictions += metrics.rateLimitEvictions.load() - evictionsBefore;
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    auto total = static_cast<double>(requests) * threads;
+    std::printf("%9llu clients x %u threads: %7.1f ns/request, %5.1f%% limited, %llu evictions\n",
+                static_cast<unsigned long long>(clients), threads,
+                elapsed.count() * 1e9 * threads / total, 100.0 * limited / total,
+                static_cast<unsigned long long>(evictions.load()));
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    std::uint64_t requests = argc > 1 ? std::stoull(argv[1]) : 4000000;
+    unsigned threads = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 1;
+    std::size_t capacity = argc > 3 ? std::stoull(argv[3]) : RateLimitOptions{}.capacity;
+
+    for (std::uint64_t clients : {1ull, 1000ull, 100000ull, 1000000ull, 4000000ull}) {
+        // Fresh buckets for every scenario.
+        RateLimitOptions options;
+        options.requestsPerSecond = 100;
+        options.burst = 20;
+        options.capacity = capacity;
+        RateLimiter::instance().setOptions(options);
+        bench(clients, requests, threads);
+    }
+    return 0;
+}
@@ -1,51 +1,281 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <string_view>
 #include <thread>
+#include <utility>
+#include <vector>
 
+#include "AccessLog.h"
+#include "Admission.h"
 #include "AsioCoroutineUtil.h"
 #include "Connection.h"
 #include "IoContextPool.h"
 #include "Lazy.h"
+#include "Listener.h"
+#include "Metrics.h"
+#include "RateLimit.h"
+#include "ServerOptions.h"
 #include "SyncAwait.h"
+#include "Upgrade.h"
 
 using namespace boost::asio::ip;
+namespace asio = boost::asio;
 
 class Server {
 public:
-    Server(IoContextPool& pool, unsigned short port)
-        : _pool(pool), _port(port), _executor(pool.getIoContext()) {}
+    Server(IoContextPool& pool, unsigned short port, ServerOptions options = {})
+        : _pool(pool),
+          _port(port),
+          _options(std::move(options)),
+          _ioContext(pool.getIoContext()),
+          _executor(_ioContext) {
+        if (!_options.accessLog.path.empty()) AccessLog::instance().start(_options.accessLog);
+        Admission::instance().setOptions(_options.admission);
+        RateLimiter::instance().setOptions(_options.rateLimit);
+        OpenFileCache::instance().setOptions(_options.openFileCache);
+        FileIo::instance().setOptions(_options.fileIo);
+        Tracer::instance().setOptions(_options.trace);
+        RunBudget::instance().setOptions(_options.fairness);
+        PriorityLanes::setWeights(_options.lanes.weights);
+        ResponseCache::instance().setOptions(_options.proxy.cache);
+        DnsCache::instance().setOptions(_options.dns);
+        if (_options.tls.port != 0) _tls = std::make_unique<TlsContext>(_options.tls);
+    }
 
+    /// Serve until the listeners are taken over by another process and the connections drained.
     Lazy<void> start() {
-        tcp::acceptor acceptor(_pool.getIoContext(), tcp::endpoint(tcp::v4(), _port));
+        openListeners();
+        if (_adminListener) acceptLoop(*_adminListener, true).via(&_executor).detach();
+        if (_tlsListener) acceptLoop(*_tlsListener, false, _tls.get()).via(&_executor).detach();
+        if (!_options.upgradeSocketPath.empty()) upgradeLoop().via(&_executor).detach();
+        // Accepting, the handoff and the shutdown all happen on the thread of '_ioContext'.
+        co_await acceptLoop(*_listener, false).via(&_executor);
+        co_await drain();
+        _pool.stop();
+    }
+
+private:
+    /// Inherit the listeners of a running process if there is one, bind new ones otherwise.
+    void openListeners() {
+        std::vector<int> inherited;
+        if (!_options.upgradeSocketPath.empty()) {
+            if (int control = Upgrade::connectControl(_options.upgradeSocketPath); control >= 0) {
+                inherited = Upgrade::receiveFds(control);
+                ::close(control);
+            }
+        }
+        auto open = [this, &inherited](unsigned short port) {
+            for (int& fd : inherited) {
+                if (fd >= 0 && Upgrade::localPort(fd) == port) {
+                    return std::make_unique<Listener>(_ioContext, std::exchange(fd, -1),
+                                                      _options.listener);
+                }
+            }
+            return std::make_unique<Listener>(_ioContext, port, _options.listener);
+        };
+        _listener = open(_port);
+        if (_options.adminPort != 0) _adminListener = open(_options.adminPort);
+        if (_tls) _tlsListener = open(_options.tls.port);
+        for (int fd : inherited) {
+            if (fd >= 0) ::close(fd);
+        }
+    }
+
+    /// Connections accepted with 'tls' start with a handshake.
+    Lazy<void> acceptLoop(Listener& listener, bool admin, TlsContext* tls = nullptr) {
+        std::vector<int> fds;
         while (true) {
-            tcp::socket socket(_pool.getIoContext());
-            if (auto err = co_await asyncAccept(acceptor, socket); err) {
-                std::cerr << "Accept failed, error message: " << err.message() << std::endl;
+            if (!admin && co_await pauseAtConnectionCap()) co_return;
+            fds.clear();
+            if (auto err = co_await listener.acceptBatch(fds); err) {
+                if (_stopping) co_return;
+                AccessLog::instance().logError(nullptr, err, "accept");
                 continue;
             }
-            std::cout << "A HTTP request coming...\n";
-            // Construct connection to handle request and respond.
-            startOne(std::move(socket)).via(&_executor).detach();
+            Metrics::local().accepts.add(fds.size());
+            dispatch(fds, admin, tls);
         }
     }
 
-    Lazy<void> startOne(tcp::socket socket) {
-        Connection con(std::move(socket), "./");
-        co_await con.start();
+    /// With AdmissionOptions::pauseAccepting, wait while the connection cap is reached. New
+    /// connections queue up in the listen backlog meanwhile. Returns whether the server stopped.
+    Lazy<bool> pauseAtConnectionCap() {
+        auto& admission = Admission::instance();
+        if (!admission.options().pauseAccepting || !admission.atConnectionCap()) {
+            co_return _stopping;
+        }
+        Metrics::local().acceptPauses.add();
+        asio::steady_timer timer(_ioContext);
+        while (admission.atConnectionCap() && !_stopping) {
+            timer.expires_after(std::chrono::milliseconds(5));
+            co_await asyncWait(timer);
+        }
+        co_return _stopping;
+    }
+
+    /// Hand the listeners to the first process that connects to the upgrade socket, then stop.
+    Lazy<void> upgradeLoop() {
+        using Local = asio::local::stream_protocol;
+        // A previous process may still run, but it already handed its listeners over to us.
+        ::unlink(_options.upgradeSocketPath.c_str());
+        Local::acceptor control(_ioContext, Local::endpoint(_options.upgradeSocketPath));
+        control.non_blocking(true);
+        while (true) {
+            if (auto err = co_await asyncWaitReadable(control); err) co_return;
+            boost::system::error_code ec;
+            Local::socket peer(_ioContext);
+            if (control.accept(peer, ec); ec) continue;
+
+            std::vector<int> fds{_listener->acceptor().native_handle()};
+            if (_adminListener) fds.push_back(_adminListener->acceptor().native_handle());
+            if (_tlsListener) fds.push_back(_tlsListener->acceptor().native_handle());
+            try {
+                Upgrade::sendFds(peer.native_handle(), fds);
+            } catch (std::system_error& e) {
+                AccessLog::instance().logError(nullptr, e.code(), "upgrade");
+                continue;
+            }
+            stop();
+            co_return;
+        }
+    }
+
+    /// Stop accepting and let every connection close after its current request.
+    void stop() {
+        _stopping = true;
+        _listener->close();
+        if (_adminListener) _adminListener->close();
+        if (_tlsListener) _tlsListener->close();
+        Connection::startDraining();
+        _pool.forEach([](asio::io_context& ioContext) {
+            asio::post(ioContext, [] { Connection::closeIdle(); });
+        });
+    }
+
+    /// Wait until all connections are closed or the drain timeout expired.
+    Lazy<void> drain() {
+        auto deadline = std::chrono::steady_clock::now() + _options.drainTimeout;
+        asio::steady_timer timer(_ioContext);
+        while (Metrics::instance().activeConnections() > 0 &&
+               std::chrono::steady_clock::now() < deadline) {
+            timer.expires_after(std::chrono::milliseconds(20));
+            co_await asyncWait(timer);
+        }
+    }
+
+    /// Spread a batch of accepted connections over the io_contexts with one post per context.
+    /// Each connection then runs entirely on the io_context its socket belongs to.
+    void dispatch(const std::vector<int>& fds, bool admin, TlsContext* tls) {
+        auto acceptedAt = std::chrono::steady_clock::now();
+        std::vector<std::pair<asio::io_context*, std::vector<int>>> batches;
+        for (int fd : fds) {
+            // Over the cap the connection is answered right here and never costs a coroutine.
+            if (!admin && !Admission::instance().tryAcquireConnection()) {
+                Admission::instance().rejectConnection(fd);
+                continue;
+            }
+            auto* ioContext = &_pool.getIoContext();
+            auto it = std::ranges::find(batches, ioContext, &decltype(batches)::value_type::first);
+            if (it == batches.end()) it = batches.insert(batches.end(), {ioContext, {}});
+            it->second.push_back(fd);
+        }
+        for (auto& [ioContext, batch] : batches) {
+            asio::post(*ioContext, [this, ioContext, batch = std::move(batch), admin, acceptedAt,
+                                    tls] {
+                for (int fd : batch) {
+                    boost::system::error_code ec;
+                    tcp::socket socket(*ioContext);
+                    if (socket.assign(tcp::v4(), fd, ec); ec) {
+                        ::close(fd);
+                        if (!admin) Admission::instance().releaseConnection();
+                        continue;
+                    }
+                    // Construct connection to handle request and respond.
+                    startOne(std::move(socket), admin, acceptedAt, tls).start([](auto&& t) {
+                        if (t.hasError()) std::rethrow_exception(t.getException());
+                    });
+                }
+            });
+        }
+    }
+
+    Lazy<void> startOne(tcp::socket socket, bool admin,
+                        std::chrono::steady_clock::time_point acceptedAt, TlsContext* tls) {
+        {
+            Connection con(std::move(socket), _options, admin, acceptedAt, tls);
+            co_await con.start();
+        }
+        if (!admin) Admission::instance().releaseConnection();
     }
 
 private:
     IoContextPool& _pool;
     unsigned short _port;
+    ServerOptions _options;
+    asio::io_context& _ioContext;
     AsioExecutor _executor;
+    std::unique_ptr<Listener> _listener;
+    std::unique_ptr<Listener> _adminListener;
+    std::unique_ptr<TlsContext> _tls;
+    std::unique_ptr<Listener> _tlsListener;
+    bool _stopping = false;
 };
 
 int main() {
     try {
         IoContextPool pool(10);
         std::thread t([&pool] { pool.run(); });
-        Server server(pool, 2333);
+        ServerOptions options;
+        options.accessLog.path = "access.log";
+        options.listener.deferAcceptSeconds = 1;
+        options.listener.fastOpenQueueLength = 256;
+        // Starting a second instance takes over the listeners and retires this one.
+        options.upgradeSocketPath = "upgrade.sock";
+        // A comma separated list of "host:port" turns requests under /api/ into proxied ones.
+        if (const char* upstreams = std::getenv("TINY_HTTP_SERVER_UPSTREAMS")) {
+            options.proxy.pathPrefix = "/api/";
+            std::string_view list = upstreams;
+            while (!list.empty()) {
+                auto comma = list.find(',');
+                options.proxy.upstreams.emplace_back(list.substr(0, comma));
+                list = comma == std::string_view::npos ? "" : list.substr(comma + 1);
+            }
+        }
+        // Proxied responses are cached for the given milliseconds unless they say otherwise.
+        if (const char* cacheMs = std::getenv("TINY_HTTP_SERVER_PROXY_CACHE_MS")) {
+            options.proxy.cache.ttl = std::chrono::milliseconds(std::stoul(cacheMs));
+        }
+        // A certificate chain and key in PEM files enable HTTPS on port 2334.
+        const char* certificate = std::getenv("TINY_HTTP_SERVER_TLS_CERT");
+        const char* key = std::getenv("TINY_HTTP_SERVER_TLS_KEY");
+        if (certificate && key) {
+            options.tls.port = 2334;
+            options.tls.certificateChainFile = certificate;
+            options.tls.privateKeyFile = key;
+        }
+        // Traces of 1 of every N requests are exported on /debug/trace, and requests slower than
+        // the given milliseconds log where their time went.
+        if (const char* every = std::getenv("TINY_HTTP_SERVER_TRACE_EVERY")) {
+            options.trace.sampleEvery = static_cast<std::uint32_t>(std::stoul(every));
+        }
+        if (const char* slow = std::getenv("TINY_HTTP_SERVER_SLOW_REQUEST_MS")) {
+            options.trace.slowThreshold = std::chrono::milliseconds(std::stoul(slow));
+        }
+        options.webSocketRoutes["/echo"] = [](WebSocket& ws) -> Lazy<void> {
+            while (true) {
+                auto [err, message] = co_await ws.read();
+                if (err) co_return;
+                if (co_await ws.write(message.payload, message.opcode)) co_return;
+            }
+        };
+        Server server(pool, 2333, std::move(options));
         syncAwait(server.start());
         t.join();
+        AccessLog::instance().stop();
     } catch (std::exception& e) {
         std::cerr << "Exception: " << e.what() << "\n";
     }
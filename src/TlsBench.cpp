@@ -0,0 +1,197 @@
+// Measures TLS handshake throughput of the server side session, full against resumed.
+// A throwaway P-256 certificate is generated, the server runs TlsSession on io threads like
+// Connection does, and blocking OpenSSL clients connect over loopback as fast as they can.
+// Resumed clients offer the session of their previous handshake, by ticket or by session id
+// looked up in the server's cache.
+//
+// Usage: TinyHttpTlsBench [handshakes per scenario] [client threads] [io threads]
+
+#include <netinet/in.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "AsioCoroutineUtil.h"
+#include "Lazy.h"
+#include "Tls.h"
+
+using namespace boost;
+using asio::ip::tcp;
+
+namespace {
+
+struct Scenario {
+    const char* name;
+    int version;
+    bool resume;
+    bool tickets;
+};
+
+constexpr Scenario kScenarios[] = {
+    {"TLS 1.3 full", TLS1_3_VERSION, false, true},
+    {"TLS 1.3 resumed, ticket", TLS1_3_VERSION, true, true},
+    {"TLS 1.3 resumed, cache", TLS1_3_VERSION, true, false},
+    {"TLS 1.2 full", TLS1_2_VERSION, false, true},
+    {"TLS 1.2 resumed, ticket", TLS1_2_VERSION, true, true},
+    {"TLS 1.2 resumed, cache", TLS1_2_VERSION, true, false},
+};
+
+/// Write a self-signed P-256 certificate and its key as PEM files.
+void writeCertificate(const std::string& certificateFile, const std::string& keyFile) {
+    EVP_PKEY* key = EVP_EC_gen("P-256");
+    X509* certificate = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+    X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+    X509_gmtime_adj(X509_getm_notAfter(certificate), 24 * 3600);
+    X509_set_pubkey(certificate, key);
+    X509_NAME* name = X509_get_subject_name(certificate);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+    X509_set_issuer_name(certificate, name);
+    X509_sign(certificate, key, EVP_sha256());
+
+    FILE* file = std::fopen(certificateFile.c_str(), "w");
+    PEM_write_X509(file, certificate);
+    std::fclose(file);
+    file = std::fopen(keyFile.c_str(), "w");
+    PEM_write_PrivateKey(file, key, nullptr, nullptr, 0, nullptr, nullptr);
+    std::fclose(file);
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+}
+
+Lazy<void> serve(tcp::socket socket, TlsContext& context) {
+    TlsSession tls(context, socket);
+    if (co_await tls.handshake()) co_return;
+    // Reading the byte makes clients process what came after the handshake, which is where
+    // TLS 1.3 delivers its tickets.
+    co_await tls.write(asio::buffer("x", 1));
+}
+
+Lazy<void> acceptLoop(tcp::acceptor& acceptor, std::vector<asio::io_context*>& contexts,
+                      std::vector<std::unique_ptr<AsioExecutor>>& executors,
+                      TlsContext& context) {
+    for (std::size_t next = 0;; ++next) {
+        std::size_t i = next % contexts.size();
+        tcp::socket socket(*contexts[i]);
+        if (auto err = co_await asyncAccept(acceptor, socket); err) co_return;
+        serve(std::move(socket), context).via(executors[i].get()).detach();
+    }
+}
+
+/// Blocking client doing 'count' handshakes, returns how many of them were resumed.
+std::uint64_t runClient(unsigned short port, const Scenario& scenario, std::uint64_t count) {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_min_proto_version(ctx, scenario.version);
+    SSL_CTX_set_max_proto_version(ctx, scenario.version);
+    if (!scenario.tickets) SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    std::uint64_t resumed = 0;
+    SSL_SESSION* session = nullptr;
+    for (std::uint64_t i = 0; i < count; ++i) {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) break;
+        SSL* ssl = SSL_new(ctx);
+        SSL_set_fd(ssl, fd);
+        if (session) SSL_set_session(ssl, session);
+        char byte;
+        if (SSL_connect(ssl) == 1 && SSL_read(ssl, &byte, 1) == 1) {
+            resumed += static_cast<std::uint64_t>(SSL_session_reused(ssl));
+            // Sessions from the server's cache are single use with TLS 1.3, take the new one.
+            if (scenario.resume) {
+                SSL_SESSION_free(session);
+                session = SSL_get1_session(ssl);
+            }
+        }
+        // Without a shutdown, OpenSSL takes the session as broken and no longer resumes it.
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        ::close(fd);
+    }
+    SSL_SESSION_free(session);
+    SSL_CTX_free(ctx);
+    return resumed;
+}
+
+void runScenario(const Scenario& scenario, unsigned short port, std::uint64_t handshakes,
+                 unsigned clients) {
+    std::atomic<std::uint64_t> resumed{0};
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < clients; ++i) {
+        workers.emplace_back([&] { resumed += runClient(port, scenario, handshakes / clients); });
+    }
+    for (auto& t : workers) t.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    auto total = handshakes / clients * clients;
+    std::printf("%-24s handshakes/s: %8.0f  mean: %7.1f us  resumed: %5.1f%%\n", scenario.name,
+                static_cast<double>(total) / elapsed.count(),
+                elapsed.count() * 1e6 * clients / static_cast<double>(total),
+                100.0 * static_cast<double>(resumed.load()) / static_cast<double>(total));
+    std::fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    std::uint64_t handshakes = argc > 1 ? std::stoull(argv[1]) : 2000;
+    unsigned clients = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 2;
+    std::size_t threads = argc > 3 ? std::stoul(argv[3]) : 2;
+
+    auto directory = std::filesystem::temp_directory_path();
+    auto suffix = std::to_string(::getpid());
+    TlsOptions options;
+    options.certificateChainFile = (directory / ("tls-bench-cert-" + suffix + ".pem")).string();
+    options.privateKeyFile = (directory / ("tls-bench-key-" + suffix + ".pem")).string();
+    writeCertificate(options.certificateChainFile, options.privateKeyFile);
+
+    try {
+        TlsContext context(options);
+        std::filesystem::remove(options.certificateChainFile);
+        std::filesystem::remove(options.privateKeyFile);
+
+        std::vector<std::unique_ptr<asio::io_context>> owned;
+        std::vector<asio::io_context*> contexts;
+        std::vector<std::unique_ptr<AsioExecutor>> executors;
+        std::vector<asio::io_context::work> works;
+        std::vector<std::thread> ioThreads;
+        for (std::size_t i = 0; i < threads; ++i) {
+            owned.push_back(std::make_unique<asio::io_context>());
+            contexts.push_back(owned.back().get());
+            executors.push_back(std::make_unique<AsioExecutor>(*contexts.back()));
+            works.emplace_back(*contexts.back());
+        }
+        tcp::acceptor acceptor(*contexts[0], tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+        auto port = acceptor.local_endpoint().port();
+        for (auto* ctx : contexts) ioThreads.emplace_back([ctx] { ctx->run(); });
+        acceptLoop(acceptor, contexts, executors, context).via(executors[0].get()).detach();
+
+        for (const auto& scenario : kScenarios) runScenario(scenario, port, handshakes, clients);
+
+        for (auto* ctx : contexts) ctx->stop();
+        for (auto& t : ioThreads) t.join();
+    } catch (std::exception& e) {
+        std::cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
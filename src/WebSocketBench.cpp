@@ -0,0 +1,198 @@
+// Measures the WebSocket hot paths.
+// First the unmasking variants are timed on an in-memory buffer, then an echo server running on
+// a single io thread is driven by a forked client process that keeps a window of masked frames in
+// flight on every connection; the echoed messages per second are what one core sustains.
+//
+// Usage: TinyHttpWsBench [connections] [seconds] [payload bytes] [window]
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "AsioCoroutineUtil.h"
+#include "Connection.h"
+#include "Lazy.h"
+#include "WebSocket.h"
+
+using namespace boost;
+using asio::ip::tcp;
+
+namespace {
+
+void benchUnmask(const char* name, WebSocketMask::UnmaskFunction function) {
+    constexpr std::size_t kSize = 1 << 20;
+    constexpr int kRounds = 2000;
+    std::vector<char> data(kSize, 'x');
+    std::array<std::uint8_t, 4> key{0x37, 0xfa, 0x21, 0x3d};
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kRounds; ++i) function(data.data(), data.size(), key, i);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    // Read the buffer so the loop cannot be dropped.
+    volatile char sink = data[kSize / 2];
+    (void)sink;
+    std::printf("unmask %-6s %8.2f GB/s\n", name,
+                static_cast<double>(kSize) * kRounds / elapsed.count() / 1e9);
+}
+
+/// A masked client frame carrying 'payloadSize' bytes.
+std::string maskedFrame(std::size_t payloadSize) {
+    std::string frame;
+    frame += static_cast<char>(0x82);
+    if (payloadSize < 126) {
+        frame += static_cast<char>(0x80 | payloadSize);
+    } else {
+        frame += static_cast<char>(0x80 | 126);
+        frame += static_cast<char>(payloadSize >> 8);
+        frame += static_cast<char>(payloadSize & 0xff);
+    }
+    std::array<std::uint8_t, 4> key{0x12, 0x34, 0x56, 0x78};
+    frame.append(key.begin(), key.end());
+    std::string payload(payloadSize, 'p');
+    WebSocketMask::unmaskScalar(payload.data(), payload.size(), key, 0);
+    return frame + payload;
+}
+
+/// Blocking client keeping 'window' messages in flight, returns the number of echoed messages.
+std::uint64_t runClient(unsigned short port, std::size_t payloadSize, std::size_t window,
+                        std::chrono::steady_clock::time_point deadline) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) return 0;
+    // Small frames must not wait for the acknowledgement of the previous ones.
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    std::string_view handshake =
+        "GET /echo HTTP/1.1\r\nHost: bench\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+    if (::send(fd, handshake.data(), handshake.size(), MSG_NOSIGNAL) < 0) return 0;
+    std::string head;
+    char buf[65536];
+    while (head.find("\r\n\r\n") == std::string::npos) {
+        auto n = ::recv(fd, buf, 1, 0);
+        if (n <= 0) return 0;
+        head.append(buf, 1);
+    }
+
+    auto frame = maskedFrame(payloadSize);
+    std::size_t echoSize = payloadSize + (payloadSize < 126 ? 2 : 4);
+    std::string batch;
+    for (std::size_t i = 0; i < window; ++i) batch += frame;
+    if (::send(fd, batch.data(), batch.size(), MSG_NOSIGNAL) < 0) return 0;
+
+    std::uint64_t messages = 0;
+    std::size_t partial = 0;
+    while (std::chrono::steady_clock::now() < deadline) {
+        auto n = ::recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) break;
+        partial += static_cast<std::size_t>(n);
+        std::size_t completed = partial / echoSize;
+        partial %= echoSize;
+        messages += completed;
+        if (completed == 0) continue;
+        // Refill the window with as many frames as were echoed.
+        if (::send(fd, batch.data(), frame.size() * completed, MSG_NOSIGNAL) < 0) break;
+    }
+    ::close(fd);
+    return messages;
+}
+
+Lazy<void> serve(tcp::socket socket, const ServerOptions& options) {
+    Connection con(std::move(socket), options);
+    co_await con.start();
+}
+
+Lazy<void> acceptLoop(tcp::acceptor& acceptor, asio::io_context& ioContext,
+                      AsioExecutor& executor, const ServerOptions& options) {
+    while (true) {
+        tcp::socket socket(ioContext);
+        if (auto err = co_await asyncAccept(acceptor, socket); err) co_return;
+        socket.set_option(tcp::no_delay(true));
+        serve(std::move(socket), options).via(&executor).detach();
+    }
+}
+
+void benchEcho(std::size_t connections, int seconds, std::size_t payloadSize,
+               std::size_t window) {
+    asio::io_context ioContext;
+    tcp::acceptor acceptor(ioContext, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    auto port = acceptor.local_endpoint().port();
+
+    int pipeFds[2];
+    if (::pipe(pipeFds) != 0) throw std::system_error(errno, std::generic_category());
+    pid_t client = ::fork();
+    if (client == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+        std::atomic<std::uint64_t> total{0};
+        std::vector<std::thread> workers;
+        for (std::size_t i = 0; i < connections; ++i) {
+            workers.emplace_back(
+                [&] { total += runClient(port, payloadSize, window, deadline); });
+        }
+        for (auto& t : workers) t.join();
+        std::uint64_t value = total;
+        [[maybe_unused]] auto n = ::write(pipeFds[1], &value, sizeof(value));
+        ::_exit(0);
+    }
+
+    ServerOptions options;
+    options.webSocketRoutes["/echo"] = [](WebSocket& ws) -> Lazy<void> {
+        while (true) {
+            auto [err, message] = co_await ws.read();
+            if (err) co_return;
+            if (co_await ws.write(message.payload, message.opcode)) co_return;
+        }
+    };
+    AsioExecutor executor(ioContext);
+    asio::io_context::work work(ioContext);
+    std::thread ioThread([&ioContext] { ioContext.run(); });
+    acceptLoop(acceptor, ioContext, executor, options).via(&executor).detach();
+
+    std::uint64_t messages = 0;
+    [[maybe_unused]] auto n = ::read(pipeFds[0], &messages, sizeof(messages));
+    ::waitpid(client, nullptr, 0);
+    ioContext.stop();
+    ioThread.join();
+
+    std::printf("echo %zu x %zu bytes, window %zu: %10.0f messages/s on one io thread\n",
+                connections, payloadSize, window, static_cast<double>(messages) / seconds);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    std::size_t connections = argc > 1 ? std::stoul(argv[1]) : 16;
+    int seconds = argc > 2 ? std::stoi(argv[2]) : 3;
+    std::size_t payloadSize = argc > 3 ? std::stoul(argv[3]) : 128;
+    std::size_t window = argc > 4 ? std::stoul(argv[4]) : 16;
+    if (payloadSize > 0xffff) payloadSize = 0xffff;
+
+    benchUnmask("scalar", WebSocketMask::unmaskScalar);
+#if defined(__x86_64__) || defined(__i386__)
+    benchUnmask("sse2", WebSocketMask::unmaskSse2);
+    if (__builtin_cpu_supports("avx2")) benchUnmask("avx2", WebSocketMask::unmaskAvx2);
+#endif
+
+    try {
+        benchEcho(connections, seconds, payloadSize, window);
+    } catch (std::exception& e) {
+        std::cerr << "Exception: " << e.what() << "\n";
+    }
+    return 0;
+}